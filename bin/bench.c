@@ -0,0 +1,395 @@
+// Microbenchmarks of the per-frame kernels, on synthetic frames so no Kinect is needed.
+#define _GNU_SOURCE // for CPU_SETSIZE, it has to come before any system header
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <getopt.h>
+
+#include <freenect_internal.h>
+#include <cameras.h>
+#include <registration.h>
+#include <cubic_internal.h>
+
+#define BENCH_WIDTH (640)
+#define BENCH_HEIGHT (480)
+#define BENCH_PIXELS (BENCH_WIDTH * BENCH_HEIGHT)
+
+typedef struct {
+	const char* name;
+	void (*run)(void);
+	double pixels; // per run, for ns / pixel
+	double bytes; // read and written per run, for GB/s
+} bench_t;
+
+static uint8_t* packed11;
+static uint8_t* packed10;
+static uint8_t* bayer;
+static uint8_t* uyvy;
+static uint16_t* unpacked;
+static uint16_t* depth_mm;
+static uint8_t* rgb;
+static uint32_t* cube;
+static cubic_mask_t mask;
+static size_t cube_dims[3] = {
+	128, 64, 128
+};
+static freenect_device device;
+static volatile uint64_t sink; // keeps results alive
+
+// fixed seed, so every run measures the same frames
+static uint32_t bench_state = 0x9e3779b9;
+
+static uint32_t bench_random(void)
+{
+	bench_state ^= bench_state << 13;
+	bench_state ^= bench_state >> 17;
+	bench_state ^= bench_state << 5;
+	return bench_state;
+}
+
+static void bench_pack(uint8_t* packed, int bits, uint16_t lo, uint16_t hi)
+{
+	int i;
+	uint64_t acc = 0;
+	int filled = 0;
+	for (i = 0; i < BENCH_PIXELS; i++)
+	{
+		uint16_t value = lo + bench_random() % (hi - lo);
+		acc = (acc << bits) | value;
+		filled += bits;
+		while (filled >= 8)
+		{
+			*packed++ = (uint8_t)(acc >> (filled - 8));
+			filled -= 8;
+		}
+	}
+}
+
+static void bench_setup(void)
+{
+	int i;
+	packed11 = (uint8_t*)malloc(BENCH_PIXELS * 11 / 8);
+	packed10 = (uint8_t*)malloc(BENCH_PIXELS * 10 / 8);
+	bayer = (uint8_t*)malloc(BENCH_PIXELS);
+	uyvy = (uint8_t*)malloc(BENCH_PIXELS * 2);
+	unpacked = (uint16_t*)malloc(BENCH_PIXELS * sizeof(uint16_t));
+	depth_mm = (uint16_t*)malloc(BENCH_PIXELS * sizeof(uint16_t));
+	rgb = (uint8_t*)malloc(BENCH_PIXELS * 3);
+	cube = (uint32_t*)malloc(sizeof(uint32_t) * cube_dims[0] * cube_dims[1] * cube_dims[2]);
+	mask.ranges = (cubic_range_t*)malloc(sizeof(cubic_range_t) * BENCH_PIXELS);
+	mask.spans = (cubic_span_t*)malloc(sizeof(cubic_span_t) * BENCH_HEIGHT);
+	mask.ref_pix_size = 0.1042;
+	mask.ref_distance = 120;
+	// raw disparities of a room, roughly 0.5 to 4 meters
+	bench_pack(packed11, 11, 400, 1050);
+	bench_pack(packed10, 10, 0, 1024);
+	for (i = 0; i < BENCH_PIXELS; i++)
+		bayer[i] = bench_random();
+	for (i = 0; i < BENCH_PIXELS * 2; i++)
+		uyvy[i] = bench_random();
+	// 5% of pixels without a reading, like shadows behind edges
+	for (i = 0; i < BENCH_PIXELS; i++)
+		depth_mm[i] = bench_random() % 20 ? 500 + bench_random() % 3500 : 0;
+	// calibration of a typical device, the table contents don't change the kernels' cost much
+	freenect_registration* reg = &device.registration;
+	memset(reg, 0, sizeof(freenect_registration));
+	reg->zero_plane_info.dcmos_emitter_dist = 7.5;
+	reg->zero_plane_info.dcmos_rcmos_dist = 2.4;
+	reg->zero_plane_info.reference_distance = 120;
+	reg->zero_plane_info.reference_pixel_size = 0.1042;
+	reg->const_shift = 200;
+	reg->raw_to_mm_shift = (uint16_t*)malloc(sizeof(uint16_t) * FREENECT_DEPTH_RAW_MAX_VALUE);
+	reg->depth_to_rgb_shift = (int32_t*)malloc(sizeof(int32_t) * FREENECT_DEPTH_MM_MAX_VALUE);
+	reg->registration_table = (int32_t (*)[2])malloc(sizeof(int32_t) * BENCH_PIXELS * 2);
+	complete_tables(reg);
+}
+
+static void bench_packed11(void)
+{
+	convert_packed11_to_16bit(packed11, unpacked, BENCH_PIXELS);
+}
+
+static void bench_packed10(void)
+{
+	convert_packed_to_16bit(packed10, unpacked, 10, BENCH_PIXELS);
+}
+
+static void bench_depth_to_mm(void)
+{
+	freenect_apply_depth_to_mm(&device, packed11, unpacked);
+}
+
+static void bench_registration(void)
+{
+	freenect_apply_registration(&device, packed11, unpacked);
+}
+
+static void bench_bayer(void)
+{
+	convert_bayer_to_rgb(bayer, rgb, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_RGB));
+}
+
+static void bench_uyvy(void)
+{
+	convert_uyvy_to_rgb(uyvy, rgb, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_YUV_RGB));
+}
+
+static void bench_complete_tables(void)
+{
+	complete_tables(&device.registration);
+}
+
+static void bench_depth_to_cube(void)
+{
+	cubic_transform_t transform;
+	memset(&transform, 0, sizeof(transform));
+	transform.m00 = transform.m11 = transform.m22 = 1;
+	memset(cube, 0, sizeof(uint32_t) * cube_dims[0] * cube_dims[1] * cube_dims[2]);
+	sink += cubic_depth_rows_to_cube(depth_mm, 0, BENCH_HEIGHT, 1, 0, 50, cube_dims, 0.1042, 120, transform, cube, 0);
+}
+
+// a third of the way out along x, so a good part of the frame can't land in the cube
+static cubic_transform_t bench_offset(void)
+{
+	cubic_transform_t transform;
+	memset(&transform, 0, sizeof(transform));
+	transform.m00 = transform.m11 = transform.m22 = 1;
+	transform.m03 = cube_dims[0] * 50 / 3;
+	return transform;
+}
+
+static void bench_depth_to_cube_offset(void)
+{
+	memset(cube, 0, sizeof(uint32_t) * cube_dims[0] * cube_dims[1] * cube_dims[2]);
+	sink += cubic_depth_rows_to_cube(depth_mm, 0, BENCH_HEIGHT, 1, 0, 50, cube_dims, 0.1042, 120, bench_offset(), cube, 0);
+}
+
+static void bench_mask_rows(void)
+{
+	cubic_mask_rows(&mask, 0, BENCH_HEIGHT, 50, cube_dims, bench_offset());
+}
+
+static void bench_depth_to_cube_masked(void)
+{
+	// built once, in the warmup, as fusion does until the transform moves
+	if (!mask.version)
+	{
+		bench_mask_rows();
+		mask.version = 1;
+	}
+	memset(cube, 0, sizeof(uint32_t) * cube_dims[0] * cube_dims[1] * cube_dims[2]);
+	sink += cubic_depth_rows_to_cube(depth_mm, 0, BENCH_HEIGHT, 1, &mask, 50, cube_dims, 0.1042, 120, bench_offset(), cube, 0);
+}
+
+static bench_t benches[] = {
+	{"convert_packed11_to_16bit", bench_packed11, BENCH_PIXELS, BENCH_PIXELS * (11.0 / 8 + 2)},
+	{"convert_packed_to_16bit", bench_packed10, BENCH_PIXELS, BENCH_PIXELS * (10.0 / 8 + 2)},
+	{"freenect_apply_depth_to_mm", bench_depth_to_mm, BENCH_PIXELS, BENCH_PIXELS * (11.0 / 8 + 2)},
+	{"freenect_apply_registration", bench_registration, BENCH_PIXELS, BENCH_PIXELS * (11.0 / 8 + 2)},
+	{"convert_bayer_to_rgb", bench_bayer, BENCH_PIXELS, BENCH_PIXELS * (1 + 3)},
+	{"convert_uyvy_to_rgb", bench_uyvy, BENCH_PIXELS, BENCH_PIXELS * (2 + 3)},
+	{"complete_tables", bench_complete_tables, BENCH_PIXELS, FREENECT_DEPTH_RAW_MAX_VALUE * 2 + FREENECT_DEPTH_MM_MAX_VALUE * 4 + BENCH_PIXELS * 8},
+	{"cubic_depth_to_cube", bench_depth_to_cube, BENCH_PIXELS, BENCH_PIXELS * 2},
+	{"cubic_depth_to_cube_offset", bench_depth_to_cube_offset, BENCH_PIXELS, BENCH_PIXELS * 2},
+	{"cubic_mask_rows", bench_mask_rows, BENCH_PIXELS, BENCH_PIXELS * 4},
+	{"cubic_depth_to_cube_masked", bench_depth_to_cube_masked, BENCH_PIXELS, BENCH_PIXELS * 6},
+};
+
+static double bench_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int bench_compare(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static volatile int bench_loaded;
+
+// a background workload that never sleeps, for the scheduler to preempt the library's threads with
+static void* bench_load(void* data)
+{
+	uint64_t spins = 0;
+	while (bench_loaded)
+		++spins;
+	sink += spins;
+	return 0;
+}
+
+static void bench_ready(cubic_t* cubic)
+{
+}
+
+// comma-separated cpus, returns how many
+static int bench_cpus(char* list, int* cpus, int max)
+{
+	int count = 0;
+	char* cpu;
+	for (cpu = strtok(list, ","); cpu && count < max; cpu = strtok(0, ","))
+		cpus[count++] = atoi(cpu);
+	return count;
+}
+
+// fuses virtual devices live for a while, to see how late the compute thread wakes up and how many cycles run over
+static int bench_schedule(double seconds, int load, cubic_param_t params, int machine)
+{
+	int i;
+	int ids[3] = {0, 1, 2};
+	params.dims[0] = cube_dims[0];
+	params.dims[1] = cube_dims[1];
+	params.dims[2] = cube_dims[2];
+	params.resolution = 50;
+	params.refresh_rate = 30;
+	params.on_ready = bench_ready;
+	params.virtual_count = 3;
+	params.replay_speed = FREENECT_REPLAY_REALTIME;
+	pthread_t loads[load > 0 ? load : 1];
+	bench_loaded = 1;
+	for (i = 0; i < load; i++)
+		pthread_create(&loads[i], 0, bench_load, 0);
+	cubic_t* cubic = cubic_open(3, ids, params);
+	if (!cubic)
+	{
+		bench_loaded = 0;
+		for (i = 0; i < load; i++)
+			pthread_join(loads[i], 0);
+		fprintf(stderr, "cubic_open failed\n");
+		return -1;
+	}
+	usleep((useconds_t)(seconds * 1e6));
+	cubic_stats_t stats = cubic_get_stats(cubic, 0);
+	double total = cubic_get_latency(cubic, CUBIC_STAGE_TOTAL, 99);
+	bench_loaded = 0;
+	for (i = 0; i < load; i++)
+		pthread_join(loads[i], 0);
+	if (machine)
+		printf("{\"load\":%d,\"cycles\":%llu,\"deadline_misses\":%llu,\"wakeup_jitter_us\":%.1f,\"max_wakeup_jitter_us\":%.1f,\"p99_latency_ms\":%.2f,\"pin_failures\":%llu,\"skipped\":%llu,\"quality\":%d}\n",
+			load, (unsigned long long)stats.cycles, (unsigned long long)stats.deadline_misses, stats.wakeup_jitter * 1e6, stats.max_wakeup_jitter * 1e6, total * 1e3, (unsigned long long)stats.pin_failures, (unsigned long long)stats.skipped, stats.quality);
+	else {
+		printf("%d load threads, %llu cycles, %llu deadline misses\n", load, (unsigned long long)stats.cycles, (unsigned long long)stats.deadline_misses);
+		printf("wakeup jitter %.1f us average, %.1f us max, capture to delivered %.2f ms at p99\n", stats.wakeup_jitter * 1e6, stats.max_wakeup_jitter * 1e6, total * 1e3);
+		if (params.adaptive)
+			printf("%llu cycles skipped, ended at quality %d\n", (unsigned long long)stats.skipped, stats.quality);
+		if (stats.pin_failures > 0)
+			printf("%llu threads or buffers didn't get the cpus, priority or locked memory asked for\n", (unsigned long long)stats.pin_failures);
+	}
+	// the live threads don't stop, the process exits right after
+	cubic_close(cubic);
+	return 0;
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-w warmup] [-r repetitions] [-m] [name...]\n"
+		"       %s -j seconds [-l threads] [-e cpus] [-c cpus] [-p priority] [-k] [-a] [-m]\n"
+		"  -w  untimed runs before measuring, 10 by default\n"
+		"  -r  timed runs, 50 by default\n"
+		"  -m  machine-readable output, one JSON object per benchmark and line\n"
+		"  name  only run benchmarks whose name contains one of these\n"
+		"  -j  fuse three virtual devices live for this long instead, and report wakeup jitter and deadline misses\n"
+		"  -l  busy threads of background load meanwhile\n"
+		"  -e  comma-separated cpus to pin event threads to\n"
+		"  -c  comma-separated cpus to keep the compute thread and pool workers to\n"
+		"  -p  SCHED_FIFO priority of the compute thread and pool workers, event threads get one above\n"
+		"  -k  lock the library's buffers in memory\n"
+		"  -a  adaptive quality\n", name, name);
+}
+
+int main(int argc, char** argv)
+{
+	int warmup = 10, repetitions = 50, machine = 0, load = 0, priority = 0;
+	double seconds = 0;
+	int event_cpus[CPU_SETSIZE], compute_cpus[CPU_SETSIZE];
+	cubic_param_t params;
+	memset(&params, 0, sizeof(params));
+	int opt, i, j;
+	while ((opt = getopt(argc, argv, "w:r:mj:l:e:c:p:kah")) != -1)
+		switch (opt)
+		{
+			case 'j':
+				seconds = atof(optarg);
+				break;
+			case 'l':
+				load = atoi(optarg);
+				break;
+			case 'e':
+				params.event_cpus = event_cpus;
+				params.event_cpu_count = bench_cpus(optarg, event_cpus, CPU_SETSIZE);
+				break;
+			case 'c':
+				params.compute_cpus = params.pool_cpus = compute_cpus;
+				params.compute_cpu_count = params.pool_cpu_count = bench_cpus(optarg, compute_cpus, CPU_SETSIZE);
+				break;
+			case 'p':
+				priority = atoi(optarg);
+				break;
+			case 'k':
+				params.lock_memory = 1;
+				break;
+			case 'a':
+				params.adaptive = 1;
+				break;
+			case 'w':
+				warmup = atoi(optarg);
+				break;
+			case 'r':
+				repetitions = atoi(optarg);
+				break;
+			case 'm':
+				machine = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	if (seconds > 0)
+	{
+		params.compute_priority = params.pool_priority = priority;
+		params.event_priority = priority > 0 ? priority + 1 : 0;
+		return bench_schedule(seconds, load, params, machine) < 0 ? 1 : 0;
+	}
+	if (repetitions < 1)
+		repetitions = 1;
+	bench_setup();
+	if (!machine)
+		printf("%-28s %12s %12s %10s %8s\n", "benchmark", "median(us)", "min(us)", "ns/pixel", "GB/s");
+	double* samples = (double*)malloc(sizeof(double) * repetitions);
+	for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+	{
+		bench_t* bench = benches + i;
+		if (optind < argc)
+		{
+			for (j = optind; j < argc; j++)
+				if (strstr(bench->name, argv[j]))
+					break;
+			if (j == argc)
+				continue;
+		}
+		for (j = 0; j < warmup; j++)
+			bench->run();
+		for (j = 0; j < repetitions; j++)
+		{
+			double start = bench_time();
+			bench->run();
+			samples[j] = bench_time() - start;
+		}
+		qsort(samples, repetitions, sizeof(double), bench_compare);
+		double median = samples[repetitions / 2];
+		double ns_per_pixel = median / bench->pixels;
+		double gb_per_s = bench->bytes / median;
+		if (machine)
+			printf("{\"benchmark\":\"%s\",\"repetitions\":%d,\"warmup\":%d,\"pixels\":%.0f,\"bytes\":%.0f,\"median_ns\":%.0f,\"min_ns\":%.0f,\"max_ns\":%.0f,\"ns_per_pixel\":%.4f,\"gb_per_s\":%.4f}\n",
+				bench->name, repetitions, warmup, bench->pixels, bench->bytes, median, samples[0], samples[repetitions - 1], ns_per_pixel, gb_per_s);
+		else
+			printf("%-28s %12.1f %12.1f %10.3f %8.2f\n", bench->name, median * 1e-3, samples[0] * 1e-3, ns_per_pixel, gb_per_s);
+	}
+	free(samples);
+	return 0;
+}
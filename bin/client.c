@@ -0,0 +1,96 @@
+// Follows a cube stream served with cubic_param_t.serve_port and rebuilds the occupancy on this side.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <cubic.h>
+#include <delta.h>
+#include <snapshot.h>
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-n messages] [-o snapshot] [-q] host port\n"
+		"  -n  stop after this many messages, runs until the server goes away by default\n"
+		"  -o  write the rebuilt occupancy as a snapshot when done\n"
+		"  -q  no line per message, only the summary\n", name);
+}
+
+static double client_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv)
+{
+	int limit = 0, quiet = 0;
+	const char* output = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:o:qh")) != -1)
+		switch (opt)
+		{
+			case 'n':
+				limit = atoi(optarg);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	if (argc - optind != 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	delta_client_t* client = delta_client_connect(argv[optind], atoi(argv[optind + 1]));
+	if (!client)
+	{
+		fprintf(stderr, "%s:%s: can't connect\n", argv[optind], argv[optind + 1]);
+		return 1;
+	}
+	size_t dims[3];
+	double resolution;
+	uint32_t threshold;
+	delta_client_dims(client, dims, &resolution, &threshold);
+	if (!quiet)
+		printf("%zux%zux%zu at %g mm, occupied from %u hits\n", dims[0], dims[1], dims[2], resolution, threshold);
+	int messages = 0, keyframes = 0;
+	uint64_t bytes = 0, skipped = 0, last = 0;
+	double start = client_time();
+	delta_message_t message;
+	while ((limit == 0 || messages < limit) && delta_client_next(client, &message) == 0)
+	{
+		// versions the server left out for us are updates it dropped while we were behind
+		if (messages > 0 && message.version > last + 1)
+			skipped += message.version - last - 1;
+		last = message.version;
+		++messages;
+		bytes += sizeof(message) + message.size;
+		if (message.type == DELTA_KEYFRAME)
+			++keyframes;
+		if (!quiet)
+			printf("%s %8llu %8u bytes\n", message.type == DELTA_KEYFRAME ? "keyframe" : "update  ", (unsigned long long)message.version, message.size);
+	}
+	double elapsed = client_time() - start;
+	printf("%d messages, %d keyframes, %llu versions skipped, %.1f KB/s\n", messages, keyframes, (unsigned long long)skipped, elapsed > 0 ? bytes / elapsed / 1024 : 0);
+	int failed = 0;
+	if (output)
+	{
+		uint32_t* cube = (uint32_t*)malloc(sizeof(uint32_t) * dims[0] * dims[1] * dims[2]);
+		delta_client_cube(client, cube);
+		failed = snapshot_write(output, cube, dims, resolution, 0, 0) != 0;
+		if (failed)
+			fprintf(stderr, "%s: can't write\n", output);
+		free(cube);
+	}
+	delta_client_close(client);
+	return failed;
+}
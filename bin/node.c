@@ -0,0 +1,148 @@
+// Runs a capture node of virtual devices, a fusion node, or both over loopback, to check frames make it from one to the other.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <cubic.h>
+
+#define MAX_DEVICES (32)
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-n devices] [-b base] [-t seconds] -c host:port\n"
+		"       %s [-n devices] [-b base] [-t seconds] -f port\n"
+		"       %s [-n devices] [-t seconds] -l port\n"
+		"  -c  be a capture node of virtual devices shipping depth to the fusion node there\n"
+		"  -f  be the fusion node, fusing depth from capture nodes connecting to this port\n"
+		"  -l  run a capture node and a fusion node in this process, connected over loopback on this port\n"
+		"  -n  virtual devices on a capture node, devices expected by the fusion node, 3 by default\n"
+		"  -b  a capture node's devices are known to the fusion node as base .. base + devices - 1,\n"
+		"      a fusion node expects devices numbered from base, 0 by default\n"
+		"  -t  stop and report after this long, 10 seconds by default\n", name, name, name);
+}
+
+static void node_ready(cubic_t* cubic)
+{
+}
+
+static cubic_param_t node_params(void)
+{
+	cubic_param_t params;
+	memset(&params, 0, sizeof(params));
+	params.dims[0] = 200;
+	params.dims[1] = 100;
+	params.dims[2] = 200;
+	params.resolution = 50;
+	params.refresh_rate = 30;
+	params.on_ready = node_ready;
+	params.replay_speed = FREENECT_REPLAY_REALTIME;
+	return params;
+}
+
+static void node_report(const char* role, cubic_t* cubic, int count, int base)
+{
+	cubic_device_stats_t devices[MAX_DEVICES];
+	cubic_stats_t stats = cubic_get_stats(cubic, devices);
+	int i;
+	// a capture node fuses nothing, its cycle count stays 0
+	printf("%s: %llu cycles, %llu deadline misses\n", role, (unsigned long long)stats.cycles, (unsigned long long)stats.deadline_misses);
+	for (i = 0; i < count; i++)
+		printf("%s: device %d, %llu frames, %llu dropped, %.2f ms average latency, %.2f ms max\n", role, base + i,
+			(unsigned long long)devices[i].frames, (unsigned long long)devices[i].dropped, devices[i].latency * 1e3, devices[i].max_latency * 1e3);
+}
+
+int main(int argc, char** argv)
+{
+	int count = 3, base = 0, fusion_port = 0, loopback = 0;
+	double seconds = 10;
+	char* fusion_host = 0;
+	int opt, i;
+	while ((opt = getopt(argc, argv, "n:b:t:c:f:l:h")) != -1)
+		switch (opt)
+		{
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'b':
+				base = atoi(optarg);
+				break;
+			case 't':
+				seconds = atof(optarg);
+				break;
+			case 'c':
+			{
+				char* colon = strrchr(optarg, ':');
+				if (!colon)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				*colon = 0;
+				fusion_host = optarg;
+				fusion_port = atoi(colon + 1);
+				break;
+			}
+			case 'f':
+				fusion_port = atoi(optarg);
+				break;
+			case 'l':
+				fusion_host = "127.0.0.1";
+				fusion_port = atoi(optarg);
+				loopback = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	if (fusion_port <= 0 || count < 1 || count > MAX_DEVICES || base < 0 || base + count > NODE_MAX_DEVICES)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	int ids[MAX_DEVICES];
+	cubic_t* fusion = 0;
+	cubic_t* capture = 0;
+	if (!fusion_host || loopback)
+	{
+		// the fusion node knows the devices by what the capture nodes call them
+		for (i = 0; i < count; i++)
+			ids[i] = base + i;
+		cubic_param_t params = node_params();
+		params.node_port = fusion_port;
+		fusion = cubic_open(count, ids, params);
+		if (!fusion)
+		{
+			fprintf(stderr, "can't open the fusion node\n");
+			return 1;
+		}
+	}
+	if (fusion_host)
+	{
+		for (i = 0; i < count; i++)
+			ids[i] = i;
+		cubic_param_t params = node_params();
+		params.virtual_count = count;
+		params.fusion_host = fusion_host;
+		params.fusion_port = fusion_port;
+		params.node_base = base;
+		capture = cubic_open(count, ids, params);
+		if (!capture)
+		{
+			fprintf(stderr, "can't open %d virtual devices\n", count);
+			return 1;
+		}
+	}
+	usleep((useconds_t)(seconds * 1e6));
+	if (capture)
+		node_report("capture", capture, count, base);
+	if (fusion)
+		node_report("fusion", fusion, count, base);
+	// the live threads don't stop, the process exits right after
+	if (capture)
+		cubic_close(capture);
+	if (fusion)
+		cubic_close(fusion);
+	return 0;
+}
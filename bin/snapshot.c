@@ -0,0 +1,143 @@
+// Converts dense cube dumps to sparse snapshots and back, and looks inside snapshots.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <cubic.h>
+#include <snapshot.h>
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s info snapshot\n"
+		"       %s voxel snapshot x y z\n"
+		"       %s convert -d 200x100x200 [-r resolution] dense snapshot\n"
+		"       %s inflate snapshot dense\n"
+		"  info     dims, resolution, device transforms and how sparse the volume is\n"
+		"  voxel    the hit count of one voxel, read without inflating the volume\n"
+		"  convert  a raw dump of cubic_t.cube, x fastest, to a snapshot\n"
+		"  inflate  a snapshot back to a raw dump\n", name, name, name, name);
+}
+
+static int snapshot_info(const char* path)
+{
+	snapshot_t* snapshot = snapshot_open(path);
+	if (!snapshot)
+	{
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		return 1;
+	}
+	size_t dims[3];
+	snapshot_dims(snapshot, dims);
+	snapshot_stats_t stats = snapshot_stats(snapshot);
+	uint64_t dense = sizeof(uint32_t) * dims[0] * dims[1] * dims[2];
+	printf("dims        %zux%zux%zu\n", dims[0], dims[1], dims[2]);
+	printf("resolution  %g mm\n", snapshot_resolution(snapshot));
+	printf("bricks      %llu of %llu occupied\n", (unsigned long long)stats.occupied, (unsigned long long)stats.bricks);
+	printf("voxels      %llu of %llu non-zero\n", (unsigned long long)stats.voxels, (unsigned long long)(dims[0] * dims[1] * dims[2]));
+	printf("size        %llu bytes, %.1fx smaller than dense\n", (unsigned long long)stats.bytes, (double)dense / stats.bytes);
+	int i;
+	for (i = 0; i < snapshot_transform_count(snapshot); i++)
+	{
+		cubic_transform_t transform = snapshot_transform(snapshot, i);
+		printf("device %d    yaw %g pitch %g at (%g, %g, %g)\n", i, transform.yaw, transform.pitch, transform.x, transform.y, transform.z);
+	}
+	snapshot_close(snapshot);
+	return 0;
+}
+
+static int snapshot_lookup(const char* path, size_t x, size_t y, size_t z)
+{
+	snapshot_t* snapshot = snapshot_open(path);
+	if (!snapshot)
+	{
+		fprintf(stderr, "%s: not a snapshot\n", path);
+		return 1;
+	}
+	printf("%u\n", snapshot_voxel(snapshot, x, y, z));
+	snapshot_close(snapshot);
+	return 0;
+}
+
+static int snapshot_convert(const char* from, const char* to, size_t dims[3], double resolution)
+{
+	size_t count = dims[0] * dims[1] * dims[2];
+	uint32_t* cube = (uint32_t*)malloc(sizeof(uint32_t) * count);
+	FILE* in = fopen(from, "rb");
+	if (!in || fread(cube, sizeof(uint32_t), count, in) != count)
+	{
+		fprintf(stderr, "%s: can't read %zu voxels\n", from, count);
+		if (in)
+			fclose(in);
+		free(cube);
+		return 1;
+	}
+	fclose(in);
+	int failed = snapshot_write(to, cube, dims, resolution, 0, 0);
+	if (failed)
+		fprintf(stderr, "%s: can't write\n", to);
+	free(cube);
+	return failed ? 1 : 0;
+}
+
+static int snapshot_dense(const char* from, const char* to)
+{
+	snapshot_t* snapshot = snapshot_open(from);
+	if (!snapshot)
+	{
+		fprintf(stderr, "%s: not a snapshot\n", from);
+		return 1;
+	}
+	size_t dims[3];
+	snapshot_dims(snapshot, dims);
+	size_t count = dims[0] * dims[1] * dims[2];
+	uint32_t* cube = (uint32_t*)malloc(sizeof(uint32_t) * count);
+	snapshot_inflate(snapshot, cube);
+	snapshot_close(snapshot);
+	FILE* out = fopen(to, "wb");
+	int failed = !out || fwrite(cube, sizeof(uint32_t), count, out) != count;
+	if (out && fclose(out) != 0)
+		failed = 1;
+	if (failed)
+		fprintf(stderr, "%s: can't write\n", to);
+	free(cube);
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	size_t dims[3] = {
+		0, 0, 0
+	};
+	double resolution = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:r:h")) != -1)
+		switch (opt)
+		{
+			case 'd':
+				if (sscanf(optarg, "%zux%zux%zu", &dims[0], &dims[1], &dims[2]) != 3)
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'r':
+				resolution = atof(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	int left = argc - optind;
+	char** args = argv + optind;
+	if (left == 2 && strcmp(args[0], "info") == 0)
+		return snapshot_info(args[1]);
+	if (left == 5 && strcmp(args[0], "voxel") == 0)
+		return snapshot_lookup(args[1], strtoul(args[2], 0, 10), strtoul(args[3], 0, 10), strtoul(args[4], 0, 10));
+	if (left == 3 && strcmp(args[0], "convert") == 0 && dims[0] > 0 && dims[1] > 0 && dims[2] > 0)
+		return snapshot_convert(args[1], args[2], dims, resolution);
+	if (left == 3 && strcmp(args[0], "inflate") == 0)
+		return snapshot_dense(args[1], args[2]);
+	usage(argv[0]);
+	return 1;
+}
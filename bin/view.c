@@ -20,6 +20,8 @@ static float pitch = 0;
 static float yaw = 0;
 static float scale = 1;
 
+static volatile int snapshot_requested = 0;
+
 static void draw_cube_at(double x, double y, double z)
 {
 	const static float radius = 0.045f;
@@ -137,6 +139,8 @@ static void key_pressed(unsigned char key, int x, int y)
 		scale *= 1 / 1.1;
 	} else if (key == 'x') {
 		scale *= 1.1;
+	} else if (key == 'p') {
+		snapshot_requested = 1;
 	}
 }
 
@@ -162,6 +166,11 @@ static void cubic_on_ready(cubic_t* cubic)
 	pthread_mutex_lock(&gl_backbuf_mutex);
 	memcpy(back, cubic->cube, sizeof(uint32_t) * 200 * 200 * 100);
 	pthread_mutex_unlock(&gl_backbuf_mutex);
+	if (snapshot_requested)
+	{
+		snapshot_requested = 0;
+		cubic_snapshot(cubic, "cubic.snap");
+	}
 }
 
 int main(int argc, char **argv)
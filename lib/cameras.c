@@ -28,10 +28,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "freenect_internal.h"
 #include "registration.h"
 #include "cameras.h"
+#include "trace.h"
 
 #define MAKE_RESERVED(res, fmt) (uint32_t)(((res & 0xff) << 8) | (((fmt & 0xff))))
 #define RESERVED_TO_RESOLUTION(reserved) (freenect_resolution)((reserved >> 8) & 0xff)
@@ -83,7 +85,103 @@ struct pkt_hdr {
 	uint32_t timestamp;
 };
 
-static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *pkt, int len)
+#define CLOCK_FORGET 0.002 // weight of a new sample once warmed up, about 17 seconds of memory at 30 fps
+#define CLOCK_LEAK 0.001 // seconds per second the envelope rises when no arrival touches it
+#define ISO_PACKET_INTERVAL 0.000125 // one high speed microframe per isochronous packet
+
+static double monotonic_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void clock_update(fn_clock_model *clock, uint32_t timestamp, double arrival)
+{
+	if (clock->samples == 0) {
+		memset(clock, 0, sizeof(*clock));
+		clock->last = timestamp;
+		clock->my = arrival;
+		clock->arrival = arrival;
+		clock->samples = 1;
+		return;
+	}
+	clock->ticks += (int32_t)(timestamp - clock->last);
+	clock->last = timestamp;
+	// exponentially weighted fit, plain averages until there are enough samples
+	double alpha = 1.0 / (clock->samples + 1);
+	if (alpha < CLOCK_FORGET)
+		alpha = CLOCK_FORGET;
+	double dx = clock->ticks - clock->mx;
+	double dy = arrival - clock->my;
+	clock->mx += alpha * dx;
+	clock->my += alpha * dy;
+	clock->cxx = (1 - alpha) * (clock->cxx + alpha * dx * dx);
+	clock->cxy = (1 - alpha) * (clock->cxy + alpha * dx * dy);
+	clock->samples++;
+	if (clock->cxx > 0)
+		clock->rate = clock->cxy / clock->cxx;
+	double residual = arrival - (clock->my + clock->rate * (clock->ticks - clock->mx));
+	double envelope = clock->envelope + CLOCK_LEAK * (arrival - clock->arrival);
+	clock->envelope = (clock->samples == 2 || residual < envelope) ? residual : envelope;
+	clock->arrival = arrival;
+}
+
+static double clock_host_time(fn_clock_model *clock, uint32_t timestamp)
+{
+	if (clock->samples < 2)
+		return clock->arrival;
+	double ticks = clock->ticks + (int32_t)(timestamp - clock->last);
+	return clock->my + clock->rate * (ticks - clock->mx) + clock->envelope;
+}
+
+// Called when a frame completes, feeds the clock model and stamps the frame with host time.
+static void stream_clock(packet_stream *strm)
+{
+	TRACE_INSTANT("frame_complete", strm->flag);
+	strm->times.first_packet = 0;
+	if (strm->sof_seen) {
+		clock_update(&strm->clock, strm->sof_timestamp, strm->sof_arrival);
+		strm->times.first_packet = strm->sof_arrival;
+		strm->sof_seen = 0;
+	}
+	strm->host_timestamp = clock_host_time(&strm->clock, strm->timestamp);
+	strm->times.capture = strm->host_timestamp;
+	strm->times.last_packet = strm->arrival;
+}
+
+// Called when a frame completes in concealment mode.  Works out which rows are
+// covered entirely by packets that arrived, fills the missing packets if asked to,
+// and clears the packet map for the next frame.
+static void stream_conceal(packet_stream *strm)
+{
+	int row_bytes = strm->frame_size / strm->rows;
+	int i, missing = 0;
+	memset(strm->row_valid, 1, strm->rows);
+	for (i = 0; i < strm->pkts_per_frame; i++) {
+		if (strm->pkt_valid[i])
+			continue;
+		int start = i * strm->pkt_size;
+		int size = (i == strm->pkts_per_frame - 1) ? strm->last_pkt_size : strm->pkt_size;
+		int first = start / row_bytes;
+		int last = (start + size - 1) / row_bytes;
+		if (last >= strm->rows)
+			last = strm->rows - 1;
+		memset(strm->row_valid + first, 0, last - first + 1);
+		// FREENECT_CONCEAL_PREVIOUS leaves whatever the previous frame had there
+		if (strm->conceal == FREENECT_CONCEAL_INVALID)
+			memset(strm->raw_buf + start, strm->fill, size);
+		missing = 1;
+	}
+	if (missing)
+		strm->concealed_frames++;
+	memset(strm->pkt_valid, 0, strm->pkts_per_frame);
+}
+
+// Returns the size of a completed frame, if any.  *retry is set when the frame was
+// completed by a gap in the sequence, the packet was not consumed then and must be
+// passed in again once the frame has been handled, so it can't overwrite the frame.
+static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *pkt, int len, int *retry)
 {
 	if (len < 12)
 		return 0;
@@ -121,6 +219,8 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 		strm->pkt_num = 0;
 		strm->valid_pkts = 0;
 		strm->got_pkts = 0;
+		if (strm->pkt_valid)
+			memset(strm->pkt_valid, 0, strm->pkts_per_frame);
 	}
 
 	int got_frame_size = 0;
@@ -128,24 +228,37 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 	// handle lost packets
 	if (strm->seq != hdr->seq) {
 		uint8_t lost = hdr->seq - strm->seq;
+		int left = strm->pkts_per_frame - strm->pkt_num;
 		FN_LOG(l_info, "[Stream %02x] Lost %d packets\n", strm->flag, lost);
-		if (lost > 5 || strm->variable_length) {
+		// with concealment, any gap is fine as long as we can still tell which frame we are in
+		if (strm->variable_length || (lost > 5 && (!strm->conceal || lost - left >= strm->pkts_per_frame))) {
 			FN_LOG(l_notice, "[Stream %02x] Lost too many packets, resyncing...\n", strm->flag);
+			strm->lost_pkts += lost;
 			strm->synced = 0;
+			strm->resyncs++;
 			return 0;
 		}
-		strm->seq = hdr->seq;
-		int left = strm->pkts_per_frame - strm->pkt_num;
 		if (left <= lost) {
-			strm->pkt_num = lost - left;
+			// the gap runs past the end of the frame in progress, deliver that first,
+			// the rest of the gap is accounted for when this packet comes back
+			strm->lost_pkts += left;
+			strm->seq += left;
+			strm->pkt_num = 0;
+			*retry = 1;
+			if (strm->got_pkts == 0)
+				return 0; // nothing of that frame arrived at all, skip it
 			strm->valid_pkts = strm->got_pkts;
 			strm->got_pkts = 0;
-			got_frame_size = strm->frame_size;
 			strm->timestamp = strm->last_timestamp;
 			strm->valid_frames++;
-		} else {
-			strm->pkt_num += lost;
+			stream_clock(strm);
+			if (strm->conceal)
+				stream_conceal(strm);
+			return strm->frame_size;
 		}
+		strm->lost_pkts += lost;
+		strm->seq = hdr->seq;
+		strm->pkt_num += lost;
 	}
 
 	int expected_pkt_size = (strm->pkt_num == strm->pkts_per_frame-1) ? strm->last_pkt_size : strm->pkt_size;
@@ -158,6 +271,7 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 			FN_LOG(l_notice, "[Stream %02x] Inconsistent flag %02x with %d packets in buf (%d total), resyncing...\n",
 			       strm->flag, hdr->flag, strm->pkt_num, strm->pkts_per_frame);
 			strm->synced = 0;
+			strm->resyncs++;
 			return got_frame_size;
 		}
 		// check data length
@@ -176,6 +290,7 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 			FN_LOG(l_notice, "[Stream %02x] Inconsistent flag %02x with %d packets in buf (%d total), resyncing...\n",
 			       strm->flag, hdr->flag, strm->pkt_num, strm->pkts_per_frame);
 			strm->synced = 0;
+			strm->resyncs++;
 			return got_frame_size;
 		}
 		// check data length
@@ -183,12 +298,14 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 			FN_LOG(l_warning, "[Stream %02x] Expected max %d data bytes, but got %d. Resyncng...\n",
 			       strm->flag, expected_pkt_size, datalen);
 			strm->synced = 0;
+			strm->resyncs++;
 			return got_frame_size;
 		}
 		if (datalen < expected_pkt_size && hdr->flag != eof) {
 			FN_LOG(l_warning, "[Stream %02x] Expected %d data bytes, but got %d. Resyncing...\n",
 			       strm->flag, expected_pkt_size, datalen);
 			strm->synced = 0;
+			strm->resyncs++;
 			return got_frame_size;
 		}
 	}
@@ -196,6 +313,13 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 	// copy data
 	uint8_t *dbuf = strm->raw_buf + strm->pkt_num * strm->pkt_size;
 	memcpy(dbuf, data, datalen);
+	if (strm->pkt_valid)
+		strm->pkt_valid[strm->pkt_num] = 1;
+	if (hdr->flag == sof) {
+		strm->sof_seen = 1;
+		strm->sof_timestamp = fn_le32(hdr->timestamp);
+		strm->sof_arrival = strm->arrival;
+	}
 
 	strm->pkt_num++;
 	strm->seq++;
@@ -213,14 +337,87 @@ static int stream_process(freenect_context *ctx, packet_stream *strm, uint8_t *p
 		strm->got_pkts = 0;
 		strm->timestamp = strm->last_timestamp;
 		strm->valid_frames++;
+		stream_clock(strm);
+		if (strm->conceal)
+			stream_conceal(strm);
 	}
 	return got_frame_size;
 }
 
+// Packets in the middle of a frame that are in sequence and full size need nothing
+// but a copy.  Validate a run of them in a tight loop and update the stream state
+// once for the whole run.  Returns the number of packets consumed.
+static int stream_process_run(packet_stream *strm, uint8_t *buf, int stride, const int *lens, int n)
+{
+	uint8_t mof = strm->flag|2;
+	int pkt_len = strm->pkt_size + sizeof(struct pkt_hdr);
+	int max = strm->pkts_per_frame - 1 - strm->pkt_num; // the last packet is EOF, never MOF
+	if (max > n)
+		max = n;
+	uint8_t *dbuf = strm->raw_buf + strm->pkt_num * strm->pkt_size;
+	struct pkt_hdr *hdr = NULL;
+	int k;
+	for (k = 0; k < max; k++) {
+		struct pkt_hdr *next = (struct pkt_hdr*)(buf + k * stride);
+		if (lens[k] != pkt_len || next->magic[0] != 'R' || next->magic[1] != 'B' ||
+		    next->flag != mof || next->seq != (uint8_t)(strm->seq + k))
+			break;
+		hdr = next;
+		memcpy(dbuf, hdr + 1, strm->pkt_size);
+		dbuf += strm->pkt_size;
+	}
+	if (k > 0) {
+		if (strm->pkt_valid)
+			memset(strm->pkt_valid + strm->pkt_num, 1, k);
+		strm->pkt_num += k;
+		strm->seq += k;
+		strm->got_pkts += k;
+		strm->last_timestamp = fn_le32(hdr->timestamp);
+	}
+	return k;
+}
+
+// Process all packets of a transfer, calling frame() whenever one completes and
+// before the next frame's packets can overwrite it.  arrival is when the last
+// packet of the transfer came in, earlier ones are one microframe apart.
+static void stream_process_batch(freenect_device *dev, packet_stream *strm, uint8_t *buf, int stride, const int *lens, int n, double arrival, void (*frame)(freenect_device *dev, int got_frame_size))
+{
+	freenect_context *ctx = dev->parent;
+	int i = 0;
+	while (i < n) {
+		if (strm->synced && strm->pkt_num > 0 && !strm->variable_length) {
+			int k = stream_process_run(strm, buf + i * stride, stride, lens + i, n - i);
+			if (k > 0) {
+				i += k;
+				continue;
+			}
+		}
+		// anything else goes through the full state machine
+		int retry = 0;
+		if (lens[i] > 0) {
+			strm->arrival = arrival - (n - 1 - i) * ISO_PACKET_INTERVAL;
+			int got_frame_size = stream_process(ctx, strm, buf + i * stride, lens[i], &retry);
+			if (got_frame_size)
+				frame(dev, got_frame_size);
+		}
+		if (!retry)
+			i++;
+	}
+}
+
 static void stream_init(freenect_context *ctx, packet_stream *strm, int rlen, int plen)
 {
 	strm->valid_frames = 0;
 	strm->synced = 0;
+	strm->lost_pkts = 0;
+	strm->resyncs = 0;
+	strm->adapt_pkts = 0;
+	strm->adapt_events = 0;
+	strm->adapt_calm = 0;
+	strm->concealed_frames = 0;
+	strm->sof_seen = 0;
+	strm->clock.samples = 0;
+	strm->host_timestamp = 0;
 
 	if (strm->usr_buf) {
 		strm->lib_buf = NULL;
@@ -244,6 +441,16 @@ static void stream_init(freenect_context *ctx, packet_stream *strm, int rlen, in
 	if (strm->last_pkt_size == 0)
 		strm->last_pkt_size = strm->pkt_size;
 	strm->pkts_per_frame = (strm->frame_size + strm->pkt_size - 1) / strm->pkt_size;
+
+	// variable length frames have no fixed packet to row mapping, those always resync
+	if (strm->conceal && !strm->variable_length && strm->rows > 0) {
+		strm->pkt_valid = (uint8_t*)calloc(strm->pkts_per_frame, 1);
+		strm->row_valid = (uint8_t*)malloc(strm->rows);
+		memset(strm->row_valid, 1, strm->rows);
+	} else {
+		strm->pkt_valid = NULL;
+		strm->row_valid = NULL;
+	}
 }
 
 static void stream_freebufs(freenect_context *ctx, packet_stream *strm)
@@ -252,10 +459,14 @@ static void stream_freebufs(freenect_context *ctx, packet_stream *strm)
 		free(strm->raw_buf);
 	if (strm->lib_buf)
 		free(strm->lib_buf);
+	free(strm->pkt_valid);
+	free(strm->row_valid);
 
 	strm->raw_buf = NULL;
 	strm->proc_buf = NULL;
 	strm->lib_buf = NULL;
+	strm->pkt_valid = NULL;
+	strm->row_valid = NULL;
 }
 
 static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
@@ -281,6 +492,53 @@ static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
 	}
 }
 
+#define ADAPT_WINDOW_FRAMES 30 // one controller decision about every second
+#define ADAPT_CALM_WINDOWS 10 // windows without trouble before giving a transfer back
+#define ADAPT_MIN_XFERS 4
+
+// Double the transfers in flight as soon as the stream loses packets or sync,
+// and give them back one by one once it has been calm for a while.
+static void stream_adapt(packet_stream *strm, fnusb_isoc_stream *isoc, int pkts)
+{
+	strm->adapt_pkts += pkts;
+	if (strm->adapt_pkts < strm->pkts_per_frame * ADAPT_WINDOW_FRAMES)
+		return;
+	uint64_t events = strm->lost_pkts + strm->resyncs - strm->adapt_events;
+	strm->adapt_events = strm->lost_pkts + strm->resyncs;
+	strm->adapt_pkts = 0;
+	if (events > 0) {
+		strm->adapt_calm = 0;
+		fnusb_set_iso_depth(isoc, isoc->target_xfers * 2);
+	} else if (++strm->adapt_calm >= ADAPT_CALM_WINDOWS && isoc->target_xfers > ADAPT_MIN_XFERS) {
+		strm->adapt_calm = 0;
+		fnusb_set_iso_depth(isoc, isoc->target_xfers - 1);
+	}
+}
+
+static int stream_start_iso(freenect_device *dev, packet_stream *strm, fnusb_isoc_stream *isoc, freenect_transfer_depth depth, fnusb_iso_cb cb, int ep, int len)
+{
+	int xfers = depth.transfers > 0 ? depth.transfers : NUM_XFERS;
+	int pkts = depth.packets > 0 ? depth.packets : PKTS_PER_XFER;
+	// a budget larger than the fixed depth needs lets the controller adapt within it
+	int max_xfers = depth.budget / (pkts * len);
+	strm->adaptive = max_xfers > xfers;
+	return fnusb_start_iso(&dev->usb_cam, isoc, cb, ep, xfers, max_xfers, pkts, len, depth.hugepages, depth.copy);
+}
+
+static freenect_stream_stats stream_stats(packet_stream *strm, fnusb_isoc_stream *isoc)
+{
+	freenect_stream_stats stats;
+	stats.frames = strm->valid_frames;
+	stats.lost_packets = __sync_fetch_and_add(&strm->lost_pkts, 0);
+	stats.resyncs = __sync_fetch_and_add(&strm->resyncs, 0);
+	stats.transfers = isoc->xfers ? fnusb_iso_depth(isoc) : 0;
+	stats.zero_copy = isoc->xfers && isoc->buffer_kind == FNUSB_BUFFER_DEV_MEM;
+	stats.cpu_time = isoc->cpu_nsec * 1e-9;
+	stats.concealed = __sync_fetch_and_add(&strm->concealed_frames, 0);
+	stats.tick_rate = strm->clock.rate > 0 ? 1 / strm->clock.rate : 0;
+	return stats;
+}
+
 /**
  * Convert a packed array of n elements with vw useful bits into array of
  * zero-padded 16bit elements.
@@ -290,7 +548,7 @@ static int stream_setbuf(freenect_context *ctx, packet_stream *strm, void *pbuf)
  * @param vw The virtual width of elements, that is the number of useful bits for each of them
  * @param n The number of elements (in particular, of the destination array), NOT a length in bytes
  */
-static inline void convert_packed_to_16bit(uint8_t *src, uint16_t *dest, int vw, int n)
+void convert_packed_to_16bit(uint8_t *src, uint16_t *dest, int vw, int n)
 {
 	unsigned int mask = (1 << vw) - 1;
 	uint32_t buffer = 0;
@@ -331,7 +589,7 @@ static inline void convert_packed_to_8bit(uint8_t *src, uint8_t *dest, int vw, i
 }
 
 // Loop-unrolled version of the 11-to-16 bit unpacker.  n must be a multiple of 8.
-static void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
+void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
 {
 	uint16_t baseMask = (1 << 11) - 1;
 	while(n >= 8)
@@ -363,24 +621,15 @@ static void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n)
 	}
 }
 
-static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
+static void depth_frame(freenect_device *dev, int got_frame_size)
 {
 	freenect_context *ctx = dev->parent;
 
-	if (len == 0)
-		return;
-
-	if (!dev->depth.running)
-		return;
-
-	int got_frame_size = stream_process(ctx, &dev->depth, pkt, len);
-
-	if (!got_frame_size)
-		return;
-
 	FN_SPEW("Got depth frame of size %d/%d, %d/%d packets arrived, TS %08x\n", got_frame_size,
 	        dev->depth.frame_size, dev->depth.valid_pkts, dev->depth.pkts_per_frame, dev->depth.timestamp);
 
+	TRACE_BEGIN("depth_convert", dev->depth.flag);
+
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_11BIT:
 			convert_packed11_to_16bit(dev->depth.raw_buf, (uint16_t*)dev->depth.proc_buf, 640*480);
@@ -398,15 +647,28 @@ static void depth_process(freenect_device *dev, uint8_t *pkt, int len)
 		case FREENECT_DEPTH_11BIT_PACKED:
 			break;
 		default:
-			FN_ERROR("depth_process() was called, but an invalid depth_format is set\n");
+			FN_ERROR("depth_frame() was called, but an invalid depth_format is set\n");
 			break;
 	}
+	TRACE_END("depth_convert", dev->depth.flag);
+	dev->depth.times.converted = monotonic_time();
 	if (dev->depth_cb)
 		dev->depth_cb(dev, dev->depth.proc_buf, dev->depth.timestamp);
 }
 
+static void depth_process(freenect_device *dev, uint8_t *buf, int stride, const int *lens, int n)
+{
+	if (!dev->depth.running)
+		return;
+
+	if (dev->depth.adaptive)
+		stream_adapt(&dev->depth, &dev->depth_isoc, n);
+
+	stream_process_batch(dev, &dev->depth, buf, stride, lens, n, monotonic_time(), depth_frame);
+}
+
 #define CLAMP(x) if (x < 0) {x = 0;} if (x > 255) {x = 255;}
-static void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
 {
 	int x, y;
 	for(y = 0; y < frame_mode.height; ++y) {
@@ -439,7 +701,7 @@ static void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_fr
 }
 #undef CLAMP
 
-static void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
+void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode)
 {
 	int x,y;
 	/* Pixel arrangement:
@@ -603,24 +865,15 @@ static void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_f
 	} // end of for y loop
 }
 
-static void video_process(freenect_device *dev, uint8_t *pkt, int len)
+static void video_frame(freenect_device *dev, int got_frame_size)
 {
 	freenect_context *ctx = dev->parent;
 
-	if (len == 0)
-		return;
-
-	if (!dev->video.running)
-		return;
-
-	int got_frame_size = stream_process(ctx, &dev->video, pkt, len);
-
-	if (!got_frame_size)
-		return;
-
 	FN_SPEW("Got video frame of size %d/%d, %d/%d packets arrived, TS %08x\n", got_frame_size,
 	        dev->video.frame_size, dev->video.valid_pkts, dev->video.pkts_per_frame, dev->video.timestamp);
 
+	TRACE_BEGIN("video_convert", dev->video.flag);
+
 	freenect_frame_mode frame_mode = freenect_get_current_video_mode(dev);
 	switch (dev->video_format) {
 		case FREENECT_VIDEO_RGB:
@@ -642,14 +895,27 @@ static void video_process(freenect_device *dev, uint8_t *pkt, int len)
 		case FREENECT_VIDEO_YUV_RAW:
 			break;
 		default:
-			FN_ERROR("video_process() was called, but an invalid video_format is set\n");
+			FN_ERROR("video_frame() was called, but an invalid video_format is set\n");
 			break;
 	}
 
+	TRACE_END("video_convert", dev->video.flag);
+	dev->video.times.converted = monotonic_time();
 	if (dev->video_cb)
 		dev->video_cb(dev, dev->video.proc_buf, dev->video.timestamp);
 }
 
+static void video_process(freenect_device *dev, uint8_t *buf, int stride, const int *lens, int n)
+{
+	if (!dev->video.running)
+		return;
+
+	if (dev->video.adaptive)
+		stream_adapt(&dev->video, &dev->video_isoc, n);
+
+	stream_process_batch(dev, &dev->video, buf, stride, lens, n, monotonic_time(), video_frame);
+}
+
 typedef struct {
 	uint8_t magic[2];
 	uint16_t len;
@@ -689,6 +955,10 @@ static int send_cmd(freenect_device *dev, uint16_t cmd, void *cmdbuf, unsigned i
 	do {
 		actual_len = fnusb_control(&dev->usb_cam, 0xc0, 0, 0, 0, ibuf, 0x200);
 		FN_FLOOD("actual_len: %d\n", actual_len);
+		// reply not ready yet, back off a little rather than hammering the control pipe
+		// that other devices being brought up at the same time share
+		if ((actual_len == 0) || (actual_len == 0x200))
+			usleep(500);
 	} while ((actual_len == 0) || (actual_len == 0x200));
 	FN_SPEW("Control reply: %d\n", res);
 	if (actual_len < (int)sizeof(*rhdr)) {
@@ -936,17 +1206,19 @@ static int freenect_fetch_zero_plane_info(freenect_device *dev)
 	return 0;
 }
 
-int freenect_start_depth(freenect_device *dev)
+int freenect_prepare_depth(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 	int res;
 
-	if (dev->depth.running)
+	if (dev->depth.running || dev->depth.prepared)
 		return -1;
 
 	dev->depth.pkt_size = DEPTH_PKTDSIZE;
 	dev->depth.flag = 0x70;
 	dev->depth.variable_length = 0;
+	dev->depth.rows = freenect_get_current_depth_mode(dev).height;
+	dev->depth.fill = 0xff; // all ones unpacks to the no-reading value of both 10 and 11 bit depth
 
 	switch (dev->depth_format) {
 		case FREENECT_DEPTH_REGISTERED:
@@ -967,7 +1239,7 @@ int freenect_start_depth(freenect_device *dev)
 			return -1;
 	}
 
-	res = fnusb_start_iso(&dev->usb_cam, &dev->depth_isoc, depth_process, 0x82, NUM_XFERS, PKTS_PER_XFER, DEPTH_PKTBUF);
+	res = stream_start_iso(dev, &dev->depth, &dev->depth_isoc, dev->depth_transfers, depth_process, 0x82, DEPTH_PKTBUF);
 	if (res < 0)
 		return res;
 
@@ -989,9 +1261,28 @@ int freenect_start_depth(freenect_device *dev)
 	}
 	write_register(dev, 0x13, 0x01);
 	write_register(dev, 0x14, 0x1e);
+
+	dev->depth.prepared = 1;
+	return 0;
+}
+
+int freenect_start_depth(freenect_device *dev)
+{
+	int res;
+
+	if (dev->depth.running)
+		return -1;
+
+	if (!dev->depth.prepared) {
+		res = freenect_prepare_depth(dev);
+		if (res < 0)
+			return res;
+	}
+
 	write_register(dev, 0x06, 0x02); // start depth stream
 	write_register(dev, 0x17, 0x00); // disable depth hflip
 
+	dev->depth.prepared = 0;
 	dev->depth.running = 1;
 	return 0;
 }
@@ -1007,6 +1298,8 @@ int freenect_start_video(freenect_device *dev)
 	dev->video.pkt_size = VIDEO_PKTDSIZE;
 	dev->video.flag = 0x80;
 	dev->video.variable_length = 0;
+	dev->video.rows = freenect_get_current_video_mode(dev).height;
+	dev->video.fill = 0;
 
 	uint16_t mode_reg, mode_value;
 	uint16_t res_reg, res_value;
@@ -1113,7 +1406,7 @@ int freenect_start_video(freenect_device *dev)
 			break;
 	}
 
-	res = fnusb_start_iso(&dev->usb_cam, &dev->video_isoc, video_process, 0x81, NUM_XFERS, PKTS_PER_XFER, VIDEO_PKTBUF);
+	res = stream_start_iso(dev, &dev->video, &dev->video_isoc, dev->video_transfers, video_process, 0x81, VIDEO_PKTBUF);
 	if (res < 0)
 		return res;
 
@@ -1148,10 +1441,11 @@ int freenect_stop_depth(freenect_device *dev)
 	freenect_context *ctx = dev->parent;
 	int res;
 
-	if (!dev->depth.running)
+	if (!dev->depth.running && !dev->depth.prepared)
 		return -1;
 
 	dev->depth.running = 0;
+	dev->depth.prepared = 0;
 	freenect_destroy_registration(&(dev->registration));
 	write_register(dev, 0x06, 0x00); // stop depth stream
 
@@ -1317,6 +1611,90 @@ int freenect_set_depth_mode(freenect_device* dev, const freenect_frame_mode mode
 	dev->depth_resolution = res;
 	return 0;
 }
+int freenect_set_depth_transfers(freenect_device *dev, freenect_transfer_depth depth)
+{
+	freenect_context *ctx = dev->parent;
+	if (dev->depth.running || dev->depth.prepared) {
+		FN_ERROR("Tried to set depth transfers while stream is active\n");
+		return -1;
+	}
+	dev->depth_transfers = depth;
+	return 0;
+}
+
+int freenect_set_video_transfers(freenect_device *dev, freenect_transfer_depth depth)
+{
+	freenect_context *ctx = dev->parent;
+	if (dev->video.running) {
+		FN_ERROR("Tried to set video transfers while stream is active\n");
+		return -1;
+	}
+	dev->video_transfers = depth;
+	return 0;
+}
+
+int freenect_set_depth_concealment(freenect_device *dev, freenect_concealment mode)
+{
+	freenect_context *ctx = dev->parent;
+	if (dev->depth.running || dev->depth.prepared) {
+		FN_ERROR("Tried to set depth concealment while stream is active\n");
+		return -1;
+	}
+	dev->depth.conceal = mode;
+	return 0;
+}
+
+int freenect_set_video_concealment(freenect_device *dev, freenect_concealment mode)
+{
+	freenect_context *ctx = dev->parent;
+	if (dev->video.running) {
+		FN_ERROR("Tried to set video concealment while stream is active\n");
+		return -1;
+	}
+	dev->video.conceal = mode;
+	return 0;
+}
+
+const uint8_t *freenect_get_depth_row_mask(freenect_device *dev)
+{
+	return dev->depth.row_valid;
+}
+
+const uint8_t *freenect_get_video_row_mask(freenect_device *dev)
+{
+	return dev->video.row_valid;
+}
+
+double freenect_get_depth_host_time(freenect_device *dev)
+{
+	return dev->depth.host_timestamp;
+}
+
+double freenect_get_video_host_time(freenect_device *dev)
+{
+	return dev->video.host_timestamp;
+}
+
+freenect_frame_times freenect_get_depth_frame_times(freenect_device *dev)
+{
+	return dev->depth.times;
+}
+
+freenect_frame_times freenect_get_video_frame_times(freenect_device *dev)
+{
+	return dev->video.times;
+}
+
+freenect_stream_stats freenect_get_depth_stats(freenect_device *dev)
+{
+	return stream_stats(&dev->depth, &dev->depth_isoc);
+}
+
+freenect_stream_stats freenect_get_video_stats(freenect_device *dev)
+{
+	return stream_stats(&dev->video, &dev->video_isoc);
+}
+
 int freenect_set_depth_buffer(freenect_device *dev, void *buf)
 {
 	return stream_setbuf(dev->parent, &dev->depth, buf);
@@ -1331,6 +1709,17 @@ int freenect_camera_init(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 	int res;
+	// warm start, the calibration for the default video mode comes from the cache, no round trips needed
+	if (freenect_load_registration_cache(dev, FREENECT_RESOLUTION_MEDIUM) == 0) {
+		dev->video_format = FREENECT_VIDEO_RGB;
+		dev->video_resolution = FREENECT_RESOLUTION_MEDIUM;
+		res = freenect_set_depth_mode(dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT));
+		if (res < 0) {
+			FN_ERROR("freenect_camera_init(): Failed to set depth mode for device\n");
+			return res;
+		}
+		return 0;
+	}
 	res = freenect_fetch_reg_pad_info(dev);
 	if (res < 0) {
 		FN_ERROR("freenect_camera_init(): Failed to fetch registration pad info for device\n");
@@ -1355,7 +1744,7 @@ int freenect_camera_teardown(freenect_device *dev)
 {
 	freenect_context *ctx = dev->parent;
 	int res = 0;
-	if (dev->depth.running) {
+	if (dev->depth.running || dev->depth.prepared) {
 		res = freenect_stop_depth(dev);
 		if (res < 0) {
 			FN_ERROR("freenect_camera_teardown(): Failed to stop depth camera\n");
@@ -36,5 +36,11 @@
 int freenect_camera_init(freenect_device *dev);
 int freenect_camera_teardown(freenect_device *dev);
 
+// The per-frame conversion kernels, only exposed so bench can measure them.
+void convert_packed_to_16bit(uint8_t *src, uint16_t *dest, int vw, int n);
+void convert_packed11_to_16bit(uint8_t *raw, uint16_t *frame, int n);
+void convert_uyvy_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode);
+void convert_bayer_to_rgb(uint8_t *raw_buf, uint8_t *proc_buf, freenect_frame_mode frame_mode);
+
 #endif
 
@@ -1,4 +1,4 @@
 CC := clang
 AR := ar
 CFLAGS := -msse2 -I"."
-LDFLAGS := -lm -lusb-1.0 -lpthread -lglut -lGL -lGLU
+LDFLAGS := -lm -lrt -lusb-1.0 -lpthread -lglut -lGL -lGLU
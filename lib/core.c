@@ -35,18 +35,27 @@
 #include "registration.h"
 #include "cameras.h"
 
+static freenect_context *alloc_context(void)
+{
+	freenect_context *ctx = (freenect_context*)malloc(sizeof(freenect_context));
+	if (!ctx)
+		return NULL;
+
+	memset(ctx, 0, sizeof(freenect_context));
+
+	ctx->log_level = LL_WARNING;
+	ctx->enabled_subdevices = (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA);
+	return ctx;
+}
+
 int freenect_init(freenect_context **ctx, freenect_usb_context *usb_ctx)
 {
 	int res;
 
-	*ctx = (freenect_context*)malloc(sizeof(freenect_context));
-	if (!ctx)
+	*ctx = alloc_context();
+	if (!*ctx)
 		return -1;
 
-	memset(*ctx, 0, sizeof(freenect_context));
-
-	(*ctx)->log_level = LL_WARNING;
-	(*ctx)->enabled_subdevices = (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA);
 	res = fnusb_init(&(*ctx)->usb, usb_ctx);
 	if (res < 0) {
 		free(*ctx);
@@ -55,6 +64,46 @@ int freenect_init(freenect_context **ctx, freenect_usb_context *usb_ctx)
 	return res;
 }
 
+int freenect_init_replay(freenect_context **ctx, const char *path, freenect_replay_speed speed)
+{
+	int res;
+
+	*ctx = alloc_context();
+	if (!*ctx)
+		return -1;
+
+	res = fnusb_init_replay(&(*ctx)->usb, path, speed);
+	if (res < 0) {
+		free(*ctx);
+		*ctx = NULL;
+	}
+	return res;
+}
+
+int freenect_init_virtual(freenect_context **ctx, int count, const freenect_virtual_pose *poses, freenect_replay_speed speed)
+{
+	int res;
+
+	*ctx = alloc_context();
+	if (!*ctx)
+		return -1;
+
+	res = fnusb_init_virtual(&(*ctx)->usb, count, poses, speed);
+	if (res < 0) {
+		free(*ctx);
+		*ctx = NULL;
+	}
+	return res;
+}
+
+int freenect_record_usb(freenect_context *ctx, const char *path)
+{
+	int res = fnusb_record(&ctx->usb, path);
+	if (res < 0)
+		FN_ERROR("Could not record to %s\n", path);
+	return res;
+}
+
 int freenect_shutdown(freenect_context *ctx)
 {
 	while (ctx->first) {
@@ -63,6 +112,7 @@ int freenect_shutdown(freenect_context *ctx)
 	}
 
 	fnusb_shutdown(&ctx->usb);
+	free(ctx->registration_cache);
 	free(ctx);
 	return 0;
 }
@@ -102,6 +152,11 @@ int freenect_list_device_attributes(freenect_context *ctx, struct freenect_devic
 	return fnusb_list_device_attributes(&ctx->usb, attribute_list);
 }
 
+int freenect_get_device_bus(freenect_context *ctx, int index)
+{
+	return fnusb_get_device_bus(&ctx->usb, index);
+}
+
 void freenect_free_device_attributes(struct freenect_device_attributes *attribute_list)
 {
 	// Iterate over list, freeing contents of each item as we go.
@@ -145,14 +200,10 @@ int freenect_open_device(freenect_context *ctx, freenect_device **dev, int index
 		return res;
 	}
 
-	if (!ctx->first) {
-		ctx->first = pdev;
-	} else {
-		freenect_device *prev = ctx->first;
-		while (prev->next)
-			prev = prev->next;
-		prev->next = pdev;
-	}
+	// append lock-free, so devices of the same context can be opened from several threads at once
+	freenect_device **tail = &ctx->first;
+	while (!__sync_bool_compare_and_swap(tail, NULL, pdev))
+		tail = &(*tail)->next;
 
 	*dev = pdev;
 
@@ -198,6 +249,7 @@ int freenect_close_device(freenect_device *dev)
 	if (dev->usb_cam.dev) {
 		freenect_camera_teardown(dev);
 	}
+	freenect_unload_registration_cache(dev);
 
 	res = fnusb_close_subdevices(dev);
 	if (res < 0) {
@@ -242,6 +294,12 @@ void freenect_set_log_level(freenect_context *ctx, freenect_loglevel level)
 	ctx->log_level = level;
 }
 
+void freenect_set_registration_cache(freenect_context *ctx, const char *path)
+{
+	free(ctx->registration_cache);
+	ctx->registration_cache = path ? strdup(path) : NULL;
+}
+
 void freenect_set_log_callback(freenect_context *ctx, freenect_log_cb cb)
 {
 	ctx->log_cb = cb;
@@ -1,34 +1,196 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#endif
+
 #include "cubic.h"
+#include "cubic_internal.h"
+#include "delta.h"
+#include "node.h"
+#include "publish.h"
+#include "snapshot.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
-#include <sys/time.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #define CUBIC_PI (3.141592653589793)
 #define KINECT_WIDTH (640)
 #define KINECT_HEIGHT (480)
+#define CUBIC_BANDS (16) // tasks a frame is fused in, bands of rows
+#define CUBIC_ADAPT_HIGH (0.9) // of the cycle's budget, above it a cycle counts as over
+#define CUBIC_ADAPT_DEGRADE (3) // cycles over in a row before quality drops a level
+#define CUBIC_ADAPT_RESTORE (30) // cycles with room to spare in a row before it comes back one
 
-static void cubic_feedback(freenect_device *dev, void *depth, uint32_t timestamp)
+static double cubic_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define cubic_counter_add(counter, value) __sync_fetch_and_add(&(counter), (value))
+#define cubic_counter_get(counter) __sync_fetch_and_add(&(counter), 0)
+
+// only one thread ever writes a given counter, the swap just keeps readers from seeing a torn value
+static void cubic_counter_max(uint64_t* counter, uint64_t value)
+{
+	uint64_t current = cubic_counter_get(*counter);
+	if (value > current)
+		__sync_bool_compare_and_swap(counter, current, value);
+}
+
+static int cubic_histogram_bucket(uint64_t usec)
+{
+	if (usec < 16)
+		return (int)usec;
+	int exponent = 63 - __builtin_clzll(usec);
+	int bucket = (exponent - 3) * 16 + (int)((usec >> (exponent - 4)) & 15);
+	return bucket < CUBIC_HISTOGRAM_BUCKETS ? bucket : CUBIC_HISTOGRAM_BUCKETS - 1;
+}
+
+static uint64_t cubic_histogram_value(int bucket)
+{
+	if (bucket < 16)
+		return bucket;
+	int exponent = bucket / 16 + 3;
+	return (uint64_t)(16 + bucket % 16) << (exponent - 4);
+}
+
+static void cubic_histogram_add(cubic_histogram_t* histogram, double from, double to)
+{
+	if (from <= 0 || to <= 0)
+		return;
+	uint64_t usec = to > from ? (uint64_t)((to - from) * 1e6) : 0;
+	cubic_counter_add(histogram->buckets[cubic_histogram_bucket(usec)], 1);
+	cubic_counter_add(histogram->count, 1);
+}
+
+// only called from the compute thread
+static void cubic_trace_record(cubic_t* cubic, cubic_trace_t* trace)
+{
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_TRANSFER, trace->first_packet, trace->last_packet);
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_CONVERT, trace->last_packet, trace->converted);
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_COPY, trace->converted, trace->copied);
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_QUEUE, trace->copied, trace->fusion_start);
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_FUSE, trace->fusion_start, trace->fusion_end);
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_DELIVER, trace->fusion_end, trace->delivered);
+	cubic_histogram_add(cubic->histograms + CUBIC_STAGE_TOTAL, trace->capture, trace->delivered);
+	cubic->traces[cubic->trace_head % cubic->trace_depth] = *trace;
+	__sync_fetch_and_add(&cubic->trace_head, 1);
+}
+
+// overwrite the oldest slot, unless that is being fused right now, it is filled without holding the lock
+static cubic_frame_t* cubic_ring_claim(cubic_device_t* device, double ref_pix_size, double ref_distance)
 {
-	cubic_device_t* device = (cubic_device_t*)freenect_get_user(dev);
-	freenect_registration registration = freenect_copy_registration(dev);
 	pthread_mutex_lock(&device->mutex);
-	device->ref_pix_size = registration.zero_plane_info.reference_pixel_size;
-	device->ref_distance = registration.zero_plane_info.reference_distance;
-	memcpy(device->depth, depth, sizeof(uint16_t) * KINECT_WIDTH * KINECT_HEIGHT);
+	device->ref_pix_size = ref_pix_size;
+	device->ref_distance = ref_distance;
+	int slot = (device->latest + 1) % device->cubic->history;
+	if (slot == device->reading)
+		slot = (slot + 1) % device->cubic->history;
+	cubic_frame_t* frame = device->frames + slot;
+	if (frame->timestamp > 0 && !frame->fused)
+		cubic_counter_add(device->counters.dropped, 1);
+	frame->timestamp = 0;
+	frame->fused = 0;
 	pthread_mutex_unlock(&device->mutex);
-	freenect_destroy_registration(&registration);
+	return frame;
+}
+
+static void cubic_ring_publish(cubic_device_t* device, cubic_frame_t* frame, double captured)
+{
+	pthread_mutex_lock(&device->mutex);
+	frame->timestamp = captured;
+	device->latest = frame - device->frames;
+	pthread_mutex_unlock(&device->mutex);
+}
+
+static void cubic_feedback(freenect_device *dev, void *depth, uint32_t timestamp)
+{
+	cubic_device_t* device = (cubic_device_t*)freenect_get_user(dev);
+	TRACE_BEGIN("cubic_feedback", device->id);
+	freenect_zero_plane_info zero_plane = freenect_get_zero_plane_info(dev);
+	const uint8_t* rows = freenect_get_depth_row_mask(dev);
+	struct cubic_t* cubic = device->cubic;
+	cubic_frame_t* frame = cubic_ring_claim(device, zero_plane.reference_pixel_size, zero_plane.reference_distance);
+	if (rows)
+	{
+		// a partial frame, rows with missing packets are cleared so they don't contribute
+		int i;
+		for (i = 0; i < KINECT_HEIGHT; i++)
+			if (rows[i])
+				memcpy(frame->depth + i * KINECT_WIDTH, (uint16_t*)depth + i * KINECT_WIDTH, sizeof(uint16_t) * KINECT_WIDTH);
+			else
+				memset(frame->depth + i * KINECT_WIDTH, 0, sizeof(uint16_t) * KINECT_WIDTH);
+	} else
+		memcpy(frame->depth, depth, sizeof(uint16_t) * KINECT_WIDTH * KINECT_HEIGHT);
+	freenect_frame_times times = freenect_get_depth_frame_times(dev);
+	double captured = times.capture;
+	frame->trace.device = device - cubic->devices;
+	frame->trace.capture = captured;
+	frame->trace.first_packet = times.first_packet;
+	frame->trace.last_packet = times.last_packet;
+	frame->trace.converted = times.converted;
+	frame->trace.copied = cubic_time();
+	// event threads never stop, cubic_close waits for this to be let go before it closes the writer or the sender
+	pthread_rwlock_rdlock(&cubic->outputs);
+	if (cubic->sender)
+	{
+		sequence_frame_t shipped;
+		shipped.device = cubic->node_base + device->id;
+		shipped.timestamp = captured;
+		shipped.ref_pix_size = zero_plane.reference_pixel_size;
+		shipped.ref_distance = zero_plane.reference_distance;
+		node_sender_push(cubic->sender, shipped, frame->depth);
+	}
+	if (cubic->sequence)
+	{
+		// the slot is still ours, archive it as it will be fused
+		sequence_frame_t archived;
+		archived.device = device->id;
+		archived.timestamp = captured;
+		archived.ref_pix_size = zero_plane.reference_pixel_size;
+		archived.ref_distance = zero_plane.reference_distance;
+		sequence_writer_push(cubic->sequence, archived, frame->depth);
+	}
+	pthread_rwlock_unlock(&cubic->outputs);
+	cubic_ring_publish(device, frame, captured);
+	// the capture time is estimated from the device clock, early on it can come out a little after the copy
+	uint64_t latency = frame->trace.copied > captured ? (uint64_t)((frame->trace.copied - captured) * 1e9) : 0;
+	cubic_counter_add(device->counters.frames, 1);
+	cubic_counter_add(device->counters.latency, latency);
+	cubic_counter_max(&device->counters.max_latency, latency);
+	TRACE_END("cubic_feedback", device->id);
 }
 
-static void cubic_depth_to_cube(uint16_t* depth, double resolution, size_t dims[static 3], double ref_pix_size, double ref_distance, cubic_transform_t transform, uint32_t* cube)
+// fuses rows [begin, end) of a frame, every stride-th pixel of every stride-th row, returns the number
+// of points that landed in the cube, shared when other threads add to the same cube at the same time,
+// mask is optional, pixels and depths it rules out are skipped
+uint64_t cubic_depth_rows_to_cube(uint16_t* depth, int begin, int end, int stride, const cubic_mask_t* mask, double resolution, size_t dims[static 3], double ref_pix_size, double ref_distance, cubic_transform_t transform, uint32_t* cube, int shared)
 {
 	int i, j;
-	for (i = 0; i < KINECT_HEIGHT; i++)
+	uint64_t voxels = 0;
+	begin = (begin + stride - 1) / stride * stride;
+	depth += begin * KINECT_WIDTH;
+	for (i = begin; i < end; i += stride)
 	{
-		for (j = 0; j < KINECT_WIDTH; j++)
+		int first = 0, last = KINECT_WIDTH;
+		const cubic_range_t* ranges = 0;
+		if (mask)
 		{
-			if (depth[j]) // 0 is not a valid value
+			first = (mask->spans[i].first + stride - 1) / stride * stride;
+			last = mask->spans[i].last;
+			ranges = mask->ranges + i * KINECT_WIDTH;
+		}
+		for (j = first; j < last; j += stride)
+		{
+			// 0 is not a valid value, and it never is within a range
+			if (ranges ? depth[j] >= ranges[j].near && depth[j] <= ranges[j].far : depth[j] != 0)
 			{
 				double z = depth[j] + ref_distance;
 				double factor = 2 * ref_pix_size * z / ref_distance;
@@ -38,63 +200,582 @@ static void cubic_depth_to_cube(uint16_t* depth, double resolution, size_t dims[
 				uint32_t wy = (uint32_t)((x * transform.m10 + y * transform.m11 + z * transform.m12 + transform.m13) / resolution + 0.5 * dims[1] + 0.5);
 				uint32_t wz = (uint32_t)((x * transform.m20 + y * transform.m21 + z * transform.m22 + transform.m23) / resolution + 0.5 * dims[2] + 0.5);
 				if (wx < dims[0] && wy < dims[1] && wz < dims[2])
-					++cube[wz * dims[0] * dims[1] + wy * dims[0] + wx];
+				{
+					if (shared)
+						__sync_fetch_and_add(cube + wz * dims[0] * dims[1] + wy * dims[0] + wx, 1);
+					else
+						++cube[wz * dims[0] * dims[1] + wy * dims[0] + wx];
+					++voxels;
+				}
+			}
+		}
+		depth += KINECT_WIDTH * stride;
+	}
+	return voxels;
+}
+
+// a pixel's point along its ray is depth + ref_distance times a fixed direction, so every voxel coordinate
+// is linear in depth and the depths that keep it inside the cube are an interval, solved for per axis
+void cubic_mask_rows(cubic_mask_t* mask, int begin, int end, double resolution, size_t dims[static 3], cubic_transform_t transform)
+{
+	int i, j, k;
+	double m[3][4] = {
+		{transform.m00, transform.m01, transform.m02, transform.m03},
+		{transform.m10, transform.m11, transform.m12, transform.m13},
+		{transform.m20, transform.m21, transform.m22, transform.m23},
+	};
+	double scale = 2 * mask->ref_pix_size / mask->ref_distance;
+	for (i = begin; i < end; i++)
+	{
+		double v = (i - KINECT_HEIGHT / 2 + 0.5) * scale;
+		cubic_range_t* ranges = mask->ranges + i * KINECT_WIDTH;
+		int first = KINECT_WIDTH, last = 0;
+		for (j = 0; j < KINECT_WIDTH; j++)
+		{
+			double u = (j - KINECT_WIDTH / 2 + 0.5) * scale;
+			// in mm from the reference plane, as the kernel's z
+			double lo = mask->ref_distance + 1, hi = mask->ref_distance + 65535;
+			for (k = 0; k < 3; k++)
+			{
+				// coordinates just past either end still truncate into the cube, so the bounds are generous
+				double slope = (m[k][0] * u + m[k][1] * v + m[k][2]) / resolution;
+				double offset = m[k][3] / resolution + 0.5 * dims[k] + 0.5;
+				double below = -1.001 - offset, above = dims[k] + 0.001 - offset;
+				if (fabs(slope) < 1e-12)
+				{
+					if (below > 0 || above < 0)
+						hi = lo - 1;
+					continue;
+				}
+				double a = below / slope, b = above / slope;
+				if (a > b)
+				{
+					double swap = a;
+					a = b;
+					b = swap;
+				}
+				if (a > lo)
+					lo = a;
+				if (b < hi)
+					hi = b;
+			}
+			lo = floor(lo - mask->ref_distance) - 1;
+			hi = ceil(hi - mask->ref_distance) + 1;
+			if (lo < 1)
+				lo = 1;
+			if (hi > 65535)
+				hi = 65535;
+			if (lo <= hi)
+			{
+				ranges[j].near = (uint16_t)lo;
+				ranges[j].far = (uint16_t)hi;
+				if (first == KINECT_WIDTH)
+					first = j;
+				last = j + 1;
+			} else {
+				ranges[j].near = 1;
+				ranges[j].far = 0;
 			}
 		}
-		depth += KINECT_WIDTH;
+		mask->spans[i].first = first < last ? first : 0;
+		mask->spans[i].last = last;
+	}
+}
+
+typedef struct {
+	int id; // the device's, for the trace
+	uint16_t* depth;
+	double ref_pix_size;
+	double ref_distance;
+	cubic_transform_t transform;
+	uint64_t version;
+	cubic_mask_t* mask;
+} cubic_source_t;
+
+// what a cycle hands to the pool, every task is one band of rows of one device's frame
+typedef struct {
+	cubic_t* cubic;
+	cubic_source_t* sources;
+	int stride;
+	int shared;
+	uint64_t voxels;
+} cubic_fusion_t;
+
+static void cubic_fuse_bands(void* data, int begin, int end)
+{
+	cubic_fusion_t* fusion = (cubic_fusion_t*)data;
+	cubic_t* cubic = fusion->cubic;
+	uint64_t voxels = 0;
+	int i;
+	for (i = begin; i < end; i++)
+	{
+		cubic_source_t* source = fusion->sources + i / CUBIC_BANDS;
+		int band = i % CUBIC_BANDS;
+		// one span per run of a device's bands on this thread
+		if (i == begin || band == 0)
+			TRACE_BEGIN("cubic_depth_to_cube", source->id);
+		voxels += cubic_depth_rows_to_cube(source->depth, band * KINECT_HEIGHT / CUBIC_BANDS, (band + 1) * KINECT_HEIGHT / CUBIC_BANDS, fusion->stride, source->mask, cubic->resolution, cubic->dims, source->ref_pix_size, source->ref_distance, source->transform, cubic->cube, fusion->shared);
+		if (i == end - 1 || band == CUBIC_BANDS - 1)
+			TRACE_END("cubic_depth_to_cube", source->id);
+	}
+	__sync_fetch_and_add(&fusion->voxels, voxels);
+}
+
+typedef struct {
+	cubic_t* cubic;
+	cubic_source_t* source;
+} cubic_rebuild_t;
+
+static void cubic_mask_bands(void* data, int begin, int end)
+{
+	cubic_rebuild_t* rebuild = (cubic_rebuild_t*)data;
+	cubic_mask_rows(rebuild->source->mask, begin, end, rebuild->cubic->resolution, rebuild->cubic->dims, rebuild->source->transform);
+}
+
+static void cubic_clear_slabs(void* data, int begin, int end)
+{
+	cubic_t* cubic = (cubic_t*)data;
+	size_t slab = cubic->dims[0] * cubic->dims[1];
+	memset(cubic->cube + slab * begin, 0, sizeof(uint32_t) * slab * (end - begin));
+}
+
+// the newest capture time every device has reached, but no older than what every ring still holds,
+// so one stalled device doesn't hold everyone else back, 0 if there are no frames yet
+static double cubic_target(cubic_t* cubic)
+{
+	int i, j;
+	double latest = 0, oldest = 0;
+	for (i = 0; i < cubic->count; i++)
+	{
+		cubic_device_t* device = cubic->devices + i;
+		pthread_mutex_lock(&device->mutex);
+		double newest = device->frames[device->latest].timestamp;
+		double first = newest;
+		for (j = 0; j < cubic->history; j++)
+			if (device->frames[j].timestamp > 0 && device->frames[j].timestamp < first)
+				first = device->frames[j].timestamp;
+		pthread_mutex_unlock(&device->mutex);
+		if (newest > 0 && (latest == 0 || newest < latest))
+			latest = newest;
+		if (first > oldest)
+			oldest = first;
+	}
+	return latest > oldest ? latest : oldest;
+}
+
+// fuses one cube out of what the rings hold and hands it to on_ready, returns 0 if the cycle was skipped
+static int cubic_fuse(cubic_t* cubic)
+{
+	int i, j;
+	double start = cubic_time();
+	// from each device, fuse the frame captured closest to a common target time, rather than whatever is newest
+	double target = cubic_target(cubic);
+	double earliest = 0, latest = 0;
+	int fused = 0, changed = 0;
+	cubic_trace_t traces[cubic->count];
+	cubic_source_t sources[cubic->count];
+	cubic_device_t* readers[cubic->count];
+	for (i = 0; i < cubic->count; i++)
+	{
+		cubic_device_t* device = cubic->devices + i;
+		uint64_t version = __sync_fetch_and_add(&device->transform_version, 0);
+		double timestamp = 0;
+		pthread_mutex_lock(&device->mutex);
+		int slot = -1;
+		for (j = 0; j < cubic->history; j++)
+			if (device->frames[j].timestamp > 0 && (slot < 0 || fabs(device->frames[j].timestamp - target) < fabs(device->frames[slot].timestamp - target)))
+				slot = j;
+		if (slot >= 0 && fabs(device->frames[slot].timestamp - target) <= cubic->max_skew)
+		{
+			timestamp = device->frames[slot].timestamp;
+			sources[fused].id = device->id;
+			sources[fused].depth = device->frames[slot].depth;
+			sources[fused].ref_pix_size = device->ref_pix_size;
+			sources[fused].ref_distance = device->ref_distance;
+			sources[fused].transform = device->transform;
+			sources[fused].version = version;
+			sources[fused].mask = &device->mask;
+			device->reading = slot;
+			device->frames[slot].fused = 1;
+			traces[fused] = device->frames[slot].trace;
+			readers[fused] = device;
+			if (fused == 0 || timestamp < earliest)
+				earliest = timestamp;
+			if (fused == 0 || timestamp > latest)
+				latest = timestamp;
+			++fused;
+		}
+		pthread_mutex_unlock(&device->mutex);
+		// the same frames from the same poses make the same cube
+		changed |= timestamp != device->fused_at || version != device->fused_version;
+		device->fused_at = timestamp;
+		device->fused_version = version;
 	}
+	if (!changed && cubic->quality >= 1)
+	{
+		for (i = 0; i < fused; i++)
+		{
+			pthread_mutex_lock(&readers[i]->mutex);
+			readers[i]->reading = -1;
+			pthread_mutex_unlock(&readers[i]->mutex);
+		}
+		cubic_counter_add(cubic->counters.skipped, 1);
+		return 0;
+	}
+	// masks follow the transforms, only the devices that moved since get theirs rebuilt
+	for (i = 0; i < fused; i++)
+	{
+		cubic_mask_t* mask = sources[i].mask;
+		if (mask->version != sources[i].version || mask->ref_pix_size != sources[i].ref_pix_size || mask->ref_distance != sources[i].ref_distance)
+		{
+			mask->ref_pix_size = sources[i].ref_pix_size;
+			mask->ref_distance = sources[i].ref_distance;
+			cubic_rebuild_t rebuild;
+			rebuild.cubic = cubic;
+			rebuild.source = sources + i;
+			TRACE_BEGIN("cubic_mask_rows", readers[i]->id);
+			pool_for(cubic->pool, KINECT_HEIGHT, 16, cubic_mask_bands, &rebuild);
+			TRACE_END("cubic_mask_rows", readers[i]->id);
+			mask->version = sources[i].version;
+		}
+	}
+	// fuse straight into the shared ring, so publishing costs no copy
+	if (cubic->publish)
+		cubic->cube = publish_begin(cubic->publish);
+	pool_for(cubic->pool, cubic->dims[2], 8, cubic_clear_slabs, cubic);
+	// all devices at once, bands of rows across the pool, so a device that comes late doesn't leave cores idle
+	double fusion_start = cubic_time();
+	cubic_fusion_t fusion;
+	fusion.cubic = cubic;
+	fusion.sources = sources;
+	fusion.stride = cubic->quality >= 2 ? 1 << (cubic->quality - 1) : 1;
+	fusion.shared = pool_size(cubic->pool) > 1;
+	fusion.voxels = 0;
+	// the cycle's spans carry its number, the devices' spans inside carry their ids
+	int cycle = (int)cubic_counter_get(cubic->counters.cycles);
+	TRACE_BEGIN("cubic_fuse", cycle);
+	pool_for(cubic->pool, fused * CUBIC_BANDS, 1, cubic_fuse_bands, &fusion);
+	TRACE_END("cubic_fuse", cycle);
+	double fusion_end = cubic_time();
+	uint64_t voxels = fusion.voxels;
+	for (i = 0; i < fused; i++)
+	{
+		traces[i].fusion_start = fusion_start;
+		traces[i].fusion_end = fusion_end;
+		pthread_mutex_lock(&readers[i]->mutex);
+		readers[i]->reading = -1;
+		pthread_mutex_unlock(&readers[i]->mutex);
+	}
+	cubic->target = target;
+	cubic->skew = latest - earliest;
+	cubic->fused = fused;
+	if (cubic->publish)
+		publish_end(cubic->publish, target, cubic->skew, fused, cubic->quality, cubic->pool);
+	if (cubic->server)
+		delta_server_publish(cubic->server, cubic->cube, target, cubic->pool);
+	uint64_t fusion_time = (uint64_t)((cubic_time() - start) * 1e9);
+	cubic_counter_add(cubic->counters.cycles, 1);
+	cubic_counter_add(cubic->counters.fusion_time, fusion_time);
+	cubic_counter_max(&cubic->counters.max_fusion_time, fusion_time);
+	__sync_lock_test_and_set(&cubic->counters.last_fusion_time, fusion_time);
+	__sync_lock_test_and_set(&cubic->counters.voxels, voxels);
+	TRACE_BEGIN("on_ready", cycle);
+	cubic->on_ready(cubic);
+	TRACE_END("on_ready", cycle);
+	double delivered = cubic_time();
+	for (i = 0; i < fused; i++)
+	{
+		traces[i].delivered = delivered;
+		cubic_trace_record(cubic, traces + i);
+	}
+	return 1;
+}
+
+// sheds quality after a few cycles in a row over budget, a single slow one may just be a hiccup, and brings it back
+// only after a long run with room for what the better level costs, so it doesn't flap between the two
+static void cubic_adapt(cubic_t* cubic, double load)
+{
+	// load as fraction of the budget, the level above costs about 4 times as much when it halves the stride
+	double restore = cubic->quality >= 2 ? CUBIC_ADAPT_HIGH / 4 : CUBIC_ADAPT_HIGH / 2;
+	if (load > CUBIC_ADAPT_HIGH)
+	{
+		cubic->under = 0;
+		if (++cubic->over >= CUBIC_ADAPT_DEGRADE && cubic->quality < CUBIC_QUALITY_LEVELS - 1)
+		{
+			__sync_lock_test_and_set(&cubic->quality, cubic->quality + 1);
+			cubic->over = 0;
+		}
+	} else if (load < restore) {
+		cubic->over = 0;
+		if (++cubic->under >= CUBIC_ADAPT_RESTORE && cubic->quality > 0)
+		{
+			__sync_lock_test_and_set(&cubic->quality, cubic->quality - 1);
+			cubic->under = 0;
+		}
+	} else
+		cubic->over = cubic->under = 0;
 }
 
 static void* cubic_compute(void* data)
 {
 	cubic_t* cubic = (cubic_t*)data;
-	int i;
-	struct timeval ltv, ctv;
-	gettimeofday(&ltv, 0);
+	trace_thread_name("cubic_compute");
+	double woke = cubic_time();
 	for (;;)
 	{
-		memset(cubic->cube, 0, sizeof(uint32_t) * cubic->dims[0] * cubic->dims[1] * cubic->dims[2]);
-		for (i = 0; i < cubic->count; i++)
+		int fused = cubic_fuse(cubic);
+		double deadline = woke + 1.0 / cubic->refresh_rate;
+		double now = cubic_time();
+		// skipped cycles cost next to nothing, they say nothing about what fusing costs
+		if (cubic->adaptive && fused)
+			cubic_adapt(cubic, (now - woke) * cubic->refresh_rate);
+		if (now > deadline)
 		{
-			pthread_mutex_lock(&cubic->devices[i].mutex);
-			cubic_depth_to_cube(cubic->devices[i].depth, cubic->resolution, cubic->dims, cubic->devices[i].ref_pix_size, cubic->devices[i].ref_distance, cubic->devices[i].transform, cubic->cube);
-			pthread_mutex_unlock(&cubic->devices[i].mutex);
+			cubic_counter_add(cubic->counters.deadline_misses, 1);
+			woke = now;
+			continue;
 		}
-		cubic->on_ready(cubic);
-		gettimeofday(&ctv, 0);
-		int64_t usec = 1000000 / cubic->refresh_rate - (ctv.tv_usec - ltv.tv_usec + (ctv.tv_sec - ltv.tv_sec) * 1000000);
-		if (usec > 0)
-			usleep(usec);
-		gettimeofday(&ltv, 0);
+		// to an absolute time, so how late the wakeup comes is all the scheduler's
+		struct timespec ts;
+		ts.tv_sec = (time_t)deadline;
+		ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+		woke = cubic_time();
+		uint64_t jitter = woke > deadline ? (uint64_t)((woke - deadline) * 1e9) : 0;
+		cubic_counter_add(cubic->counters.wakeups, 1);
+		cubic_counter_add(cubic->counters.wakeup_jitter, jitter);
+		cubic_counter_max(&cubic->counters.max_wakeup_jitter, jitter);
 	}
 	return 0;
 }
 
-static void* cubic_main(void* data)
+// feeds a recorded sequence through the rings as fast as it decodes, fusing on the recording's clock
+// every 1 / refresh_rate, so the rings hold exactly what they would have when running live
+static void* cubic_replay(void* data)
 {
-	int i;
 	cubic_t* cubic = (cubic_t*)data;
+	int i, j;
+	trace_thread_name("cubic_replay");
+	int count = sequence_reader_count(cubic->replay);
+	double next = 0;
+	for (i = 0; i < count && !cubic->stopping; i++)
+	{
+		sequence_frame_t info = sequence_reader_info(cubic->replay, i);
+		for (j = 0; j < cubic->count; j++)
+			if (cubic->devices[j].id == info.device)
+				break;
+		if (j == cubic->count)
+			continue;
+		if (next == 0)
+			next = info.timestamp + 1.0 / cubic->refresh_rate;
+		for (; next <= info.timestamp; next += 1.0 / cubic->refresh_rate)
+			cubic_fuse(cubic);
+		cubic_device_t* device = cubic->devices + j;
+		cubic_frame_t* frame = cubic_ring_claim(device, info.ref_pix_size, info.ref_distance);
+		TRACE_BEGIN("sequence_reader_read", device->id);
+		int failed = sequence_reader_read(cubic->replay, i, frame->depth);
+		TRACE_END("sequence_reader_read", device->id);
+		if (failed)
+			break;
+		// the recording's host times mean nothing now, only stages from the ring on are traced
+		memset(&frame->trace, 0, sizeof(cubic_trace_t));
+		frame->trace.device = j;
+		frame->trace.copied = cubic_time();
+		cubic_ring_publish(device, frame, info.timestamp);
+		cubic_counter_add(device->counters.frames, 1);
+	}
+	// the last frames
+	if (next > 0)
+		cubic_fuse(cubic);
+	__sync_lock_test_and_set(&cubic->finished, 1);
+	return 0;
+}
 
+// frames from capture nodes go through the rings just like local ones
+static void cubic_node_feedback(void* user, sequence_frame_t received, const uint16_t* depth)
+{
+	cubic_t* cubic = (cubic_t*)user;
+	int i;
 	for (i = 0; i < cubic->count; i++)
+		if (cubic->devices[i].id == received.device)
+			break;
+	if (i == cubic->count)
+		return;
+	cubic_device_t* device = cubic->devices + i;
+	TRACE_BEGIN("cubic_node_feedback", device->id);
+	cubic_frame_t* frame = cubic_ring_claim(device, received.ref_pix_size, received.ref_distance);
+	memcpy(frame->depth, depth, sizeof(uint16_t) * KINECT_WIDTH * KINECT_HEIGHT);
+	// the node's packet times are on another machine, only its capture time is brought over
+	memset(&frame->trace, 0, sizeof(cubic_trace_t));
+	frame->trace.device = i;
+	frame->trace.capture = received.timestamp;
+	frame->trace.copied = cubic_time();
+	cubic_ring_publish(device, frame, received.timestamp);
+	uint64_t latency = frame->trace.copied > received.timestamp ? (uint64_t)((frame->trace.copied - received.timestamp) * 1e9) : 0;
+	cubic_counter_add(device->counters.frames, 1);
+	cubic_counter_add(device->counters.latency, latency);
+	cubic_counter_max(&device->counters.max_latency, latency);
+	TRACE_END("cubic_node_feedback", device->id);
+}
+
+// keeps a thread to the given cpus and raises it to a SCHED_FIFO priority, either optional, -1 if the kernel refused
+static int cubic_pin(pthread_t thread, const int* cpus, int count, int priority)
+{
+	int i, failed = 0;
+	if (count > 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (i = 0; i < count; i++)
+			CPU_SET(cpus[i], &set);
+		failed |= pthread_setaffinity_np(thread, sizeof(cpu_set_t), &set) != 0;
+	}
+	if (priority > 0)
 	{
-		freenect_set_depth_callback(cubic->devices[i].device, cubic_feedback);
-		freenect_set_depth_mode(cubic->devices[i].device, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM));
-		freenect_start_depth(cubic->devices[i].device);
-		usleep(100000);
+		struct sched_param param;
+		param.sched_priority = priority;
+		failed |= pthread_setschedparam(thread, SCHED_FIFO, &param) != 0;
 	}
+	return failed ? -1 : 0;
+}
+
+static void* cubic_main(void* data)
+{
+	int i;
+	cubic_context_t* context = (cubic_context_t*)data;
+	cubic_t* cubic = context->cubic;
+	int index = context - cubic->contexts;
+	trace_thread_name("cubic_main");
+
+	if (cubic_pin(pthread_self(), &context->cpu, context->cpu >= 0, context->priority) != 0)
+		cubic_counter_add(cubic->counters.pin_failures, 1);
 
-	while (freenect_process_events(cubic->context) >= 0);
+	// devices are already prepared, only the stream-start command is staggered, globally across contexts
+	for (i = 0; i < cubic->count; i++)
+		if (cubic->devices[i].context == index && cubic->devices[i].device)
+		{
+			int64_t usec = (cubic->kickoff + i * cubic->start_stagger - cubic_time()) * 1000000;
+			if (usec > 0)
+				usleep(usec);
+			freenect_start_depth(cubic->devices[i].device);
+			cubic->devices[i].startup.start = cubic_time() - cubic->epoch;
+		}
+
+	while (freenect_process_events(context->context) >= 0);
 
 	for (i = 0; i < cubic->count; i++)
+		if (cubic->devices[i].context == index && cubic->devices[i].device)
+		{
+			freenect_stop_depth(cubic->devices[i].device);
+			freenect_close_device(cubic->devices[i].device);
+		}
+	freenect_shutdown(context->context);
+
+	return 0;
+}
+
+typedef struct {
+	cubic_device_t* device;
+	freenect_context* context;
+	freenect_transfer_depth transfers;
+	freenect_concealment conceal;
+} cubic_bring_up_t;
+
+static void* cubic_bring_up(void* data)
+{
+	cubic_bring_up_t* bring_up = (cubic_bring_up_t*)data;
+	cubic_device_t* device = bring_up->device;
+	double start = cubic_time();
+	if (freenect_open_device(bring_up->context, &device->device, device->id) < 0)
 	{
-		freenect_stop_depth(cubic->devices[i].device);
-		freenect_close_device(cubic->devices[i].device);
+		device->device = 0;
+		return 0;
 	}
-	freenect_shutdown(cubic->context);
-
+	double opened = cubic_time();
+	device->startup.open = opened - start;
+	freenect_set_user(device->device, device);
+	freenect_set_depth_callback(device->device, cubic_feedback);
+	freenect_set_depth_mode(device->device, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_MM));
+	freenect_set_depth_transfers(device->device, bring_up->transfers);
+	freenect_set_depth_concealment(device->device, bring_up->conceal);
+	freenect_prepare_depth(device->device);
+	device->startup.prepare = cubic_time() - opened;
 	return 0;
 }
 
+static void cubic_init_context(freenect_context** context, cubic_param_t params)
+{
+	if (params.virtual_count > 0)
+		freenect_init_virtual(context, params.virtual_count, params.virtual_poses, params.replay_speed);
+	else if (params.usb_replay)
+		freenect_init_replay(context, params.usb_replay, params.replay_speed);
+	else
+		freenect_init(context, 0);
+	if (params.usb_record)
+		freenect_record_usb(*context, params.usb_record);
+}
+
+// contexts are allocated one per device, so a map has to use every index from 0 up, and none past count - 1
+static int cubic_shard_map_valid(int count, const int* shards)
+{
+	int i, context_count = 0;
+	if (!shards)
+		return 0;
+	int used[count];
+	memset(used, 0, sizeof(used));
+	for (i = 0; i < count; i++)
+	{
+		if (shards[i] < 0 || shards[i] >= count)
+			return 0;
+		used[shards[i]] = 1;
+		if (shards[i] + 1 > context_count)
+			context_count = shards[i] + 1;
+	}
+	for (i = 0; i < context_count; i++)
+		if (!used[i])
+			return 0;
+	return 1;
+}
+
+// assign every device a context index, returns the number of contexts needed
+static int cubic_shard(freenect_context* probe, int count, int ids[], cubic_param_t params, int shards[])
+{
+	int i, j, context_count = 0;
+	switch (params.shard)
+	{
+		case CUBIC_SHARD_BY_BUS:
+		{
+			int buses[count];
+			for (i = 0; i < count; i++)
+			{
+				int bus = freenect_get_device_bus(probe, ids[i]);
+				for (j = 0; j < context_count; j++)
+					if (buses[j] == bus)
+						break;
+				if (j == context_count)
+					buses[context_count++] = bus;
+				shards[i] = j;
+			}
+			break;
+		}
+		case CUBIC_SHARD_BY_MAP:
+			for (i = 0; i < count; i++)
+			{
+				shards[i] = params.shards[i];
+				if (shards[i] + 1 > context_count)
+					context_count = shards[i] + 1;
+			}
+			break;
+		case CUBIC_SHARD_NONE:
+		default:
+			for (i = 0; i < count; i++)
+				shards[i] = 0;
+			context_count = 1;
+			break;
+	}
+	return context_count;
+}
+
 void cubic_transform_adjust(cubic_t* cubic, int id, float yaw, float pitch, float x, float y, float z)
 {
 	cubic->devices[id].transform.yaw = yaw;
@@ -114,43 +795,345 @@ void cubic_transform_adjust(cubic_t* cubic, int id, float yaw, float pitch, floa
 	cubic->devices[id].transform.m21 = sinf(yaw) * cosf(pitch);
 	cubic->devices[id].transform.m22 = cosf(yaw) * cosf(pitch);
 	cubic->devices[id].transform.m23 = z;
+	__sync_fetch_and_add(&cubic->devices[id].transform_version, 1);
+}
+
+// whichever loop fuses, live or replayed, runs where the compute thread was asked to
+static void cubic_start_compute(cubic_t* cubic, cubic_param_t params, void* (*compute)(void*))
+{
+	pthread_create(&cubic->compute, 0, compute, cubic);
+	if (cubic_pin(cubic->compute, params.compute_cpus, params.compute_cpu_count, params.compute_priority) != 0)
+		cubic_counter_add(cubic->counters.pin_failures, 1);
+}
+
+// everything about a device but opening it, the rings are carved out of frames and depth, masks out of what follows depth
+static void cubic_setup_devices(cubic_t* cubic, int ids[], cubic_param_t params, cubic_frame_t* frames, uint16_t* depth)
+{
+	cubic_range_t* ranges = (cubic_range_t*)(depth + KINECT_WIDTH * KINECT_HEIGHT * cubic->history * cubic->count);
+	cubic_span_t* spans = (cubic_span_t*)(ranges + KINECT_WIDTH * KINECT_HEIGHT * cubic->count);
+	int i, j;
+	for (i = 0; i < cubic->count; i++)
+	{
+		cubic->devices[i].id = ids[i];
+		cubic->devices[i].cubic = cubic;
+		cubic->devices[i].context = 0;
+		cubic->devices[i].device = 0;
+		cubic->devices[i].transform_version = 0;
+		cubic->devices[i].fused_at = 0;
+		cubic->devices[i].fused_version = 0;
+		cubic->devices[i].mask.ranges = ranges + KINECT_WIDTH * KINECT_HEIGHT * i;
+		cubic->devices[i].mask.spans = spans + KINECT_HEIGHT * i;
+		cubic->devices[i].mask.version = 0;
+		cubic->devices[i].mask.ref_pix_size = cubic->devices[i].mask.ref_distance = 0;
+		// we defaulting to clockwise Kinects
+		if (params.virtual_count > 0 && params.virtual_poses && ids[i] >= 0 && ids[i] < params.virtual_count)
+		{
+			freenect_virtual_pose pose = params.virtual_poses[ids[i]];
+			cubic_transform_adjust(cubic, i, pose.yaw, pose.pitch, pose.x, pose.y, pose.z);
+		} else
+			cubic_transform_adjust(cubic, i, 0, i * CUBIC_PI / 3, 0, 0, 0);
+		cubic->devices[i].frames = frames;
+		cubic->devices[i].latest = 0;
+		cubic->devices[i].reading = -1;
+		memset(&cubic->devices[i].counters, 0, sizeof(cubic_device_counters_t));
+		for (j = 0; j < cubic->history; j++)
+		{
+			frames[j].depth = depth;
+			frames[j].timestamp = 0;
+			frames[j].fused = 0;
+			memset(&frames[j].trace, 0, sizeof(cubic_trace_t));
+			memset(depth, 0, sizeof(uint16_t) * KINECT_WIDTH * KINECT_HEIGHT);
+			depth += KINECT_WIDTH * KINECT_HEIGHT;
+		}
+		frames += cubic->history;
+		memset(&cubic->devices[i].startup, 0, sizeof(cubic_startup_t));
+		pthread_mutex_init(&cubic->devices[i].mutex, 0);
+	}
+}
+
+// detach first so no more frames are pushed, then write out what is queued and the index
+static void cubic_close_outputs(cubic_t* cubic)
+{
+	pthread_rwlock_wrlock(&cubic->outputs);
+	sequence_writer_t* sequence = cubic->sequence;
+	cubic->sequence = 0;
+	node_sender_t* sender = cubic->sender;
+	cubic->sender = 0;
+	pthread_rwlock_unlock(&cubic->outputs);
+	if (sequence)
+		sequence_writer_close(sequence);
+	if (sender)
+		node_sender_close(sender);
+	if (cubic->receiver)
+		node_receiver_close(cubic->receiver);
+	cubic->receiver = 0;
+}
+
+// only once no compute thread is left to fuse
+static void cubic_close_fusion(cubic_t* cubic)
+{
+	if (cubic->replay)
+		sequence_reader_close(cubic->replay);
+	cubic->replay = 0;
+	if (cubic->publish)
+		publish_close(cubic->publish);
+	cubic->publish = 0;
+	if (cubic->server)
+		delta_server_close(cubic->server);
+	cubic->server = 0;
+	if (cubic->pool)
+		pool_close(cubic->pool);
+	cubic->pool = 0;
 }
 
 cubic_t* cubic_open(int count, int ids[], cubic_param_t params)
 {
-	cubic_t* cubic = (cubic_t*)malloc(sizeof(cubic_t) + sizeof(cubic_device_t) * count + sizeof(uint32_t) * params.dims[0] * params.dims[1] * params.dims[2] + sizeof(uint16_t) * KINECT_WIDTH * KINECT_HEIGHT * count);
+	int history = params.history >= 2 ? params.history : 3;
+	int trace_depth = params.trace_depth > 0 ? params.trace_depth : 256;
+	if (params.shard == CUBIC_SHARD_BY_MAP && !cubic_shard_map_valid(count, params.shards))
+		return 0;
+	// everything, including the frame rings, comes out of one allocation up front
+	if (params.trace_events > 0)
+		trace_start(params.trace_events);
+	size_t size = sizeof(cubic_t) + sizeof(cubic_device_t) * count + sizeof(cubic_context_t) * count + sizeof(cubic_histogram_t) * CUBIC_STAGE_COUNT + sizeof(cubic_trace_t) * trace_depth + sizeof(cubic_frame_t) * history * count + sizeof(uint32_t) * params.dims[0] * params.dims[1] * params.dims[2] + sizeof(uint16_t) * KINECT_WIDTH * KINECT_HEIGHT * history * count + (sizeof(cubic_range_t) * KINECT_WIDTH + sizeof(cubic_span_t)) * KINECT_HEIGHT * count;
+	cubic_t* cubic = (cubic_t*)malloc(size);
 	cubic->on_ready = params.on_ready;
 	cubic->resolution = params.resolution;
 	cubic->dims[0] = params.dims[0];
 	cubic->dims[1] = params.dims[1];
 	cubic->dims[2] = params.dims[2];
 	cubic->refresh_rate = params.refresh_rate;
+	cubic->start_stagger = params.start_stagger > 0 ? params.start_stagger : 0.1;
+	cubic->epoch = cubic_time();
 	cubic->devices = (cubic_device_t*)(cubic + 1);
-	cubic->cube = (uint32_t*)(cubic->devices + count);
+	cubic->contexts = (cubic_context_t*)(cubic->devices + count);
+	cubic->histograms = (cubic_histogram_t*)(cubic->contexts + count);
+	memset(cubic->histograms, 0, sizeof(cubic_histogram_t) * CUBIC_STAGE_COUNT);
+	cubic->traces = (cubic_trace_t*)(cubic->histograms + CUBIC_STAGE_COUNT);
+	cubic->trace_depth = trace_depth;
+	cubic->trace_head = 0;
+	cubic_frame_t* frames = (cubic_frame_t*)(cubic->traces + trace_depth);
+	cubic->cube = (uint32_t*)(frames + history * count);
+	cubic->history = history;
+	cubic->max_skew = params.max_skew > 0 ? params.max_skew : 1.0 / 60;
+	cubic->target = 0;
+	cubic->skew = 0;
+	cubic->fused = 0;
+	cubic->adaptive = params.adaptive;
+	cubic->quality = 0;
+	cubic->over = cubic->under = 0;
+	memset(&cubic->counters, 0, sizeof(cubic_counters_t));
+	// faults the whole block in too, so the first frames don't pay for it either
+	if (params.lock_memory && mlock(cubic, size) != 0)
+		cubic_counter_add(cubic->counters.pin_failures, 1);
 	uint16_t* depth = (uint16_t*)(cubic->cube + params.dims[0] * params.dims[1] * params.dims[2]);
-	freenect_init(&cubic->context, 0);
-	freenect_set_log_level(cubic->context, FREENECT_LOG_WARNING);
-	freenect_select_subdevices(cubic->context, FREENECT_DEVICE_CAMERA);
 	cubic->count = count;
+	pthread_rwlock_init(&cubic->outputs, 0);
+	cubic->sequence = params.sequence ? sequence_writer_open(params.sequence, KINECT_WIDTH, KINECT_HEIGHT, params.sequence_queue, 0) : 0;
+	cubic->publish = params.publish ? publish_open(params.publish, params.dims, params.resolution, params.publish_slots, params.publish_threshold) : 0;
+	cubic->server = params.serve_port > 0 ? delta_server_open(params.serve_port, params.dims, params.resolution, params.serve_threshold, params.serve_backlog) : 0;
+	// a capture node fuses nothing, so it needs no workers
+	cubic->pool = params.fusion_host ? 0 : pool_open(params.pool_threads, params.pool_cpus, params.pool_cpu_count, params.pool_priority);
+	cubic->replay = 0;
+	cubic->stopping = 0;
+	cubic->finished = 0;
+	cubic->node_base = params.node_base;
+	cubic->sender = params.fusion_host ? node_sender_open(params.fusion_host, params.fusion_port, KINECT_WIDTH, KINECT_HEIGHT, 0) : 0;
+	cubic->receiver = 0;
 	int i;
+	if (params.node_port > 0)
+	{
+		// no devices and no event threads, the capture nodes fill the rings
+		cubic->context_count = 0;
+		cubic_setup_devices(cubic, ids, params, frames, depth);
+		cubic->receiver = node_receiver_open(params.node_port, KINECT_WIDTH, KINECT_HEIGHT, cubic_node_feedback, cubic);
+		cubic->kickoff = cubic_time();
+		cubic_start_compute(cubic, params, cubic_compute);
+		return cubic;
+	}
+	if (params.sequence_replay)
+	{
+		cubic->replay = sequence_reader_open(params.sequence_replay);
+		int width, height;
+		if (cubic->replay)
+			sequence_reader_size(cubic->replay, &width, &height);
+		if (!cubic->replay || width != KINECT_WIDTH || height != KINECT_HEIGHT)
+		{
+			// no thread was started yet, so everything goes right away
+			cubic_close_outputs(cubic);
+			cubic_close_fusion(cubic);
+			pthread_rwlock_destroy(&cubic->outputs);
+			if (params.lock_memory)
+				munlock(cubic, size);
+			free(cubic);
+			return 0;
+		}
+		// no devices and no event threads, the frames go straight into the rings
+		cubic->context_count = 0;
+		cubic_setup_devices(cubic, ids, params, frames, depth);
+		cubic->kickoff = cubic_time();
+		cubic_start_compute(cubic, params, cubic_replay);
+		return cubic;
+	}
+	// the first context doubles as the probe to find out which bus each device sits on
+	freenect_context* probe;
+	// contexts share the recording, so start it afresh before any of them appends to it
+	if (params.usb_record)
+		unlink(params.usb_record);
+	cubic_init_context(&probe, params);
+	int shards[count];
+	cubic->context_count = cubic_shard(probe, count, ids, params, shards);
+	for (i = 0; i < cubic->context_count; i++)
+	{
+		// every context owns its own libusb context, thus can be pumped independently
+		if (i == 0)
+			cubic->contexts[i].context = probe;
+		else
+			cubic_init_context(&cubic->contexts[i].context, params);
+		freenect_set_log_level(cubic->contexts[i].context, FREENECT_LOG_WARNING);
+		freenect_select_subdevices(cubic->contexts[i].context, FREENECT_DEVICE_CAMERA);
+		freenect_set_registration_cache(cubic->contexts[i].context, params.calibration_cache);
+		cubic->contexts[i].cubic = cubic;
+		cubic->contexts[i].cpu = params.event_cpu_count > 0 ? params.event_cpus[i % params.event_cpu_count] : -1;
+		cubic->contexts[i].priority = params.event_priority;
+	}
+	cubic_setup_devices(cubic, ids, params, frames, depth);
+	pthread_t bring_ups[count];
+	cubic_bring_up_t args[count];
 	for (i = 0; i < cubic->count; i++)
 	{
-		cubic->devices[i].id = ids[i];
-		freenect_open_device(cubic->context, &cubic->devices[i].device, cubic->devices[i].id);
-		freenect_set_user(cubic->devices[i].device, &cubic->devices[i]);
-		// we defaulting to clockwise Kinects
-		cubic_transform_adjust(cubic, i, 0, i * CUBIC_PI / 3, 0, 0, 0);
-		cubic->devices[i].depth = depth;
-		pthread_mutex_init(&cubic->devices[i].mutex, 0);
-		depth += KINECT_WIDTH * KINECT_HEIGHT;
+		cubic->devices[i].context = shards[i];
+		// opening and preparing a device is a long series of control round trips, do them for all devices at once
+		args[i].device = &cubic->devices[i];
+		args[i].context = cubic->contexts[shards[i]].context;
+		args[i].transfers = params.transfers;
+		args[i].conceal = params.conceal;
+		pthread_create(&bring_ups[i], 0, cubic_bring_up, &args[i]);
 	}
-	// we need another compute thread to do it, because main thread are used for processing events,
-	// and we cannot put any computing on it otherwise will lose frame
-	pthread_create(&cubic->compute, 0, cubic_compute, cubic);
-	pthread_create(&cubic->main, 0, cubic_main, cubic);
+	for (i = 0; i < cubic->count; i++)
+		pthread_join(bring_ups[i], 0);
+	cubic->kickoff = cubic_time();
+	// we need another compute thread to do it, because main threads are used for processing events,
+	// and we cannot put any computing on them otherwise will lose frame, a capture node leaves fusion to the fusion node
+	if (!cubic->sender)
+		cubic_start_compute(cubic, params, cubic_compute);
+	// one event thread per context, so isochronous streams on different host controllers don't contend
+	for (i = 0; i < cubic->context_count; i++)
+		pthread_create(&cubic->contexts[i].main, 0, cubic_main, &cubic->contexts[i]);
 	return cubic;
 }
 
+cubic_stats_t cubic_get_stats(cubic_t* cubic, cubic_device_stats_t* devices)
+{
+	int i;
+	cubic_stats_t stats;
+	stats.cycles = cubic_counter_get(cubic->counters.cycles);
+	stats.fusion_time = stats.cycles > 0 ? cubic_counter_get(cubic->counters.fusion_time) * 1e-9 / stats.cycles : 0;
+	stats.max_fusion_time = cubic_counter_get(cubic->counters.max_fusion_time) * 1e-9;
+	stats.last_fusion_time = cubic_counter_get(cubic->counters.last_fusion_time) * 1e-9;
+	stats.voxels = cubic_counter_get(cubic->counters.voxels);
+	stats.deadline_misses = cubic_counter_get(cubic->counters.deadline_misses);
+	stats.skipped = cubic_counter_get(cubic->counters.skipped);
+	stats.quality = cubic->quality;
+	uint64_t wakeups = cubic_counter_get(cubic->counters.wakeups);
+	stats.wakeup_jitter = wakeups > 0 ? cubic_counter_get(cubic->counters.wakeup_jitter) * 1e-9 / wakeups : 0;
+	stats.max_wakeup_jitter = cubic_counter_get(cubic->counters.max_wakeup_jitter) * 1e-9;
+	stats.pin_failures = cubic_counter_get(cubic->counters.pin_failures) + (cubic->pool ? pool_pin_failures(cubic->pool) : 0);
+	stats.recorded_frames = stats.recording_dropped = 0;
+	stats.recording_error = 0;
+	stats.compression_ratio = stats.encode_rate = 0;
+	if (cubic->sequence)
+	{
+		sequence_stats_t sequence = sequence_writer_stats(cubic->sequence);
+		stats.recorded_frames = sequence.frames;
+		stats.recording_dropped = sequence.dropped;
+		stats.recording_error = sequence.error;
+		stats.compression_ratio = sequence.encoded_bytes > 0 ? (double)sequence.raw_bytes / sequence.encoded_bytes : 0;
+		stats.encode_rate = sequence.encode_time > 0 ? sequence.frames / sequence.encode_time : 0;
+	}
+	if (devices)
+		for (i = 0; i < cubic->count; i++)
+		{
+			cubic_device_t* device = cubic->devices + i;
+			devices[i].frames = cubic_counter_get(device->counters.frames);
+			devices[i].dropped = cubic_counter_get(device->counters.dropped);
+			devices[i].latency = devices[i].frames > 0 ? cubic_counter_get(device->counters.latency) * 1e-9 / devices[i].frames : 0;
+			devices[i].max_latency = cubic_counter_get(device->counters.max_latency) * 1e-9;
+			devices[i].lost_packets = devices[i].resyncs = devices[i].concealed = 0;
+			if (device->device)
+			{
+				freenect_stream_stats stream = freenect_get_depth_stats(device->device);
+				devices[i].lost_packets = stream.lost_packets;
+				devices[i].resyncs = stream.resyncs;
+				devices[i].concealed = stream.concealed;
+			}
+		}
+	return stats;
+}
+
+double cubic_get_latency(cubic_t* cubic, cubic_stage_t stage, double percentile)
+{
+	int i;
+	cubic_histogram_t* histogram = cubic->histograms + stage;
+	uint64_t count = cubic_counter_get(histogram->count);
+	if (count == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(percentile / 100 * count + 0.5), seen = 0;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < CUBIC_HISTOGRAM_BUCKETS - 1; i++)
+	{
+		seen += cubic_counter_get(histogram->buckets[i]);
+		if (seen >= rank)
+			break;
+	}
+	// the middle of the bucket
+	return (cubic_histogram_value(i) + cubic_histogram_value(i + 1)) * 0.5e-6;
+}
+
+int cubic_get_traces(cubic_t* cubic, cubic_trace_t* traces, int n)
+{
+	uint64_t i, head = cubic_counter_get(cubic->trace_head);
+	uint64_t first = head > (uint64_t)n ? head - n : 0;
+	if (head - first > (uint64_t)cubic->trace_depth)
+		first = head - cubic->trace_depth;
+	for (i = first; i < head; i++)
+		traces[i - first] = cubic->traces[i % cubic->trace_depth];
+	// whatever the compute thread may have overwritten while we were copying is stale, drop it
+	uint64_t after = cubic_counter_get(cubic->trace_head);
+	uint64_t valid = after >= (uint64_t)cubic->trace_depth ? after - cubic->trace_depth + 1 : 0;
+	if (valid > first)
+	{
+		if (valid >= head)
+			return 0;
+		memmove(traces, traces + (valid - first), sizeof(cubic_trace_t) * (head - valid));
+		first = valid;
+	}
+	return (int)(head - first);
+}
+
+int cubic_trace_flush(cubic_t* cubic, const char* path)
+{
+	return trace_flush(path);
+}
+
+int cubic_snapshot(cubic_t* cubic, const char* path)
+{
+	int i;
+	cubic_transform_t transforms[cubic->count];
+	for (i = 0; i < cubic->count; i++)
+		transforms[i] = cubic->devices[i].transform;
+	return snapshot_write(path, cubic->cube, cubic->dims, cubic->resolution, transforms, cubic->count);
+}
+
 void cubic_close(cubic_t* cubic)
 {
+	cubic_close_outputs(cubic);
+	if (cubic->replay)
+	{
+		__sync_lock_test_and_set(&cubic->stopping, 1);
+		pthread_join(cubic->compute, 0);
+		// nothing fuses any more, live cubes keep coming after close so their ring and server stay until exit
+		cubic_close_fusion(cubic);
+	}
 }
@@ -7,6 +7,11 @@
 
 #include "libfreenect.h"
 #include "libfreenect-registration.h"
+#include "delta.h"
+#include "node.h"
+#include "pool.h"
+#include "publish.h"
+#include "sequence.h"
 
 typedef struct cubic_transform_t {
 	double m00, m01, m02, m03;
@@ -16,28 +21,202 @@ typedef struct cubic_transform_t {
 	double x, y, z;
 } cubic_transform_t;
 
+typedef struct {
+	double open; // seconds spent opening the device, including fetching its calibration
+	double prepare; // seconds spent building registration tables, setting up streams and registers
+	double start; // seconds from cubic_open until the depth stream was started
+} cubic_startup_t;
+
+struct cubic_t;
+
+// host monotonic times a depth frame went through each stage, 0 if unknown
+typedef struct {
+	int device;
+	double capture; // estimated from the device clock
+	double first_packet;
+	double last_packet;
+	double converted; // libfreenect done converting to mm
+	double copied; // in the device's ring
+	double fusion_start;
+	double fusion_end;
+	double delivered; // on_ready returned
+} cubic_trace_t;
+
+typedef enum {
+	CUBIC_STAGE_TRANSFER = 0, // first to last packet
+	CUBIC_STAGE_CONVERT, // last packet to converted
+	CUBIC_STAGE_COPY, // converted to copied
+	CUBIC_STAGE_QUEUE, // copied to fusion start
+	CUBIC_STAGE_FUSE, // fusion start to end
+	CUBIC_STAGE_DELIVER, // fusion end to delivered
+	CUBIC_STAGE_TOTAL, // capture to delivered
+	CUBIC_STAGE_COUNT,
+} cubic_stage_t;
+
+// levels of cubic_param_t.adaptive, each costs less than the one before: at 0 everything is fused, from 1 on
+// cycles where no device has a new frame and no transform moved are skipped, from 2 on only every
+// 2^(quality - 1)th pixel of every 2^(quality - 1)th row is fused, so voxels get about 4^(quality - 1) times fewer hits
+#define CUBIC_QUALITY_LEVELS (5)
+
+// log-linear buckets in us, 16 per power of two, so any value is within about 6%
+#define CUBIC_HISTOGRAM_BUCKETS (26 * 16)
+
+typedef struct {
+	uint64_t count;
+	uint64_t buckets[CUBIC_HISTOGRAM_BUCKETS];
+} cubic_histogram_t;
+
+typedef struct {
+	uint16_t* depth;
+	double timestamp; // host monotonic time the frame was captured, estimated from the device clock, 0 if the slot is empty or being written
+	int fused; // whether the frame made it into a cube
+	cubic_trace_t trace;
+} cubic_frame_t;
+
+// depths in mm a pixel can land in the cube at, near > far if none
+typedef struct {
+	uint16_t near, far;
+} cubic_range_t;
+
+// columns of a row that can land in the cube at any depth
+typedef struct {
+	int16_t first, last;
+} cubic_span_t;
+
+// which pixels, at which depths, a device's rays can reach the cube with, built from its transform
+// and the cube's bounds so fusion skips the rest without transforming them, slightly wider than exact,
+// points that pass still go through the bounds check
+typedef struct {
+	cubic_range_t* ranges; // row by row
+	cubic_span_t* spans; // one per row
+	uint64_t version; // of the transform it was built for, 0 if not built yet
+	double ref_pix_size;
+	double ref_distance;
+} cubic_mask_t;
+
+// hot path counters, only ever written by one thread and read with atomics, no locks
+typedef struct {
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t latency; // in ns, summed over frames
+	uint64_t max_latency; // in ns
+} cubic_device_counters_t;
+
+typedef struct {
+	uint64_t cycles;
+	uint64_t fusion_time; // in ns, summed over cycles
+	uint64_t max_fusion_time; // in ns
+	uint64_t last_fusion_time; // in ns
+	uint64_t voxels; // voxel hits of the last cycle
+	uint64_t deadline_misses;
+	uint64_t skipped;
+	uint64_t wakeups;
+	uint64_t wakeup_jitter; // in ns, summed over wakeups
+	uint64_t max_wakeup_jitter; // in ns
+	uint64_t pin_failures;
+} cubic_counters_t;
+
+typedef struct {
+	uint64_t frames; // depth frames received
+	uint64_t dropped; // frames replaced in the ring before they were ever fused
+	uint64_t lost_packets;
+	uint64_t resyncs;
+	uint64_t concealed; // frames received with missing packets
+	double latency; // average seconds from capture until the frame was in the ring
+	double max_latency;
+} cubic_device_stats_t;
+
+typedef struct {
+	uint64_t cycles;
+	double fusion_time; // average seconds spent fusing a cube
+	double max_fusion_time;
+	double last_fusion_time;
+	uint64_t voxels; // voxel hits of the last cycle
+	uint64_t deadline_misses; // cycles, including on_ready, that took longer than 1 / refresh_rate
+	uint64_t skipped; // cycles left out because nothing changed since the last cube
+	int quality; // the adaptive mode's current level, see CUBIC_QUALITY_LEVELS
+	double wakeup_jitter; // average seconds the compute thread woke up past when it asked to
+	double max_wakeup_jitter;
+	uint64_t pin_failures; // threads that didn't get the cpus or priority asked for, and buffers that couldn't be locked
+	uint64_t recorded_frames; // depth frames compressed into the sequence, 0 if not recording
+	uint64_t recording_dropped; // depth frames the sequence writer couldn't keep up with
+	int recording_error; // errno of the write that stopped the recording, 0 while it goes to disk
+	double compression_ratio; // raw over compressed bytes of the recorded frames
+	double encode_rate; // in frames per second of the writer thread's time
+} cubic_stats_t;
+
 typedef struct cubic_device_t {
 	int id;
+	int context; // index of the context (and event thread) this device is served by
+	struct cubic_t* cubic;
 	freenect_device* device;
 	pthread_mutex_t mutex;
 	cubic_transform_t transform;
-	uint16_t* depth;
+	uint64_t transform_version; // bumped by every cubic_transform_adjust
+	double fused_at; // capture time of the frame fused last cycle, 0 if none was
+	uint64_t fused_version; // of the transform it was fused with
+	cubic_mask_t mask; // only the compute thread touches it
+	cubic_frame_t* frames; // ring of the most recent depth frames
+	int latest; // slot of the newest frame
+	int reading; // slot the compute thread is fusing, -1 if none
 	double ref_pix_size;
 	double ref_distance;
+	cubic_startup_t startup;
+	cubic_device_counters_t counters;
 } cubic_device_t;
 
-struct cubic_t;
+typedef struct cubic_context_t {
+	freenect_context* context;
+	struct cubic_t* cubic;
+	int cpu; // the cpu event thread pinned to, -1 if it can float
+	int priority; // SCHED_FIFO priority of the event thread, 0 if it stays SCHED_OTHER
+	pthread_t main;
+} cubic_context_t;
+
+typedef enum {
+	CUBIC_SHARD_NONE = 0, // all devices share one context and one event thread
+	CUBIC_SHARD_BY_BUS, // one context per USB bus, thus per host controller
+	CUBIC_SHARD_BY_MAP, // user-defined, device ids[i] goes to context shards[i]
+} cubic_shard_t;
 
 typedef struct cubic_t {
-	freenect_context* context;
+	cubic_context_t* contexts;
+	int context_count;
 	cubic_device_t* devices;
 	int count;
 	size_t dims[3];
 	double resolution;
 	double refresh_rate;
-	uint32_t* cube;
+	double start_stagger;
+	double epoch; // when cubic_open was called, startup times are relative to it
+	double kickoff; // when all devices were prepared, stream starts are staggered from it
+	int history; // depth frames kept per device
+	double max_skew; // frames captured further than this from the target are left out
+	double target; // capture time the last cube was fused for
+	double skew; // spread of capture times of the frames fused into the last cube
+	int fused; // devices that had a frame within max_skew of the target
+	int adaptive;
+	int quality; // the last cube was fused at, see CUBIC_QUALITY_LEVELS
+	int over, under; // cycles in a row over budget, and with room to spare
+	uint32_t* cube; // the one fused last, in on_ready, it moves around the shared ring when publishing
 	void (*on_ready)(struct cubic_t*);
-	pthread_t main, compute;
+	cubic_counters_t counters;
+	cubic_histogram_t* histograms; // one per stage
+	cubic_trace_t* traces; // ring of the most recently fused frames
+	int trace_depth;
+	uint64_t trace_head; // traces ever recorded
+	sequence_writer_t* sequence; // depth frames are archived to it, if recording
+	pthread_rwlock_t outputs; // event threads hold it for reading while they push to sequence or sender, cubic_close for writing to detach them
+	publish_t* publish; // cubes are fused into its shared-memory ring, if publishing
+	delta_server_t* server; // streams occupancy changes to remote consoles, if serving
+	node_sender_t* sender; // depth goes to a fusion node instead of being fused here, if a capture node
+	node_receiver_t* receiver; // depth comes from capture nodes instead of local devices, if the fusion node
+	int node_base;
+	sequence_reader_t* replay; // the sequence fused instead of live devices, if replaying one
+	int stopping; // cubic_close asked the replay to stop
+	int finished; // the replay has fused its last frame, no more on_ready calls will come
+	pool_t* pool; // workers every stage of a cycle splits its work across, 0 on a capture node
+	pthread_t compute;
 } cubic_t;
 
 typedef struct {
@@ -45,11 +224,61 @@ typedef struct {
 	double resolution; // in terms of mm
 	double refresh_rate;
 	void (*on_ready)(struct cubic_t*);
+	cubic_shard_t shard; // how devices are spread across USB contexts, each has its own event thread
+	int* shards; // for CUBIC_SHARD_BY_MAP, one context index per device, indices must be dense from 0, cubic_open fails otherwise
+	int* event_cpus; // optional, event thread of context i is pinned to event_cpus[i % event_cpu_count]
+	int event_cpu_count;
+	int event_priority; // optional, SCHED_FIFO priority of event threads, needs CAP_SYS_NICE, 0 leaves them SCHED_OTHER
+	int* compute_cpus; // optional, the compute thread is kept to these cpus
+	int compute_cpu_count;
+	int compute_priority; // optional, SCHED_FIFO priority of the compute thread, below event threads' so it can't starve them
+	double start_stagger; // in seconds, the gap between starting depth streams of successive devices, 0.1 if not set
+	const char* calibration_cache; // optional, directory to cache per-serial calibration and registration tables in
+	freenect_transfer_depth transfers; // isochronous transfer depth of each depth stream, zeroed for the defaults
+	freenect_concealment conceal; // keep depth frames with lost packets, only rows that arrived complete are fused
+	int history; // depth frames kept per device to pick time-aligned ones from, 3 if not set
+	double max_skew; // in seconds, a device's frame further than this from the fusion target time is left out, 1 / 60 if not set
+	int trace_depth; // how many of the most recently fused frames' traces are kept, 256 if not set
+	int trace_events; // opt-in timeline tracing, events each thread buffers between cubic_trace_flush calls, 0 for off
+	const char* usb_record; // optional, file to record the devices' USB traffic to, replaced if it exists
+	const char* usb_replay; // optional, a recording to replay instead of opening devices, ids refer to the devices recorded
+	freenect_replay_speed replay_speed; // whether a replay or virtual devices keep real time or run as fast as fusion goes
+	int virtual_count; // optional, simulate this many devices instead of opening real ones
+	freenect_virtual_pose* virtual_poses; // optional, one per virtual device, also used as the devices' transforms
+	const char* sequence; // optional, file to archive every device's millimeter depth frames to, compressed, replaced if it exists
+	int sequence_queue; // depth frames waiting to be compressed before more are dropped from the archive, 32 if not set
+	const char* publish; // optional, shm_open name to publish every cube under for other processes, see publish.h
+	int publish_slots; // cubes in the shared ring, a reader has slots - 1 cycles to finish with one, 3 if not set
+	uint32_t publish_threshold; // also publish a bitmask of voxels with at least this many hits, 0 for none
+	int serve_port; // optional, TCP port to stream occupancy changes of every cube on, see delta.h
+	uint32_t serve_threshold; // hits for a voxel to count as occupied on the stream, 1 if not set
+	int serve_backlog; // messages a console may fall behind before its updates are dropped for a keyframe, 8 if not set
+	const char* fusion_host; // optional, be a capture node: ship every device's depth to the fusion node there instead of fusing it
+	int fusion_port;
+	int node_base; // for a capture node, its devices are known to the fusion node as node_base + ids[i], which stays below NODE_MAX_DEVICES
+	int node_port; // optional, be the fusion node: fuse depth from capture nodes connecting here, ids are what the nodes call their devices
+	const char* sequence_replay; // optional, a sequence to fuse instead of opening devices, as fast as it decodes, ids refer to the devices recorded
+	int pool_threads; // workers fusion, publishing and serving split their work across besides the compute thread, one per online cpu but one if not set
+	int* pool_cpus; // optional, worker i is pinned to pool_cpus[i % pool_cpu_count]
+	int pool_cpu_count;
+	int pool_priority; // optional, SCHED_FIFO priority of pool workers
+	int adaptive; // when cycles run over 1 / refresh_rate, trade quality for keeping up, see CUBIC_QUALITY_LEVELS
+	int lock_memory; // mlock rings and the cube, so no page fault stalls event or compute threads, needs RLIMIT_MEMLOCK
 } cubic_param_t;
 
 // using open / close semantics because you can only have one cubic instance at the same time for the whole application
 cubic_t* __attribute__((warn_unused_result)) cubic_open(int count, int ids[], cubic_param_t params);
 void cubic_transform_adjust(cubic_t* cubic, int id, float yaw, float pitch, float x, float y, float z);
+// devices is optional, if given it has room for one entry per device
+cubic_stats_t cubic_get_stats(cubic_t* cubic, cubic_device_stats_t* devices);
+// in seconds, the given percentile (0 to 100) of a stage's latency over all fused frames
+double cubic_get_latency(cubic_t* cubic, cubic_stage_t stage, double percentile);
+// copies up to n of the most recent frame traces, oldest first, returns how many
+int cubic_get_traces(cubic_t* cubic, cubic_trace_t* traces, int n);
+// appends the timeline recorded since the last flush to a Chrome trace JSON file, returns 0 on success
+int cubic_trace_flush(cubic_t* cubic, const char* path);
+// writes the cube with its dims, resolution and device transforms as a sparse snapshot, call it from on_ready so the cube is whole
+int cubic_snapshot(cubic_t* cubic, const char* path);
 void cubic_close(cubic_t* cubic);
 
 #endif
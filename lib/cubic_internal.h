@@ -0,0 +1,15 @@
+#ifndef _GUARD_CUBIC_INTERNAL_H_
+#define _GUARD_CUBIC_INTERNAL_H_
+
+#include "cubic.h"
+
+// The per-frame kernels of cubic.c, exposed for bench to measure, not part of the library's interface.
+
+// fuses rows [begin, end) of a frame, every stride-th pixel of every stride-th row, returns the number
+// of points that landed in the cube, shared when other threads add to the same cube at the same time,
+// mask is optional, pixels and depths it rules out are skipped
+uint64_t cubic_depth_rows_to_cube(uint16_t* depth, int begin, int end, int stride, const cubic_mask_t* mask, double resolution, size_t dims[static 3], double ref_pix_size, double ref_distance, cubic_transform_t transform, uint32_t* cube, int shared);
+// builds rows [begin, end) of mask for a device at transform, mask's ref_pix_size and ref_distance set
+void cubic_mask_rows(cubic_mask_t* mask, int begin, int end, double resolution, size_t dims[static 3], cubic_transform_t transform);
+
+#endif
@@ -0,0 +1,618 @@
+#include "delta.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define DELTA_VERSION 1
+#define DELTA_WORDS (DELTA_BRICK * DELTA_BRICK * DELTA_BRICK / 64)
+
+// shared by every client it is queued to, freed with the last reference
+typedef struct {
+	int refs;
+	size_t size;
+	uint8_t data[];
+} delta_buffer_t;
+
+typedef struct {
+	int fd;
+	delta_buffer_t** queue; // ring of backlog + 1, the extra for the hello
+	int head, count;
+	size_t sent; // bytes of the head already written
+	int keyframe; // needs one before any more updates make sense
+} delta_peer_t;
+
+struct delta_server_t {
+	int fd;
+	int port;
+	int wake[2]; // pipe the publisher pokes the network thread through
+	size_t dims[3];
+	size_t bricks[3];
+	size_t brick_count;
+	uint32_t threshold;
+	int backlog;
+	uint64_t* occupancy; // as last published, DELTA_WORDS per brick
+	uint64_t* next; // scratch for the cube being published
+	uint8_t* scratch; // encoded payload, big enough for every brick
+	uint64_t version;
+	delta_buffer_t* hello;
+	delta_peer_t peers[DELTA_MAX_CLIENTS];
+	int peer_count;
+	int closing;
+	delta_stats_t stats;
+	pthread_mutex_t mutex;
+	pthread_t thread;
+};
+
+struct delta_client_t {
+	int fd;
+	delta_hello_t hello;
+	size_t bricks[3];
+	size_t brick_count;
+	uint64_t* occupancy;
+	uint64_t version;
+	int synced; // a keyframe arrived
+	uint8_t* payload;
+	size_t capacity;
+};
+
+static size_t delta_bricks(size_t dim)
+{
+	return (dim + DELTA_BRICK - 1) / DELTA_BRICK;
+}
+
+static delta_buffer_t* delta_buffer_new(const void* header, size_t header_size, const void* payload, size_t payload_size)
+{
+	delta_buffer_t* buffer = (delta_buffer_t*)malloc(sizeof(delta_buffer_t) + header_size + payload_size);
+	buffer->refs = 0;
+	buffer->size = header_size + payload_size;
+	memcpy(buffer->data, header, header_size);
+	if (payload_size)
+		memcpy(buffer->data + header_size, payload, payload_size);
+	return buffer;
+}
+
+static void delta_buffer_release(delta_buffer_t* buffer)
+{
+	if (--buffer->refs == 0)
+		free(buffer);
+}
+
+typedef struct {
+	delta_server_t* server;
+	const uint32_t* cube;
+	uint64_t* occupancy;
+} delta_slab_t;
+
+// slices of z never share a word, so they fill in apart
+static void delta_occupancy_slab(void* data, int begin, int end)
+{
+	delta_slab_t* slab = (delta_slab_t*)data;
+	delta_server_t* server = slab->server;
+	size_t x, y, z;
+	for (z = begin; z < (size_t)end; z++)
+		for (y = 0; y < server->dims[1]; y++)
+		{
+			const uint32_t* row = slab->cube + (z * server->dims[1] + y) * server->dims[0];
+			uint64_t* words = slab->occupancy + ((z / DELTA_BRICK * server->bricks[1] + y / DELTA_BRICK) * server->bricks[0]) * DELTA_WORDS + z % DELTA_BRICK;
+			int shift = (y % DELTA_BRICK) * 8;
+			for (x = 0; x < server->dims[0]; x += DELTA_BRICK)
+			{
+				uint64_t bits = 0;
+				size_t i, n = server->dims[0] - x < DELTA_BRICK ? server->dims[0] - x : DELTA_BRICK;
+				for (i = 0; i < n; i++)
+					bits |= (uint64_t)(row[x + i] >= server->threshold) << i;
+				words[(x / DELTA_BRICK) * DELTA_WORDS] |= bits << shift;
+			}
+		}
+}
+
+// occupancy of every brick, word z, byte y, bit x of the brick
+static void delta_occupancy(delta_server_t* server, const uint32_t* cube, uint64_t* occupancy, pool_t* pool)
+{
+	memset(occupancy, 0, sizeof(uint64_t) * DELTA_WORDS * server->brick_count);
+	delta_slab_t slab;
+	slab.server = server;
+	slab.cube = cube;
+	slab.occupancy = occupancy;
+	if (pool)
+		pool_for(pool, server->dims[2], 4, delta_occupancy_slab, &slab);
+	else
+		delta_occupancy_slab(&slab, 0, server->dims[2]);
+}
+
+static inline uint8_t* delta_put(uint8_t* out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		*out++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+// the bricks whose words (XORed with base's if given) are not all zero
+static size_t delta_encode(delta_server_t* server, const uint64_t* occupancy, const uint64_t* base, uint8_t* payload)
+{
+	uint8_t* out = payload;
+	size_t i, last = 0;
+	int j;
+	for (i = 0; i < server->brick_count; i++)
+	{
+		uint64_t words[DELTA_WORDS];
+		uint8_t present = 0;
+		for (j = 0; j < DELTA_WORDS; j++)
+		{
+			words[j] = occupancy[i * DELTA_WORDS + j] ^ (base ? base[i * DELTA_WORDS + j] : 0);
+			if (words[j])
+				present |= 1 << j;
+		}
+		if (!present)
+			continue;
+		out = delta_put(out, i - last);
+		last = i + 1;
+		*out++ = present;
+		for (j = 0; j < DELTA_WORDS; j++)
+			if (words[j])
+			{
+				memcpy(out, words + j, sizeof(uint64_t));
+				out += sizeof(uint64_t);
+			}
+	}
+	return out - payload;
+}
+
+static void delta_peer_push(delta_server_t* server, delta_peer_t* peer, delta_buffer_t* buffer)
+{
+	++buffer->refs;
+	peer->queue[(peer->head + peer->count) % (server->backlog + 1)] = buffer;
+	++peer->count;
+	server->stats.bytes += buffer->size;
+}
+
+// throws away all that is queued but a message half written, which the stream needs to stay framed, or the hello
+static void delta_peer_drop(delta_server_t* server, delta_peer_t* peer)
+{
+	int keep = peer->count > 0 && (peer->sent > 0 || peer->queue[peer->head] == server->hello) ? 1 : 0;
+	while (peer->count > keep)
+	{
+		--peer->count;
+		delta_buffer_release(peer->queue[(peer->head + peer->count) % (server->backlog + 1)]);
+	}
+}
+
+static void delta_peer_close(delta_server_t* server, int i)
+{
+	delta_peer_t* peer = server->peers + i;
+	close(peer->fd);
+	while (peer->count > 0)
+	{
+		delta_buffer_release(peer->queue[peer->head]);
+		peer->head = (peer->head + 1) % (server->backlog + 1);
+		--peer->count;
+	}
+	free(peer->queue);
+	server->peers[i] = server->peers[--server->peer_count];
+}
+
+// writes what the socket takes without blocking, returns -1 if the peer is gone
+static int delta_peer_flush(delta_server_t* server, delta_peer_t* peer)
+{
+	while (peer->count > 0)
+	{
+		delta_buffer_t* buffer = peer->queue[peer->head];
+		ssize_t written = send(peer->fd, buffer->data + peer->sent, buffer->size - peer->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (written < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+		peer->sent += written;
+		if (peer->sent < buffer->size)
+			return 0;
+		delta_buffer_release(buffer);
+		peer->sent = 0;
+		peer->head = (peer->head + 1) % (server->backlog + 1);
+		--peer->count;
+	}
+	return 0;
+}
+
+static void* delta_server_main(void* data)
+{
+	delta_server_t* server = (delta_server_t*)data;
+	struct pollfd fds[DELTA_MAX_CLIENTS + 2];
+	int i;
+	for (;;)
+	{
+		pthread_mutex_lock(&server->mutex);
+		if (server->closing)
+		{
+			pthread_mutex_unlock(&server->mutex);
+			break;
+		}
+		int count = server->peer_count;
+		fds[0].fd = server->wake[0];
+		fds[0].events = POLLIN;
+		fds[1].fd = server->fd;
+		fds[1].events = count < DELTA_MAX_CLIENTS ? POLLIN : 0;
+		for (i = 0; i < count; i++)
+		{
+			fds[i + 2].fd = server->peers[i].fd;
+			fds[i + 2].events = POLLIN | (server->peers[i].count > 0 ? POLLOUT : 0);
+		}
+		pthread_mutex_unlock(&server->mutex);
+		if (poll(fds, count + 2, -1) < 0)
+			continue;
+		if (fds[0].revents & POLLIN)
+		{
+			char buffer[64];
+			while (read(server->wake[0], buffer, sizeof(buffer)) > 0);
+		}
+		pthread_mutex_lock(&server->mutex);
+		// from the back, closing a peer moves the last one into its place
+		for (i = count - 1; i >= 0; i--)
+		{
+			delta_peer_t* peer = server->peers + i;
+			int failed = fds[i + 2].revents & (POLLERR | POLLNVAL);
+			if (fds[i + 2].revents & (POLLIN | POLLHUP))
+			{
+				// clients have nothing to say, anything readable is either noise or the end
+				char buffer[256];
+				ssize_t size = recv(peer->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+				if (size == 0 || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+					failed = 1;
+			}
+			if (!failed && delta_peer_flush(server, peer) < 0)
+				failed = 1;
+			if (failed)
+				delta_peer_close(server, i);
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			int fd = accept(server->fd, 0, 0);
+			if (fd >= 0 && server->peer_count < DELTA_MAX_CLIENTS)
+			{
+				int one = 1;
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				delta_peer_t* peer = server->peers + server->peer_count++;
+				peer->fd = fd;
+				peer->queue = (delta_buffer_t**)malloc(sizeof(delta_buffer_t*) * (server->backlog + 1));
+				peer->head = peer->count = 0;
+				peer->sent = 0;
+				peer->keyframe = 1;
+				delta_peer_push(server, peer, server->hello);
+			} else if (fd >= 0)
+				close(fd);
+		}
+		server->stats.clients = server->peer_count;
+		pthread_mutex_unlock(&server->mutex);
+	}
+	return 0;
+}
+
+delta_server_t* delta_server_open(int port, const size_t dims[3], double resolution, uint32_t threshold, int backlog)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	socklen_t length = sizeof(address);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0 ||
+		getsockname(fd, (struct sockaddr*)&address, &length) < 0)
+	{
+		close(fd);
+		return 0;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	delta_server_t* server = (delta_server_t*)malloc(sizeof(delta_server_t));
+	memset(server, 0, sizeof(delta_server_t));
+	server->fd = fd;
+	server->port = ntohs(address.sin_port);
+	if (pipe(server->wake) < 0)
+	{
+		close(fd);
+		free(server);
+		return 0;
+	}
+	fcntl(server->wake[0], F_SETFL, fcntl(server->wake[0], F_GETFL) | O_NONBLOCK);
+	fcntl(server->wake[1], F_SETFL, fcntl(server->wake[1], F_GETFL) | O_NONBLOCK);
+	int i;
+	for (i = 0; i < 3; i++)
+	{
+		server->dims[i] = dims[i];
+		server->bricks[i] = delta_bricks(dims[i]);
+	}
+	server->brick_count = server->bricks[0] * server->bricks[1] * server->bricks[2];
+	server->threshold = threshold > 0 ? threshold : 1;
+	server->backlog = backlog > 0 ? backlog : 8;
+	server->occupancy = (uint64_t*)calloc(server->brick_count * DELTA_WORDS, sizeof(uint64_t));
+	server->next = (uint64_t*)malloc(sizeof(uint64_t) * server->brick_count * DELTA_WORDS);
+	// a brick takes at most a 10 byte gap, the presence byte and all its words
+	server->scratch = (uint8_t*)malloc(server->brick_count * (11 + sizeof(uint64_t) * DELTA_WORDS));
+	delta_hello_t hello;
+	memcpy(hello.magic, "CBDS", 4);
+	hello.version = DELTA_VERSION;
+	hello.dims[0] = dims[0];
+	hello.dims[1] = dims[1];
+	hello.dims[2] = dims[2];
+	hello.threshold = server->threshold;
+	hello.resolution = resolution;
+	server->hello = delta_buffer_new(&hello, sizeof(hello), 0, 0);
+	server->hello->refs = 1; // the server's own, so it outlives every peer
+	pthread_mutex_init(&server->mutex, 0);
+	pthread_create(&server->thread, 0, delta_server_main, server);
+	return server;
+}
+
+int delta_server_port(delta_server_t* server)
+{
+	return server->port;
+}
+
+void delta_server_publish(delta_server_t* server, const uint32_t* cube, double target, pool_t* pool)
+{
+	int i;
+	delta_occupancy(server, cube, server->next, pool);
+	delta_message_t header;
+	header.type = DELTA_UPDATE;
+	header.version = server->version;
+	header.base = server->version - 1;
+	header.target = target;
+	header.size = delta_encode(server, server->next, server->occupancy, server->scratch);
+	delta_buffer_t* update = delta_buffer_new(&header, sizeof(header), server->scratch, header.size);
+	update->refs = 1;
+	uint64_t* swap = server->occupancy;
+	server->occupancy = server->next;
+	server->next = swap;
+	pthread_mutex_lock(&server->mutex);
+	int keyframes = 0;
+	for (i = 0; i < server->peer_count; i++)
+		if (server->peers[i].keyframe)
+			++keyframes;
+	pthread_mutex_unlock(&server->mutex);
+	// encoded outside of the lock, a peer can only go from needing one to not under the publisher
+	delta_buffer_t* keyframe = 0;
+	if (keyframes > 0)
+	{
+		header.type = DELTA_KEYFRAME;
+		header.base = server->version;
+		header.size = delta_encode(server, server->occupancy, 0, server->scratch);
+		keyframe = delta_buffer_new(&header, sizeof(header), server->scratch, header.size);
+		keyframe->refs = 1;
+	}
+	pthread_mutex_lock(&server->mutex);
+	for (i = 0; i < server->peer_count; i++)
+	{
+		delta_peer_t* peer = server->peers + i;
+		if (peer->keyframe)
+		{
+			// joined after the keyframe was encoded, wait for the next cycle
+			if (!keyframe || peer->count >= server->backlog)
+				continue;
+			delta_peer_push(server, peer, keyframe);
+			peer->keyframe = 0;
+			++server->stats.keyframes;
+		} else if (peer->count >= server->backlog) {
+			delta_peer_drop(server, peer);
+			peer->keyframe = 1;
+			++server->stats.dropped;
+		} else {
+			delta_peer_push(server, peer, update);
+			++server->stats.updates;
+		}
+	}
+	++server->version;
+	delta_buffer_release(update);
+	if (keyframe)
+		delta_buffer_release(keyframe);
+	pthread_mutex_unlock(&server->mutex);
+	char poke = 0;
+	if (write(server->wake[1], &poke, 1) < 0)
+		return;
+}
+
+delta_stats_t delta_server_stats(delta_server_t* server)
+{
+	pthread_mutex_lock(&server->mutex);
+	delta_stats_t stats = server->stats;
+	pthread_mutex_unlock(&server->mutex);
+	return stats;
+}
+
+void delta_server_close(delta_server_t* server)
+{
+	pthread_mutex_lock(&server->mutex);
+	server->closing = 1;
+	pthread_mutex_unlock(&server->mutex);
+	char poke = 0;
+	if (write(server->wake[1], &poke, 1) < 0)
+		poke = 1;
+	pthread_join(server->thread, 0);
+	while (server->peer_count > 0)
+		delta_peer_close(server, server->peer_count - 1);
+	delta_buffer_release(server->hello);
+	close(server->fd);
+	close(server->wake[0]);
+	close(server->wake[1]);
+	free(server->occupancy);
+	free(server->next);
+	free(server->scratch);
+	pthread_mutex_destroy(&server->mutex);
+	free(server);
+}
+
+static int delta_read(int fd, void* data, size_t size)
+{
+	uint8_t* bytes = (uint8_t*)data;
+	while (size > 0)
+	{
+		ssize_t got = recv(fd, bytes, size, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		bytes += got;
+		size -= got;
+	}
+	return 0;
+}
+
+delta_client_t* delta_client_connect(const char* host, int port)
+{
+	struct addrinfo hints, *addresses, *address;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+	if (getaddrinfo(host, service, &hints, &addresses) != 0)
+		return 0;
+	int fd = -1;
+	for (address = addresses; address; address = address->ai_next)
+	{
+		fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if (fd < 0)
+		return 0;
+	delta_client_t* client = (delta_client_t*)malloc(sizeof(delta_client_t));
+	memset(client, 0, sizeof(delta_client_t));
+	client->fd = fd;
+	if (delta_read(fd, &client->hello, sizeof(delta_hello_t)) < 0 || memcmp(client->hello.magic, "CBDS", 4) != 0 || client->hello.version != DELTA_VERSION)
+	{
+		close(fd);
+		free(client);
+		return 0;
+	}
+	int i;
+	for (i = 0; i < 3; i++)
+		client->bricks[i] = delta_bricks(client->hello.dims[i]);
+	client->brick_count = client->bricks[0] * client->bricks[1] * client->bricks[2];
+	client->occupancy = (uint64_t*)calloc(client->brick_count * DELTA_WORDS, sizeof(uint64_t));
+	return client;
+}
+
+void delta_client_dims(delta_client_t* client, size_t dims[3], double* resolution, uint32_t* threshold)
+{
+	dims[0] = client->hello.dims[0];
+	dims[1] = client->hello.dims[1];
+	dims[2] = client->hello.dims[2];
+	if (resolution)
+		*resolution = client->hello.resolution;
+	if (threshold)
+		*threshold = client->hello.threshold;
+}
+
+static int delta_apply(delta_client_t* client, const uint8_t* payload, size_t size, int keyframe)
+{
+	const uint8_t* end = payload + size;
+	size_t brick = 0;
+	int j;
+	if (keyframe)
+		memset(client->occupancy, 0, sizeof(uint64_t) * DELTA_WORDS * client->brick_count);
+	while (payload < end)
+	{
+		uint64_t gap = 0;
+		int shift = 0;
+		for (;;)
+		{
+			if (payload >= end || shift > 63)
+				return -1;
+			uint8_t byte = *payload++;
+			gap |= (uint64_t)(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				break;
+			shift += 7;
+		}
+		brick += gap;
+		if (brick >= client->brick_count || payload >= end)
+			return -1;
+		uint8_t present = *payload++;
+		uint64_t* words = client->occupancy + brick * DELTA_WORDS;
+		for (j = 0; j < DELTA_WORDS; j++)
+			if (present & (1 << j))
+			{
+				uint64_t word;
+				if (payload + sizeof(uint64_t) > end)
+					return -1;
+				memcpy(&word, payload, sizeof(uint64_t));
+				payload += sizeof(uint64_t);
+				words[j] ^= word;
+			}
+		++brick;
+	}
+	return 0;
+}
+
+int delta_client_next(delta_client_t* client, delta_message_t* message)
+{
+	for (;;)
+	{
+		if (delta_read(client->fd, message, sizeof(delta_message_t)) < 0)
+			return -1;
+		if (message->size > client->capacity)
+		{
+			client->capacity = message->size;
+			client->payload = (uint8_t*)realloc(client->payload, client->capacity);
+		}
+		if (delta_read(client->fd, client->payload, message->size) < 0)
+			return -1;
+		if (message->type == DELTA_KEYFRAME)
+			client->synced = 1;
+		else if (message->type != DELTA_UPDATE)
+			continue;
+		// an update for another base than what we have means the stream is broken
+		else if (!client->synced || message->base != client->version)
+			return -1;
+		if (delta_apply(client, client->payload, message->size, message->type == DELTA_KEYFRAME) < 0)
+			return -1;
+		client->version = message->version;
+		return 0;
+	}
+}
+
+int delta_client_voxel(delta_client_t* client, size_t x, size_t y, size_t z)
+{
+	if (x >= client->hello.dims[0] || y >= client->hello.dims[1] || z >= client->hello.dims[2])
+		return 0;
+	const uint64_t* words = client->occupancy + ((z / DELTA_BRICK * client->bricks[1] + y / DELTA_BRICK) * client->bricks[0] + x / DELTA_BRICK) * DELTA_WORDS;
+	return (words[z % DELTA_BRICK] >> ((y % DELTA_BRICK) * 8 + x % DELTA_BRICK)) & 1;
+}
+
+void delta_client_cube(delta_client_t* client, uint32_t* cube)
+{
+	size_t x, y, z;
+	for (z = 0; z < client->hello.dims[2]; z++)
+		for (y = 0; y < client->hello.dims[1]; y++)
+			for (x = 0; x < client->hello.dims[0]; x++)
+				*cube++ = delta_client_voxel(client, x, y, z);
+}
+
+void delta_client_close(delta_client_t* client)
+{
+	close(client->fd);
+	free(client->occupancy);
+	free(client->payload);
+	free(client);
+}
@@ -0,0 +1,73 @@
+#ifndef _GUARD_DELTA_H_
+#define _GUARD_DELTA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+// Streams the fused volume's occupancy to other machines over TCP.  A voxel is occupied when
+// it has at least threshold hits.  The volume is cut into 8x8x8 bricks whose occupancy is 8
+// 64 bit words, one per z slice, one byte per row.  Every cycle the server sends the bricks
+// that changed, as the XOR of their old and new words, keeping only the words that are not
+// zero.  A client joining late, or one that fell so far behind its queue filled up, has its
+// queued deltas thrown away and gets a keyframe of every occupied brick instead, so a slow
+// console never holds up fusion or the other consoles.
+//
+// The wire format is host byte order: a delta_hello_t, then messages, each a delta_message_t
+// and its payload.  A payload is a list of bricks, each the varint gap in brick index since
+// the last one listed, a byte with a bit per word present, and those words.
+
+#define DELTA_BRICK (8)
+#define DELTA_MAX_CLIENTS (64)
+
+typedef enum {
+	DELTA_KEYFRAME = 1, // words are the brick's occupancy
+	DELTA_UPDATE = 2, // words are XORed into the brick's occupancy
+} delta_type_t;
+
+typedef struct {
+	char magic[4]; // CBDS
+	uint32_t version;
+	uint32_t dims[3];
+	uint32_t threshold;
+	double resolution;
+} delta_hello_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t size; // of the payload
+	uint64_t version; // cycles the server published before this one
+	uint64_t base; // the version an update applies to, a keyframe's own
+	double target; // as cubic_t.target
+} delta_message_t;
+
+typedef struct delta_server_t delta_server_t;
+typedef struct delta_client_t delta_client_t;
+
+typedef struct {
+	int clients;
+	uint64_t keyframes;
+	uint64_t updates;
+	uint64_t dropped; // updates thrown away for clients that were too slow
+	uint64_t bytes; // queued to clients
+} delta_stats_t;
+
+// port 0 picks a free one, backlog is how many messages a client may be behind, 8 if 0
+delta_server_t* delta_server_open(int port, const size_t dims[3], double resolution, uint32_t threshold, int backlog);
+int delta_server_port(delta_server_t* server);
+// encodes what changed since the last cube and queues it to every client, only the compute thread calls it, pool optional
+void delta_server_publish(delta_server_t* server, const uint32_t* cube, double target, pool_t* pool);
+delta_stats_t delta_server_stats(delta_server_t* server);
+void delta_server_close(delta_server_t* server);
+
+delta_client_t* delta_client_connect(const char* host, int port);
+void delta_client_dims(delta_client_t* client, size_t dims[3], double* resolution, uint32_t* threshold);
+// blocks for the next message and applies it, returns -1 once the connection is gone or the stream is broken
+int delta_client_next(delta_client_t* client, delta_message_t* message);
+int delta_client_voxel(delta_client_t* client, size_t x, size_t y, size_t z);
+// the occupancy as a cube laid out as cubic_t.cube, 1 for occupied voxels
+void delta_client_cube(delta_client_t* client, uint32_t* cube);
+void delta_client_close(delta_client_t* client);
+
+#endif
@@ -32,7 +32,8 @@
 #include "libfreenect.h"
 #include "libfreenect-registration.h"
 
-typedef void (*fnusb_iso_cb)(freenect_device *dev, uint8_t *buf, int len);
+// called once per completed transfer with all its packets, packet i starts at buf + i * stride
+typedef void (*fnusb_iso_cb)(freenect_device *dev, uint8_t *buf, int stride, const int *lens, int n);
 
 #include "usb_libusb10.h"
 
@@ -42,6 +43,7 @@ struct _freenect_context {
 	fnusb_ctx usb;
 	freenect_device_flags enabled_subdevices;
 	freenect_device *first;
+	char *registration_cache; // directory holding per-serial calibration cache files, NULL if disabled
 };
 
 #define LL_FATAL FREENECT_LOG_FATAL
@@ -122,8 +124,24 @@ static inline int32_t fn_le32s(int32_t s)
 #define PID_NUI_CAMERA 0x02ae
 #define PID_NUI_MOTOR 0x02b0
 
+// Maps a stream's device timestamps to host monotonic time.  A line is fitted
+// through (device time, arrival time) of every frame's first packet, and the
+// lower envelope of the arrivals around it gives the offset, as the fastest
+// arrivals are the ones closest to capture.
+typedef struct {
+	int samples;
+	uint32_t last; // last raw device timestamp
+	int64_t ticks; // last device timestamp, unwrapped, relative to the first one
+	double mx, my; // weighted means of device ticks and arrival times
+	double cxx, cxy; // weighted covariances of the same
+	double rate; // host seconds per device tick
+	double envelope; // lowest arrival relative to the fitted line, leaking upward slowly
+	double arrival; // arrival of the last sample
+} fn_clock_model;
+
 typedef struct {
 	int running;
+	int prepared; // everything but the final stream-start command is done
 	uint8_t flag;
 	int synced;
 	uint8_t seq;
@@ -135,9 +153,28 @@ typedef struct {
 	int last_pkt_size;
 	int valid_pkts;
 	int valid_frames;
+	uint64_t lost_pkts; // written only by the event thread, read atomically by freenect_get_*_stats
+	uint64_t resyncs;
+	int adaptive; // whether the transfer depth follows lost packets and resyncs
+	int adapt_pkts; // packets seen in the current controller window
+	uint64_t adapt_events; // lost_pkts + resyncs when the current window started
+	int adapt_calm; // windows in a row without trouble
+	int conceal; // freenect_concealment, keep frames with missing packets instead of resyncing
+	uint8_t fill; // byte missing packets are filled with by FREENECT_CONCEAL_INVALID
+	int rows; // rows in a frame, for the validity mask
+	uint64_t concealed_frames;
+	uint8_t *pkt_valid; // which packets of the frame in progress arrived
+	uint8_t *row_valid; // which rows of the last delivered frame are complete
 	int variable_length;
 	uint32_t last_timestamp;
 	uint32_t timestamp;
+	double arrival; // estimated host arrival of the packet being processed
+	int sof_seen; // whether the first packet of the frame in progress arrived
+	uint32_t sof_timestamp;
+	double sof_arrival;
+	fn_clock_model clock;
+	double host_timestamp; // host time of the last delivered frame, per the clock model
+	freenect_frame_times times; // when the last delivered frame went through each stage
 	int split_bufs;
 	void *lib_buf;
 	void *usr_buf;
@@ -154,11 +191,14 @@ struct _freenect_device {
 	void *user_data;
 
 	uint8_t hwrev;
+	char camera_serial[128]; // empty if the camera has no serial number
 
 	// Cameras
 	fnusb_dev usb_cam;
 	fnusb_isoc_stream depth_isoc;
 	fnusb_isoc_stream video_isoc;
+	freenect_transfer_depth depth_transfers;
+	freenect_transfer_depth video_transfers;
 
 	freenect_depth_cb depth_cb;
 	freenect_video_cb video_cb;
@@ -175,6 +215,8 @@ struct _freenect_device {
 
 	// Registration
 	freenect_registration registration;
+	void *registration_cache; // read-only mapping of this camera's calibration cache file, if any
+	size_t registration_cache_size;
 
 	// Motor
 	fnusb_dev usb_motor;
@@ -105,6 +105,7 @@ typedef struct {
 	int32_t* depth_to_rgb_shift;
 	int32_t (*registration_table)[2];  // A table of 640*480 pairs of x,y values.
 	                                   // Index first by pixel, then x:0 and y:1.
+	int mapped; // tables point into a read-only calibration cache owned by the device, they are not freed
 } freenect_registration;
 
 
@@ -112,6 +113,8 @@ typedef struct {
 // come later
 freenect_registration freenect_copy_registration(freenect_device* dev);
 int freenect_destroy_registration(freenect_registration* reg);
+// only the zero plane parameters, without copying any of the tables, cheap enough to call per frame
+freenect_zero_plane_info freenect_get_zero_plane_info(freenect_device* dev);
 
 // convenience function to convert a single x-y coordinate pair from camera
 // to world coordinates
@@ -181,6 +181,75 @@ typedef enum {
  */
 int freenect_init(freenect_context **ctx, freenect_usb_context *usb_ctx);
 
+/// How fast a recording is replayed
+typedef enum {
+	FREENECT_REPLAY_REALTIME = 0, /**< Packets are delivered with the gaps they were recorded with */
+	FREENECT_REPLAY_FAST     = 1, /**< Packets are delivered as fast as they are consumed */
+} freenect_replay_speed;
+
+/**
+ * Initialize a freenect context that replays a recording made with
+ * freenect_record_usb() instead of talking to USB.  Devices, control replies
+ * and isochronous packets all come from the file, so everything above the USB
+ * layer runs as it did when recording, without a Kinect or libusb.  Control
+ * requests are answered in the order they were recorded, so devices should be
+ * opened and started the same way, with the same registration cache setting.
+ * freenect_process_events() returns < 0 once the recording is exhausted.
+ *
+ * @param ctx Address of pointer to freenect context struct to allocate and initialize
+ * @param path Recording to replay, several contexts can replay the same file
+ * @param speed Whether to keep the recorded timing or deliver as fast as possible
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_init_replay(freenect_context **ctx, const char *path, freenect_replay_speed speed);
+
+/// Most virtual devices a context can simulate
+#define FREENECT_VIRTUAL_MAX_DEVICES 32
+
+/// Where a virtual device sits in its scene.  Millimeters, with y pointing
+/// down like image rows and z along the optical axis of an unrotated device.
+typedef struct {
+	float x;     /**< Position, in mm */
+	float y;     /**< Position, in mm */
+	float z;     /**< Position, in mm */
+	float yaw;   /**< Rotation about the x axis, in radians */
+	float pitch; /**< Rotation about the y axis, in radians, applied after yaw */
+} freenect_virtual_pose;
+
+/**
+ * Initialize a freenect context of virtual devices instead of USB ones.  Each
+ * device ray casts a synthetic room with boxes and moving spheres from its
+ * pose and streams it as 11 bit packed depth, with the packet pacing, frame
+ * rate, timestamps and calibration of a real device, so the whole stack above
+ * USB can be exercised without hardware.  Frames only depend on the frame
+ * number and the pose, so runs are repeatable.  Only the depth stream is
+ * simulated, in the 11 bit and millimeter formats.  The video stream can be
+ * started and stopped like on a real device, but it never delivers a frame.
+ *
+ * @param ctx Address of pointer to freenect context struct to allocate and initialize
+ * @param count Number of virtual devices, 1 to FREENECT_VIRTUAL_MAX_DEVICES
+ * @param poses One pose per device, NULL to put them all in the middle of the room, turned 60 degrees apart
+ * @param speed Whether packets are paced like a real device or delivered as fast as they are consumed
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_init_virtual(freenect_context **ctx, int count, const freenect_virtual_pose *poses, freenect_replay_speed speed);
+
+/**
+ * Record the USB traffic of cameras opened after the call: which devices
+ * were opened, every control reply and every completed isochronous transfer,
+ * with packet lengths, status and arrival time.  Records are appended to the
+ * file, so contexts of the same session can share one path; start a session
+ * with a path that doesn't exist yet.
+ *
+ * @param ctx Context whose cameras are recorded
+ * @param path File to append the recording to, created if needed
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_record_usb(freenect_context *ctx, const char *path);
+
 /**
  * Closes the device if it is open, and frees the context
  *
@@ -243,6 +312,18 @@ int freenect_num_devices(freenect_context *ctx);
  */
 int freenect_list_device_attributes(freenect_context *ctx, struct freenect_device_attributes** attribute_list);
 
+/**
+ * Return the USB bus number the kinect camera at the given index is attached
+ * to.  Devices on different buses are served by different host controllers,
+ * so this is useful to spread devices across contexts and event threads.
+ *
+ * @param ctx Context to scan for kinect devices with
+ * @param index Index of the device on the bus, as used by freenect_open_device()
+ *
+ * @return Bus number of the device, < 0 on error or if no such device exists
+ */
+int freenect_get_device_bus(freenect_context *ctx, int index);
+
 /**
  * Free the linked list produced by freenect_list_device_attributes().
  *
@@ -327,6 +408,18 @@ void *freenect_get_user(freenect_device *dev);
 
 void freenect_set_log_level(freenect_context *ctx, freenect_loglevel level);
 
+/**
+ * Set the directory to cache camera calibration and registration tables in.
+ * Files are keyed by camera serial number; a device with a cache file skips
+ * fetching its calibration over USB on open, and maps the registration
+ * tables read-only instead of computing them when depth is started.  Affects
+ * devices opened after the call.
+ *
+ * @param ctx Context to set the cache directory for
+ * @param path Directory to keep cache files in, NULL to disable caching
+ */
+void freenect_set_registration_cache(freenect_context *ctx, const char *path);
+
 /// Typedef for depth image received event callbacks
 typedef void (*freenect_depth_cb)(freenect_device *dev, void *depth, uint32_t timestamp);
 /// Typedef for video image received event callbacks
@@ -348,6 +441,173 @@ void freenect_set_depth_callback(freenect_device *dev, freenect_depth_cb cb);
  */
 void freenect_set_video_callback(freenect_device *dev, freenect_video_cb cb);
 
+/// Isochronous transfer depth of a stream.  More transfers in flight ride out
+/// longer stalls of the event thread, at the cost of memory.
+typedef struct {
+	int transfers; /**< Transfers to keep in flight, 0 for the default of 16 */
+	int packets;   /**< Packets per transfer, 0 for the default of 16 */
+	int budget;    /**< Bytes of transfer buffers the stream may use.  If it fits more transfers than requested, the number in flight adapts to lost packets and resyncs within it, 0 keeps it fixed */
+	int hugepages; /**< Back transfer buffers with huge pages when zero-copy buffers are not available */
+	int copy;      /**< Don't use zero-copy buffers mapped by the kernel even if available, the kernel copies each packet instead */
+} freenect_transfer_depth;
+
+/// Counters of a stream since it was last started
+typedef struct {
+	int frames;            /**< Complete frames delivered */
+	uint64_t lost_packets; /**< Packets missing from the sequence */
+	uint64_t resyncs;      /**< Times the stream lost sync and dropped the frame in progress */
+	int transfers;         /**< Isochronous transfers currently in flight */
+	int zero_copy;         /**< Whether packets land in kernel-mapped buffers without a copy */
+	double cpu_time;       /**< Seconds of event thread cpu time spent handling this stream's packets */
+	uint64_t concealed;    /**< Frames delivered with missing packets, see freenect_concealment */
+	double tick_rate;      /**< Estimated device timestamp ticks per host second, 0 until known */
+} freenect_stream_stats;
+
+/// What a stream does when packets go missing
+typedef enum {
+	FREENECT_CONCEAL_NONE     = 0, /**< Drop the frame in progress and resync if more than a few packets are lost */
+	FREENECT_CONCEAL_PREVIOUS = 1, /**< Deliver the frame anyway, missing packets keep the previous frame's data */
+	FREENECT_CONCEAL_INVALID  = 2, /**< Deliver the frame anyway, missing packets read as no data (no reading for depth, black for video) */
+} freenect_concealment;
+
+/**
+ * Set the isochronous transfer depth for the depth stream of a device.
+ * Cannot be changed while the stream is active.
+ *
+ * @param dev Device to set transfer depth for
+ * @param depth Transfer depth, see freenect_transfer_depth
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_set_depth_transfers(freenect_device *dev, freenect_transfer_depth depth);
+
+/**
+ * Set the isochronous transfer depth for the video stream of a device.
+ * Cannot be changed while the stream is active.
+ *
+ * @param dev Device to set transfer depth for
+ * @param depth Transfer depth, see freenect_transfer_depth
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_set_video_transfers(freenect_device *dev, freenect_transfer_depth depth);
+
+/**
+ * Set what the depth stream does when packets go missing. With
+ * concealment, a per-row validity mask comes with every frame, see
+ * freenect_get_depth_row_mask(). Cannot be changed while the stream is
+ * active.
+ *
+ * @param dev Device to set concealment for
+ * @param mode Concealment mode, see freenect_concealment
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_set_depth_concealment(freenect_device *dev, freenect_concealment mode);
+
+/**
+ * Set what the video stream does when packets go missing. Cannot be
+ * changed while the stream is active.
+ *
+ * @param dev Device to set concealment for
+ * @param mode Concealment mode, see freenect_concealment
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_set_video_concealment(freenect_device *dev, freenect_concealment mode);
+
+/**
+ * Get the row validity mask of the depth frame being delivered, one byte
+ * per row, non-zero if every packet covering that row arrived. Only valid
+ * within the depth callback.
+ *
+ * @param dev Device to get the mask for
+ *
+ * @return Row mask, or NULL if concealment is off
+ */
+const uint8_t *freenect_get_depth_row_mask(freenect_device *dev);
+
+/**
+ * Get the row validity mask of the video frame being delivered, see
+ * freenect_get_depth_row_mask(). Only valid within the video callback.
+ *
+ * @param dev Device to get the mask for
+ *
+ * @return Row mask, or NULL if concealment is off
+ */
+const uint8_t *freenect_get_video_row_mask(freenect_device *dev);
+
+/**
+ * Get the host time of the depth frame being delivered. The device
+ * timestamp passed to the depth callback is mapped to CLOCK_MONOTONIC
+ * seconds by a clock model the stream keeps, with drift and offset
+ * estimated from packet arrival times. The offset follows the fastest
+ * arrivals, so it is late by the minimum transfer latency, which is the
+ * same for every device and cancels out when aligning frames between
+ * them. Only valid within the depth callback.
+ *
+ * @param dev Device to get the frame time for
+ *
+ * @return Host time in seconds
+ */
+double freenect_get_depth_host_time(freenect_device *dev);
+
+/**
+ * Get the host time of the video frame being delivered, see
+ * freenect_get_depth_host_time(). Only valid within the video callback.
+ *
+ * @param dev Device to get the frame time for
+ *
+ * @return Host time in seconds
+ */
+double freenect_get_video_host_time(freenect_device *dev);
+
+/// Host times, in CLOCK_MONOTONIC seconds, a frame went through each stage of the library
+typedef struct {
+	double capture;      /**< Estimated capture time, see freenect_get_depth_host_time() */
+	double first_packet; /**< Arrival of the first packet of the frame, 0 if it was lost */
+	double last_packet;  /**< Arrival of the packet that completed the frame */
+	double converted;    /**< Conversion to the requested format done, right before the callback */
+} freenect_frame_times;
+
+/**
+ * Get the stage times of the depth frame being delivered. Only valid
+ * within the depth callback.
+ *
+ * @param dev Device to get the frame times for
+ *
+ * @return Stage times of the frame
+ */
+freenect_frame_times freenect_get_depth_frame_times(freenect_device *dev);
+
+/**
+ * Get the stage times of the video frame being delivered. Only valid
+ * within the video callback.
+ *
+ * @param dev Device to get the frame times for
+ *
+ * @return Stage times of the frame
+ */
+freenect_frame_times freenect_get_video_frame_times(freenect_device *dev);
+
+/**
+ * Get the counters of the depth stream of a device.
+ *
+ * @param dev Device to get depth stream counters for
+ *
+ * @return Counters since the stream was started
+ */
+freenect_stream_stats freenect_get_depth_stats(freenect_device *dev);
+
+/**
+ * Get the counters of the video stream of a device.
+ *
+ * @param dev Device to get video stream counters for
+ *
+ * @return Counters since the stream was started
+ */
+freenect_stream_stats freenect_get_video_stats(freenect_device *dev);
+
 /**
  * Set the buffer to store depth information to. Size of buffer is
  * dependant on depth format. See FREENECT_DEPTH_*_SIZE defines for
@@ -373,7 +633,21 @@ int freenect_set_depth_buffer(freenect_device *dev, void *buf);
 int freenect_set_video_buffer(freenect_device *dev, void *buf);
 
 /**
- * Start the depth information stream for a device.
+ * Do all the setup for the depth information stream of a device (buffers,
+ * registration tables, isochronous transfers and camera registers) except
+ * issuing the final stream-start command.  This is the slow part of starting
+ * a stream, and it can be run for several devices at the same time, leaving
+ * only freenect_start_depth() to be staggered.
+ *
+ * @param dev Device to prepare depth information stream for.
+ *
+ * @return 0 on success, < 0 on error
+ */
+int freenect_prepare_depth(freenect_device *dev);
+
+/**
+ * Start the depth information stream for a device.  If the stream wasn't
+ * prepared with freenect_prepare_depth(), it will be prepared first.
  *
  * @param dev Device to start depth information stream for.
  *
@@ -0,0 +1,528 @@
+#include "node.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define NODE_VERSION 1
+
+// everything is in host byte order
+typedef struct {
+	char magic[4]; // CBND
+	uint32_t version;
+	uint16_t width;
+	uint16_t height;
+	uint32_t reserved;
+} node_hello_t;
+
+typedef struct {
+	uint32_t device;
+	uint32_t size; // of the code following the header
+	uint32_t intra; // coded without reference to the device's previous frame
+	uint32_t reserved;
+	double timestamp; // capture time, the node's clock
+	double sent; // the node's clock when the frame was sent
+	double ref_pix_size;
+	double ref_distance;
+} node_header_t;
+
+typedef struct {
+	uint16_t* depth;
+	sequence_frame_t frame;
+	int ready;
+} node_slot_t;
+
+typedef struct {
+	uint16_t* previous; // the frame last sent, or received, for this device
+	int frames; // since the last intra one, -1 if there is none to predict from
+} node_device_t;
+
+struct node_sender_t {
+	char* host;
+	int port;
+	int fd;
+	double attempt; // when connecting was last tried
+	int width, height;
+	int queue;
+	node_slot_t* slots;
+	uint64_t head, tail;
+	int closing;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	node_device_t* devices;
+	int device_count;
+	uint8_t* code;
+	node_stats_t stats;
+};
+
+typedef struct {
+	struct node_receiver_t* receiver;
+	int fd;
+	int done; // the thread has exited, it can be joined
+	pthread_t thread;
+} node_connection_t;
+
+struct node_receiver_t {
+	int fd;
+	int port;
+	int width, height;
+	node_frame_cb on_frame;
+	void* user;
+	int closing;
+	node_connection_t* connections[NODE_MAX_CONNECTIONS]; // their threads hold on to them, so they don't move
+	int connection_count;
+	node_stats_t stats;
+	pthread_mutex_t mutex;
+	pthread_t thread;
+};
+
+static double node_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int node_write(int fd, struct iovec* iov, int count)
+{
+	while (count > 0)
+	{
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+		while (count > 0 && (size_t)written >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = (uint8_t*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+static int node_read(int fd, void* data, size_t size)
+{
+	uint8_t* bytes = (uint8_t*)data;
+	while (size > 0)
+	{
+		ssize_t got = recv(fd, bytes, size, 0);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		bytes += got;
+		size -= got;
+	}
+	return 0;
+}
+
+static node_device_t* node_device(node_device_t** devices, int* count, int id, int pixels)
+{
+	if (id >= *count)
+	{
+		*devices = (node_device_t*)realloc(*devices, sizeof(node_device_t) * (id + 1));
+		int i;
+		for (i = *count; i <= id; i++)
+		{
+			(*devices)[i].previous = 0;
+			(*devices)[i].frames = -1;
+		}
+		*count = id + 1;
+	}
+	node_device_t* device = *devices + id;
+	if (!device->previous)
+		device->previous = (uint16_t*)malloc(sizeof(uint16_t) * pixels);
+	return device;
+}
+
+static void node_sender_connect(node_sender_t* sender)
+{
+	double now = node_time();
+	// don't hammer a fusion node that isn't up yet
+	if (now - sender->attempt < 1)
+		return;
+	sender->attempt = now;
+	struct addrinfo hints, *addresses, *address;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	char service[16];
+	snprintf(service, sizeof(service), "%d", sender->port);
+	if (getaddrinfo(sender->host, service, &hints, &addresses) != 0)
+		return;
+	int fd = -1;
+	for (address = addresses; address; address = address->ai_next)
+	{
+		fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+	if (fd < 0)
+		return;
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	node_hello_t hello;
+	memcpy(hello.magic, "CBND", 4);
+	hello.version = NODE_VERSION;
+	hello.width = sender->width;
+	hello.height = sender->height;
+	hello.reserved = 0;
+	struct iovec iov = {
+		&hello, sizeof(hello)
+	};
+	if (node_write(fd, &iov, 1) < 0)
+	{
+		close(fd);
+		return;
+	}
+	sender->fd = fd;
+	++sender->stats.connects;
+	// the other side knows nothing of what we sent before
+	int i;
+	for (i = 0; i < sender->device_count; i++)
+		sender->devices[i].frames = -1;
+}
+
+static void node_sender_send(node_sender_t* sender, node_slot_t* slot)
+{
+	int pixels = sender->width * sender->height;
+	if (slot->frame.device < 0 || slot->frame.device >= NODE_MAX_DEVICES)
+		return;
+	if (sender->fd < 0)
+		node_sender_connect(sender);
+	if (sender->fd < 0)
+	{
+		pthread_mutex_lock(&sender->mutex);
+		++sender->stats.dropped;
+		pthread_mutex_unlock(&sender->mutex);
+		return;
+	}
+	node_device_t* device = node_device(&sender->devices, &sender->device_count, slot->frame.device, pixels);
+	node_header_t header;
+	header.device = slot->frame.device;
+	header.intra = device->frames < 0 || device->frames >= NODE_INTRA;
+	header.reserved = 0;
+	header.timestamp = slot->frame.timestamp;
+	header.ref_pix_size = slot->frame.ref_pix_size;
+	header.ref_distance = slot->frame.ref_distance;
+	header.size = sequence_encode(slot->depth, header.intra ? 0 : device->previous, pixels, sender->code);
+	header.sent = node_time();
+	struct iovec iov[2] = {
+		{&header, sizeof(header)},
+		{sender->code, header.size},
+	};
+	if (node_write(sender->fd, iov, 2) < 0)
+	{
+		close(sender->fd);
+		sender->fd = -1;
+		pthread_mutex_lock(&sender->mutex);
+		++sender->stats.dropped;
+		pthread_mutex_unlock(&sender->mutex);
+		return;
+	}
+	memcpy(device->previous, slot->depth, sizeof(uint16_t) * pixels);
+	device->frames = header.intra ? 1 : device->frames + 1;
+	pthread_mutex_lock(&sender->mutex);
+	++sender->stats.frames;
+	sender->stats.bytes += sizeof(header) + header.size;
+	pthread_mutex_unlock(&sender->mutex);
+}
+
+static void* node_sender_main(void* data)
+{
+	node_sender_t* sender = (node_sender_t*)data;
+	pthread_mutex_lock(&sender->mutex);
+	for (;;)
+	{
+		node_slot_t* slot = sender->slots + sender->tail % sender->queue;
+		if (sender->tail == sender->head || !slot->ready)
+		{
+			if (sender->closing)
+				break;
+			pthread_cond_wait(&sender->cond, &sender->mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&sender->mutex);
+		node_sender_send(sender, slot);
+		pthread_mutex_lock(&sender->mutex);
+		slot->ready = 0;
+		++sender->tail;
+	}
+	pthread_mutex_unlock(&sender->mutex);
+	return 0;
+}
+
+node_sender_t* node_sender_open(const char* host, int port, int width, int height, int queue)
+{
+	queue = queue > 0 ? queue : 8;
+	node_sender_t* sender = (node_sender_t*)malloc(sizeof(node_sender_t) + sizeof(node_slot_t) * queue + sizeof(uint16_t) * width * height * queue);
+	memset(sender, 0, sizeof(node_sender_t));
+	sender->host = strdup(host);
+	sender->port = port;
+	sender->fd = -1;
+	sender->attempt = -1;
+	sender->width = width;
+	sender->height = height;
+	sender->queue = queue;
+	sender->slots = (node_slot_t*)(sender + 1);
+	uint16_t* depth = (uint16_t*)(sender->slots + queue);
+	int i;
+	for (i = 0; i < queue; i++)
+	{
+		sender->slots[i].depth = depth + i * width * height;
+		sender->slots[i].ready = 0;
+	}
+	sender->code = (uint8_t*)malloc(width * height * 3);
+	pthread_mutex_init(&sender->mutex, 0);
+	pthread_cond_init(&sender->cond, 0);
+	pthread_create(&sender->thread, 0, node_sender_main, sender);
+	return sender;
+}
+
+int node_sender_push(node_sender_t* sender, sequence_frame_t frame, const uint16_t* depth)
+{
+	pthread_mutex_lock(&sender->mutex);
+	if (sender->closing || sender->head - sender->tail >= (uint64_t)sender->queue)
+	{
+		++sender->stats.dropped;
+		pthread_mutex_unlock(&sender->mutex);
+		return -1;
+	}
+	node_slot_t* slot = sender->slots + sender->head % sender->queue;
+	++sender->head;
+	pthread_mutex_unlock(&sender->mutex);
+	memcpy(slot->depth, depth, sizeof(uint16_t) * sender->width * sender->height);
+	slot->frame = frame;
+	pthread_mutex_lock(&sender->mutex);
+	slot->ready = 1;
+	pthread_cond_signal(&sender->cond);
+	pthread_mutex_unlock(&sender->mutex);
+	return 0;
+}
+
+node_stats_t node_sender_stats(node_sender_t* sender)
+{
+	pthread_mutex_lock(&sender->mutex);
+	node_stats_t stats = sender->stats;
+	pthread_mutex_unlock(&sender->mutex);
+	return stats;
+}
+
+// sends what is queued, as long as the fusion node takes it
+void node_sender_close(node_sender_t* sender)
+{
+	pthread_mutex_lock(&sender->mutex);
+	sender->closing = 1;
+	pthread_cond_signal(&sender->cond);
+	pthread_mutex_unlock(&sender->mutex);
+	pthread_join(sender->thread, 0);
+	if (sender->fd >= 0)
+		close(sender->fd);
+	int i;
+	for (i = 0; i < sender->device_count; i++)
+		free(sender->devices[i].previous);
+	free(sender->devices);
+	free(sender->code);
+	free(sender->host);
+	pthread_mutex_destroy(&sender->mutex);
+	pthread_cond_destroy(&sender->cond);
+	free(sender);
+}
+
+static void* node_connection_main(void* data)
+{
+	node_connection_t* connection = (node_connection_t*)data;
+	node_receiver_t* receiver = connection->receiver;
+	int pixels = receiver->width * receiver->height;
+	node_device_t* devices = 0;
+	int device_count = 0;
+	// the codec never takes more than 3 bytes a pixel
+	uint8_t* code = (uint8_t*)malloc(pixels * 3);
+	uint16_t* depth = (uint16_t*)malloc(sizeof(uint16_t) * pixels);
+	double offset = 0;
+	int i, offsets = 0;
+	node_hello_t hello;
+	if (node_read(connection->fd, &hello, sizeof(hello)) < 0 || memcmp(hello.magic, "CBND", 4) != 0 ||
+		hello.version != NODE_VERSION || hello.width != receiver->width || hello.height != receiver->height)
+		goto done;
+	for (;;)
+	{
+		node_header_t header;
+		// anything past the limits isn't from a node of ours, don't let it grow what we hold for it
+		if (node_read(connection->fd, &header, sizeof(header)) < 0 ||
+			header.device >= NODE_MAX_DEVICES || header.size > (uint32_t)pixels * 3)
+			break;
+		double arrived = node_time();
+		if (node_read(connection->fd, code, header.size) < 0)
+			break;
+		node_device_t* device = node_device(&devices, &device_count, header.device, pixels);
+		if ((!header.intra && device->frames < 0) ||
+			sequence_decode(code, header.size, header.intra ? 0 : device->previous, pixels, depth) < 0)
+		{
+			// nothing to predict the next ones from until an intra frame comes
+			device->frames = -1;
+			pthread_mutex_lock(&receiver->mutex);
+			++receiver->stats.dropped;
+			pthread_mutex_unlock(&receiver->mutex);
+			continue;
+		}
+		memcpy(device->previous, depth, sizeof(uint16_t) * pixels);
+		device->frames = header.intra ? 1 : device->frames + 1;
+		if (offsets == 0 || arrived - header.sent < offset)
+			offset = arrived - header.sent;
+		++offsets;
+		pthread_mutex_lock(&receiver->mutex);
+		++receiver->stats.frames;
+		receiver->stats.bytes += sizeof(header) + header.size;
+		pthread_mutex_unlock(&receiver->mutex);
+		sequence_frame_t frame;
+		frame.device = header.device;
+		frame.timestamp = header.timestamp + offset;
+		frame.ref_pix_size = header.ref_pix_size;
+		frame.ref_distance = header.ref_distance;
+		receiver->on_frame(receiver->user, frame, depth);
+	}
+done:
+	// the node sees the hang-up right away, the fd itself is closed once the connection is reaped
+	shutdown(connection->fd, SHUT_RDWR);
+	for (i = 0; i < device_count; i++)
+		free(devices[i].previous);
+	free(devices);
+	free(code);
+	free(depth);
+	pthread_mutex_lock(&receiver->mutex);
+	connection->done = 1;
+	pthread_mutex_unlock(&receiver->mutex);
+	return 0;
+}
+
+static void* node_receiver_main(void* data)
+{
+	node_receiver_t* receiver = (node_receiver_t*)data;
+	int i;
+	for (;;)
+	{
+		int fd = accept(receiver->fd, 0, 0);
+		pthread_mutex_lock(&receiver->mutex);
+		if (receiver->closing)
+		{
+			pthread_mutex_unlock(&receiver->mutex);
+			if (fd >= 0)
+				close(fd);
+			break;
+		}
+		// reap nodes that went away, to make room
+		for (i = receiver->connection_count - 1; i >= 0; i--)
+			if (receiver->connections[i]->done)
+			{
+				pthread_join(receiver->connections[i]->thread, 0);
+				close(receiver->connections[i]->fd);
+				free(receiver->connections[i]);
+				receiver->connections[i] = receiver->connections[--receiver->connection_count];
+			}
+		if (fd >= 0 && receiver->connection_count < NODE_MAX_CONNECTIONS)
+		{
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			node_connection_t* connection = (node_connection_t*)malloc(sizeof(node_connection_t));
+			receiver->connections[receiver->connection_count++] = connection;
+			connection->receiver = receiver;
+			connection->fd = fd;
+			connection->done = 0;
+			++receiver->stats.connects;
+			pthread_create(&connection->thread, 0, node_connection_main, connection);
+		} else if (fd >= 0)
+			close(fd);
+		pthread_mutex_unlock(&receiver->mutex);
+	}
+	return 0;
+}
+
+node_receiver_t* node_receiver_open(int port, int width, int height, node_frame_cb on_frame, void* user)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 0;
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	socklen_t length = sizeof(address);
+	if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 16) < 0 ||
+		getsockname(fd, (struct sockaddr*)&address, &length) < 0)
+	{
+		close(fd);
+		return 0;
+	}
+	node_receiver_t* receiver = (node_receiver_t*)malloc(sizeof(node_receiver_t));
+	memset(receiver, 0, sizeof(node_receiver_t));
+	receiver->fd = fd;
+	receiver->port = ntohs(address.sin_port);
+	receiver->width = width;
+	receiver->height = height;
+	receiver->on_frame = on_frame;
+	receiver->user = user;
+	pthread_mutex_init(&receiver->mutex, 0);
+	pthread_create(&receiver->thread, 0, node_receiver_main, receiver);
+	return receiver;
+}
+
+int node_receiver_port(node_receiver_t* receiver)
+{
+	return receiver->port;
+}
+
+node_stats_t node_receiver_stats(node_receiver_t* receiver)
+{
+	pthread_mutex_lock(&receiver->mutex);
+	node_stats_t stats = receiver->stats;
+	pthread_mutex_unlock(&receiver->mutex);
+	return stats;
+}
+
+void node_receiver_close(node_receiver_t* receiver)
+{
+	int i;
+	pthread_mutex_lock(&receiver->mutex);
+	receiver->closing = 1;
+	// wakes accept and every connection's recv
+	shutdown(receiver->fd, SHUT_RDWR);
+	for (i = 0; i < receiver->connection_count; i++)
+		shutdown(receiver->connections[i]->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&receiver->mutex);
+	pthread_join(receiver->thread, 0);
+	for (i = 0; i < receiver->connection_count; i++)
+	{
+		pthread_join(receiver->connections[i]->thread, 0);
+		close(receiver->connections[i]->fd);
+		free(receiver->connections[i]);
+	}
+	close(receiver->fd);
+	pthread_mutex_destroy(&receiver->mutex);
+	free(receiver);
+}
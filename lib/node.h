@@ -0,0 +1,46 @@
+#ifndef _GUARD_NODE_H_
+#define _GUARD_NODE_H_
+
+#include <stdint.h>
+
+#include "sequence.h"
+
+// Depth frames from capture nodes to a fusion node over TCP, so one fusion can take more
+// Kinects than one host's USB controllers.  Frames are compressed with the sequence codec,
+// each against the frame of the same device sent before it, with one coded on its own every
+// NODE_INTRA frames and after every reconnect.  Capture times travel in the node's clock,
+// the fusion node moves them into its own by the smallest gap it has seen between a frame's
+// send time and its arrival, which is the clock offset plus the fastest the link ever was.
+
+#define NODE_INTRA (30)
+#define NODE_MAX_CONNECTIONS (32)
+#define NODE_MAX_DEVICES (256) // device ids on the wire, from 0, a node that sends any other is dropped
+
+typedef struct node_sender_t node_sender_t;
+typedef struct node_receiver_t node_receiver_t;
+
+typedef struct {
+	uint64_t frames; // sent
+	uint64_t dropped; // pushed while the queue was full or the fusion node unreachable
+	uint64_t bytes; // sent
+	uint64_t connects;
+} node_stats_t;
+
+// connects in the background and again whenever the connection breaks, queue 8 if 0
+node_sender_t* node_sender_open(const char* host, int port, int width, int height, int queue);
+// copies the frame into the queue, returns -1 and drops it if the queue is full, safe from any thread
+int node_sender_push(node_sender_t* sender, sequence_frame_t frame, const uint16_t* depth);
+node_stats_t node_sender_stats(node_sender_t* sender);
+void node_sender_close(node_sender_t* sender);
+
+// called from the connection's thread with the timestamp in this host's clock, depth is only valid during the call
+typedef void (*node_frame_cb)(void* user, sequence_frame_t frame, const uint16_t* depth);
+
+// port 0 picks a free one
+node_receiver_t* node_receiver_open(int port, int width, int height, node_frame_cb on_frame, void* user);
+int node_receiver_port(node_receiver_t* receiver);
+// frames are the ones received, dropped the ones that couldn't be decoded
+node_stats_t node_receiver_stats(node_receiver_t* receiver);
+void node_receiver_close(node_receiver_t* receiver);
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#endif
+
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct {
+	pool_body_t body;
+	void* data;
+	int pending; // tasks not finished yet
+} pool_job_t;
+
+typedef struct {
+	pool_job_t* job;
+	int begin, end;
+} pool_task_t;
+
+// the owner pushes and takes at the bottom, thieves take at the top
+typedef struct {
+	pthread_mutex_t mutex;
+	pool_task_t* tasks; // ring
+	int capacity;
+	int top, count;
+} pool_deque_t;
+
+typedef struct {
+	struct pool_t* pool;
+	int index;
+	int cpu; // -1 to float
+	int priority;
+	pthread_t thread;
+} pool_worker_t;
+
+struct pool_t {
+	int threads;
+	pool_deque_t* deques; // 0 is shared by threads outside of the pool, then one per worker
+	pool_worker_t* workers;
+	int queued; // tasks in all deques, workers sleep while there are none
+	int closing;
+	int pin_failures;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static __thread pool_t* pool_self;
+static __thread int pool_self_index;
+
+static void pool_push(pool_deque_t* deque, pool_task_t task)
+{
+	pthread_mutex_lock(&deque->mutex);
+	if (deque->count == deque->capacity)
+	{
+		int capacity = deque->capacity ? deque->capacity * 2 : 64;
+		pool_task_t* tasks = (pool_task_t*)malloc(sizeof(pool_task_t) * capacity);
+		int i;
+		for (i = 0; i < deque->count; i++)
+			tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+		free(deque->tasks);
+		deque->tasks = tasks;
+		deque->capacity = capacity;
+		deque->top = 0;
+	}
+	deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+	++deque->count;
+	pthread_mutex_unlock(&deque->mutex);
+}
+
+static int pool_take(pool_deque_t* deque, int bottom, pool_task_t* task)
+{
+	// a look without the lock first, thieves mostly find nothing
+	if (!deque->count)
+		return 0;
+	pthread_mutex_lock(&deque->mutex);
+	if (!deque->count)
+	{
+		pthread_mutex_unlock(&deque->mutex);
+		return 0;
+	}
+	if (bottom)
+		*task = deque->tasks[(deque->top + deque->count - 1) % deque->capacity];
+	else {
+		*task = deque->tasks[deque->top];
+		deque->top = (deque->top + 1) % deque->capacity;
+	}
+	--deque->count;
+	pthread_mutex_unlock(&deque->mutex);
+	return 1;
+}
+
+// own newest first, then the oldest of everybody else's
+static int pool_find(pool_t* pool, int index, pool_task_t* task)
+{
+	int i;
+	if (pool_take(pool->deques + index, 1, task))
+		return 1;
+	for (i = 1; i <= pool->threads; i++)
+		if (pool_take(pool->deques + (index + i) % (pool->threads + 1), 0, task))
+			return 1;
+	return 0;
+}
+
+static void pool_run(pool_t* pool, pool_task_t task)
+{
+	__sync_fetch_and_sub(&pool->queued, 1);
+	task.job->body(task.job->data, task.begin, task.end);
+	__sync_fetch_and_sub(&task.job->pending, 1);
+}
+
+static void* pool_main(void* data)
+{
+	pool_worker_t* worker = (pool_worker_t*)data;
+	pool_t* pool = worker->pool;
+	pool_self = pool;
+	pool_self_index = worker->index;
+	int failed = 0;
+	if (worker->cpu >= 0)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		failed |= pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus) != 0;
+	}
+	if (worker->priority > 0)
+	{
+		struct sched_param param;
+		param.sched_priority = worker->priority;
+		failed |= pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0;
+	}
+	if (failed)
+		__sync_fetch_and_add(&pool->pin_failures, 1);
+	for (;;)
+	{
+		pool_task_t task;
+		if (pool_find(pool, worker->index, &task))
+		{
+			pool_run(pool, task);
+			continue;
+		}
+		pthread_mutex_lock(&pool->mutex);
+		while (!pool->closing && __sync_fetch_and_add(&pool->queued, 0) == 0)
+			pthread_cond_wait(&pool->cond, &pool->mutex);
+		int closing = pool->closing;
+		pthread_mutex_unlock(&pool->mutex);
+		if (closing)
+			break;
+	}
+	return 0;
+}
+
+pool_t* pool_open(int threads, const int* cpus, int cpu_count, int priority)
+{
+	if (threads <= 0)
+	{
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 1 ? online - 1 : 0;
+	}
+	pool_t* pool = (pool_t*)malloc(sizeof(pool_t) + sizeof(pool_deque_t) * (threads + 1) + sizeof(pool_worker_t) * threads);
+	pool->threads = threads;
+	pool->deques = (pool_deque_t*)(pool + 1);
+	pool->workers = (pool_worker_t*)(pool->deques + threads + 1);
+	pool->queued = 0;
+	pool->closing = 0;
+	pool->pin_failures = 0;
+	pthread_mutex_init(&pool->mutex, 0);
+	pthread_cond_init(&pool->cond, 0);
+	int i;
+	for (i = 0; i <= threads; i++)
+	{
+		pthread_mutex_init(&pool->deques[i].mutex, 0);
+		pool->deques[i].tasks = 0;
+		pool->deques[i].capacity = 0;
+		pool->deques[i].top = 0;
+		pool->deques[i].count = 0;
+	}
+	for (i = 0; i < threads; i++)
+	{
+		pool->workers[i].pool = pool;
+		pool->workers[i].index = i + 1;
+		pool->workers[i].cpu = cpu_count > 0 ? cpus[i % cpu_count] : -1;
+		pool->workers[i].priority = priority;
+		pthread_create(&pool->workers[i].thread, 0, pool_main, pool->workers + i);
+	}
+	return pool;
+}
+
+int pool_size(pool_t* pool)
+{
+	return pool->threads + 1;
+}
+
+int pool_pin_failures(pool_t* pool)
+{
+	return __sync_fetch_and_add(&pool->pin_failures, 0);
+}
+
+void pool_for(pool_t* pool, int count, int grain, pool_body_t body, void* data)
+{
+	if (count <= 0)
+		return;
+	grain = grain > 0 ? grain : 1;
+	// a few pieces per thread, so the ones that finish early have something left to steal
+	int pieces = (count + grain - 1) / grain;
+	if (pieces > (pool->threads + 1) * 4)
+		pieces = (pool->threads + 1) * 4;
+	if (pool->threads == 0 || pieces <= 1)
+	{
+		body(data, 0, count);
+		return;
+	}
+	int index = pool_self == pool ? pool_self_index : 0;
+	pool_job_t job;
+	job.body = body;
+	job.data = data;
+	job.pending = pieces;
+	int i;
+	// pushed back to front, so the owner takes the front first and thieves the back
+	for (i = pieces - 1; i >= 0; i--)
+	{
+		pool_task_t task;
+		task.job = &job;
+		task.begin = (int)((long)count * i / pieces);
+		task.end = (int)((long)count * (i + 1) / pieces);
+		pool_push(pool->deques + index, task);
+	}
+	__sync_fetch_and_add(&pool->queued, pieces);
+	pthread_mutex_lock(&pool->mutex);
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	// help out until the last piece is done, with whatever is around, ours or not
+	while (__sync_fetch_and_add(&job.pending, 0) > 0)
+	{
+		pool_task_t task;
+		if (pool_find(pool, index, &task))
+			pool_run(pool, task);
+		else
+			sched_yield();
+	}
+}
+
+void pool_close(pool_t* pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	pool->closing = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+	int i;
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->workers[i].thread, 0);
+	for (i = 0; i <= pool->threads; i++)
+	{
+		pthread_mutex_destroy(&pool->deques[i].mutex);
+		free(pool->deques[i].tasks);
+	}
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+	free(pool);
+}
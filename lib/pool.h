@@ -0,0 +1,26 @@
+#ifndef _GUARD_POOL_H_
+#define _GUARD_POOL_H_
+
+// One set of worker threads every stage hands its parallel work to, so stages don't each
+// spawn their own and oversubscribe the machine.  Every worker has a deque of tasks, it takes
+// its own newest first and, once that is empty, steals the oldest of another's.  A thread
+// waiting for its loop to finish, pool worker or not, works on tasks in the meantime, so loops
+// may nest and the thread that asked is never idle.
+
+typedef struct pool_t pool_t;
+
+// body runs over [begin, end) of the range, from any thread
+typedef void (*pool_body_t)(void* data, int begin, int end);
+
+// threads workers, 0 for one per online cpu but the caller's, cpus optional, worker i is pinned to cpus[i % cpu_count],
+// priority for SCHED_FIFO, 0 to leave workers SCHED_OTHER
+pool_t* pool_open(int threads, const int* cpus, int cpu_count, int priority);
+// workers, plus one for the caller
+int pool_size(pool_t* pool);
+// workers that didn't get the cpu or priority asked for, usually for lack of CAP_SYS_NICE
+int pool_pin_failures(pool_t* pool);
+// splits count into pieces of at least grain, runs them across the pool and returns when all are done
+void pool_for(pool_t* pool, int count, int grain, pool_body_t body, void* data);
+void pool_close(pool_t* pool);
+
+#endif
@@ -0,0 +1,257 @@
+#include "publish.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PUBLISH_VERSION 1
+#define PUBLISH_PAGE (4096)
+
+typedef struct {
+	char magic[4]; // CBPB
+	uint32_t version;
+	uint32_t dims[3];
+	uint32_t slots;
+	double resolution;
+	uint32_t threshold; // 0 if there is no occupancy bitmask
+	uint32_t reserved;
+	uint64_t cube_bytes;
+	uint64_t slot_bytes; // cube and occupancy bitmask, rounded up to whole pages
+	uint64_t data; // offset of the first slot's cube
+	uint64_t latest; // version + 1 of the newest complete cube, 0 if none
+} publish_header_t;
+
+typedef struct {
+	uint64_t sequence; // odd while the slot is being written
+	uint64_t version;
+	double target;
+	double skew;
+	int32_t fused;
+	int32_t quality;
+} publish_slot_t;
+
+struct publish_t {
+	char* name;
+	uint8_t* base;
+	size_t size;
+	publish_header_t* header;
+	publish_slot_t* slots;
+	uint64_t version; // the one being written
+};
+
+struct publish_reader_t {
+	const uint8_t* base;
+	size_t size;
+	const publish_header_t* header;
+	const publish_slot_t* slots;
+};
+
+static inline uint64_t publish_load(const volatile uint64_t* value)
+{
+	uint64_t result = *value;
+	__sync_synchronize();
+	return result;
+}
+
+publish_t* publish_open(const char* name, const size_t dims[3], double resolution, int slots, uint32_t threshold)
+{
+	slots = slots > 0 ? slots : 3;
+	uint64_t voxels = (uint64_t)dims[0] * dims[1] * dims[2];
+	uint64_t cube_bytes = sizeof(uint32_t) * voxels;
+	uint64_t occupancy_bytes = threshold > 0 ? sizeof(uint64_t) * ((voxels + 63) / 64) : 0;
+	uint64_t slot_bytes = (cube_bytes + occupancy_bytes + PUBLISH_PAGE - 1) / PUBLISH_PAGE * PUBLISH_PAGE;
+	uint64_t data = (sizeof(publish_header_t) + sizeof(publish_slot_t) * slots + PUBLISH_PAGE - 1) / PUBLISH_PAGE * PUBLISH_PAGE;
+	size_t size = data + slot_bytes * slots;
+	// a stale segment of a previous run would confuse readers that still have it open, start afresh
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+		return 0;
+	if (ftruncate(fd, size) < 0)
+	{
+		close(fd);
+		shm_unlink(name);
+		return 0;
+	}
+	void* base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		shm_unlink(name);
+		return 0;
+	}
+	publish_t* publish = (publish_t*)malloc(sizeof(publish_t));
+	publish->name = strdup(name);
+	publish->base = (uint8_t*)base;
+	publish->size = size;
+	publish->header = (publish_header_t*)base;
+	publish->slots = (publish_slot_t*)(publish->header + 1);
+	publish->version = 0;
+	// ftruncate zeroed everything, so every slot is already an even, empty sequence
+	publish_header_t* header = publish->header;
+	header->version = PUBLISH_VERSION;
+	header->dims[0] = dims[0];
+	header->dims[1] = dims[1];
+	header->dims[2] = dims[2];
+	header->slots = slots;
+	header->resolution = resolution;
+	header->threshold = threshold;
+	header->cube_bytes = cube_bytes;
+	header->slot_bytes = slot_bytes;
+	header->data = data;
+	header->latest = 0;
+	__sync_synchronize();
+	// readers check the magic last
+	memcpy(header->magic, "CBPB", 4);
+	return publish;
+}
+
+uint32_t* publish_begin(publish_t* publish)
+{
+	int slot = publish->version % publish->header->slots;
+	__sync_fetch_and_add(&publish->slots[slot].sequence, 1);
+	return (uint32_t*)(publish->base + publish->header->data + publish->header->slot_bytes * slot);
+}
+
+typedef struct {
+	const uint32_t* cube;
+	uint64_t* occupancy;
+	uint64_t voxels;
+	uint32_t threshold;
+} publish_mask_t;
+
+static void publish_mask(void* data, int begin, int end)
+{
+	publish_mask_t* mask = (publish_mask_t*)data;
+	uint64_t i, j;
+	for (i = (uint64_t)begin * 64; i < (uint64_t)end * 64 && i < mask->voxels; i += 64)
+	{
+		uint64_t bits = 0;
+		uint64_t n = mask->voxels - i < 64 ? mask->voxels - i : 64;
+		for (j = 0; j < n; j++)
+			bits |= (uint64_t)(mask->cube[i + j] >= mask->threshold) << j;
+		mask->occupancy[i / 64] = bits;
+	}
+}
+
+void publish_end(publish_t* publish, double target, double skew, int fused, int quality, pool_t* pool)
+{
+	publish_header_t* header = publish->header;
+	int slot = publish->version % header->slots;
+	uint8_t* data = publish->base + header->data + header->slot_bytes * slot;
+	if (header->threshold > 0)
+	{
+		publish_mask_t mask;
+		mask.cube = (const uint32_t*)data;
+		mask.occupancy = (uint64_t*)(data + header->cube_bytes);
+		mask.voxels = (uint64_t)header->dims[0] * header->dims[1] * header->dims[2];
+		mask.threshold = header->threshold;
+		int words = (int)((mask.voxels + 63) / 64);
+		if (pool)
+			pool_for(pool, words, 1024, publish_mask, &mask);
+		else
+			publish_mask(&mask, 0, words);
+	}
+	publish->slots[slot].version = publish->version;
+	publish->slots[slot].target = target;
+	publish->slots[slot].skew = skew;
+	publish->slots[slot].fused = fused;
+	publish->slots[slot].quality = quality;
+	__sync_fetch_and_add(&publish->slots[slot].sequence, 1);
+	++publish->version;
+	__sync_lock_test_and_set(&header->latest, publish->version);
+}
+
+void publish_close(publish_t* publish)
+{
+	shm_unlink(publish->name);
+	munmap(publish->base, publish->size);
+	free(publish->name);
+	free(publish);
+}
+
+publish_reader_t* publish_reader_open(const char* name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(publish_header_t))
+	{
+		close(fd);
+		return 0;
+	}
+	void* base = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return 0;
+	const publish_header_t* header = (const publish_header_t*)base;
+	__sync_synchronize();
+	if (memcmp(header->magic, "CBPB", 4) != 0 || header->version != PUBLISH_VERSION || header->slots == 0 ||
+		header->data + header->slot_bytes * header->slots > (uint64_t)st.st_size)
+	{
+		munmap(base, st.st_size);
+		return 0;
+	}
+	publish_reader_t* reader = (publish_reader_t*)malloc(sizeof(publish_reader_t));
+	reader->base = (const uint8_t*)base;
+	reader->size = st.st_size;
+	reader->header = header;
+	reader->slots = (const publish_slot_t*)(header + 1);
+	return reader;
+}
+
+void publish_reader_dims(publish_reader_t* reader, size_t dims[3], double* resolution)
+{
+	dims[0] = reader->header->dims[0];
+	dims[1] = reader->header->dims[1];
+	dims[2] = reader->header->dims[2];
+	if (resolution)
+		*resolution = reader->header->resolution;
+}
+
+int publish_reader_acquire(publish_reader_t* reader, publish_frame_t* frame)
+{
+	const publish_header_t* header = reader->header;
+	for (;;)
+	{
+		uint64_t latest = publish_load(&header->latest);
+		if (latest == 0)
+			return -1;
+		int slot = (latest - 1) % header->slots;
+		const publish_slot_t* info = reader->slots + slot;
+		uint64_t sequence = publish_load(&info->sequence);
+		// the publisher lapped the ring since we looked, look again
+		if (sequence & 1)
+			continue;
+		frame->version = info->version;
+		frame->target = info->target;
+		frame->skew = info->skew;
+		frame->fused = info->fused;
+		frame->quality = info->quality;
+		__sync_synchronize();
+		if (info->sequence != sequence)
+			continue;
+		frame->sequence = sequence;
+		frame->slot = slot;
+		const uint8_t* data = reader->base + header->data + header->slot_bytes * slot;
+		frame->cube = (const uint32_t*)data;
+		frame->occupancy = header->threshold > 0 ? (const uint64_t*)(data + header->cube_bytes) : 0;
+		return 0;
+	}
+}
+
+int publish_reader_valid(publish_reader_t* reader, const publish_frame_t* frame)
+{
+	__sync_synchronize();
+	return reader->slots[frame->slot].sequence == frame->sequence;
+}
+
+void publish_reader_close(publish_reader_t* reader)
+{
+	munmap((void*)reader->base, reader->size);
+	free(reader);
+}
@@ -0,0 +1,47 @@
+#ifndef _GUARD_PUBLISH_H_
+#define _GUARD_PUBLISH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+// Fused cubes in POSIX shared memory for other processes on the same machine.  The segment
+// holds a ring of cubes, each behind a seqlock: the publisher makes a slot's sequence odd,
+// fuses straight into it and makes it even again.  Readers map the segment read-only, take
+// the newest slot in place and check afterwards that its sequence didn't move, so nobody
+// copies a cube and a slow reader never holds up fusion, it only has to retry.
+
+typedef struct publish_t publish_t;
+typedef struct publish_reader_t publish_reader_t;
+
+typedef struct {
+	uint64_t version; // cubes published before this one
+	uint64_t sequence; // the slot's seqlock sequence when it was acquired
+	int slot;
+	double target; // as cubic_t.target, skew and fused of the cycle
+	double skew;
+	int fused;
+	int quality; // as cubic_t.quality
+	const uint32_t* cube; // laid out as cubic_t.cube
+	const uint64_t* occupancy; // bit per voxel with at least threshold hits, x fastest, 0 if not published
+} publish_frame_t;
+
+// name as for shm_open, slots is ring depth, 3 if 0, threshold 0 for no occupancy bitmask
+publish_t* publish_open(const char* name, const size_t dims[3], double resolution, int slots, uint32_t threshold);
+// the cube to fuse the next version into, it holds whatever this slot had last
+uint32_t* publish_begin(publish_t* publish);
+// pool optional, to build the bitmask on
+void publish_end(publish_t* publish, double target, double skew, int fused, int quality, pool_t* pool);
+// unlinks the segment, mapped readers keep what they have
+void publish_close(publish_t* publish);
+
+publish_reader_t* publish_reader_open(const char* name);
+void publish_reader_dims(publish_reader_t* reader, size_t dims[3], double* resolution);
+// the newest complete cube, in place, returns -1 if none has been published yet
+int publish_reader_acquire(publish_reader_t* reader, publish_frame_t* frame);
+// whether what acquire handed out is still intact, anything read from it before is trustworthy only if so
+int publish_reader_valid(publish_reader_t* reader, const publish_frame_t* frame);
+void publish_reader_close(publish_reader_t* reader);
+
+#endif
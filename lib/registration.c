@@ -31,6 +31,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 #define REG_X_VAL_SCALE 256 // "fixed-point" precision for double -> int32_t conversion
@@ -303,7 +307,7 @@ static uint16_t freenect_raw_to_mm(uint16_t raw, freenect_registration* reg)
 }
 
 /// Compute registration tables.
-static void complete_tables(freenect_registration* reg) {
+void complete_tables(freenect_registration* reg) {
 	uint16_t i;
 	for (i = 0; i < DEPTH_MAX_RAW_VALUE; i++)
 		reg->raw_to_mm_shift[i] = freenect_raw_to_mm( i, reg);
@@ -329,6 +333,133 @@ void freenect_camera_to_world(freenect_device* dev, int cx, int cy, int wz, doub
 	*wy = (double)(cy - DEPTH_Y_RES/2) * factor;
 }
 
+#define REGISTRATION_CACHE_MAGIC "FNRC"
+#define REGISTRATION_CACHE_VERSION 1
+
+/// On-disk layout of the per-serial calibration cache, tables follow the header
+/// at the recorded offsets, everything is in host byte order.
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	char camera_serial[128];
+	uint32_t video_resolution; // reg_info depends on the video mode it was fetched for
+	freenect_reg_info reg_info;
+	freenect_reg_pad_info reg_pad_info;
+	freenect_zero_plane_info zero_plane_info;
+	double const_shift;
+	uint64_t raw_to_mm_shift;
+	uint64_t depth_to_rgb_shift;
+	uint64_t registration_table;
+	uint64_t size;
+} freenect_registration_cache;
+
+#define REGISTRATION_CACHE_RAW_TO_MM ((sizeof(freenect_registration_cache) + 7) / 8 * 8)
+#define REGISTRATION_CACHE_DEPTH_TO_RGB (REGISTRATION_CACHE_RAW_TO_MM + sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE)
+#define REGISTRATION_CACHE_TABLE (REGISTRATION_CACHE_DEPTH_TO_RGB + sizeof(int32_t) * DEPTH_MAX_METRIC_VALUE)
+#define REGISTRATION_CACHE_SIZE (REGISTRATION_CACHE_TABLE + sizeof(int32_t) * DEPTH_X_RES * DEPTH_Y_RES * 2)
+
+static int freenect_registration_cache_path(freenect_device* dev, char* path, size_t size)
+{
+	if (!dev->parent->registration_cache || !dev->camera_serial[0])
+		return -1;
+	snprintf(path, size, "%s/%s.fnreg", dev->parent->registration_cache, dev->camera_serial);
+	return 0;
+}
+
+/// Map the calibration cache for this camera and take the calibration from it.
+/// Returns 0 on a hit, the camera doesn't need to be asked for its calibration.
+int freenect_load_registration_cache(freenect_device* dev, freenect_resolution video_resolution)
+{
+	freenect_context *ctx = dev->parent;
+	char path[1024];
+	if (freenect_registration_cache_path(dev, path, sizeof(path)) < 0)
+		return -1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size != REGISTRATION_CACHE_SIZE) {
+		close(fd);
+		return -1;
+	}
+	void* map = mmap(NULL, REGISTRATION_CACHE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	freenect_registration_cache* cache = (freenect_registration_cache*)map;
+	if (memcmp(cache->magic, REGISTRATION_CACHE_MAGIC, 4) != 0 ||
+	    cache->version != REGISTRATION_CACHE_VERSION ||
+	    cache->size != REGISTRATION_CACHE_SIZE ||
+	    cache->video_resolution != video_resolution ||
+	    strncmp(cache->camera_serial, dev->camera_serial, sizeof(cache->camera_serial)) != 0) {
+		FN_WARNING("Ignoring stale registration cache %s\n", path);
+		munmap(map, REGISTRATION_CACHE_SIZE);
+		return -1;
+	}
+	freenect_unload_registration_cache(dev);
+	dev->registration_cache = map;
+	dev->registration_cache_size = REGISTRATION_CACHE_SIZE;
+	dev->registration.reg_info = cache->reg_info;
+	dev->registration.reg_pad_info = cache->reg_pad_info;
+	dev->registration.zero_plane_info = cache->zero_plane_info;
+	dev->registration.const_shift = cache->const_shift;
+	FN_DEBUG("Loaded registration cache %s\n", path);
+	return 0;
+}
+
+void freenect_unload_registration_cache(freenect_device* dev)
+{
+	if (!dev->registration_cache)
+		return;
+	// tables may still point into the mapping
+	if (dev->registration.mapped)
+		freenect_destroy_registration(&(dev->registration));
+	munmap(dev->registration_cache, dev->registration_cache_size);
+	dev->registration_cache = NULL;
+	dev->registration_cache_size = 0;
+}
+
+/// Write freshly computed tables out, to a temporary file first so a reader
+/// never maps a half-written cache.
+static void freenect_save_registration_cache(freenect_device* dev)
+{
+	freenect_context *ctx = dev->parent;
+	freenect_registration* reg = &(dev->registration);
+	char path[1024], temp[1040];
+	if (freenect_registration_cache_path(dev, path, sizeof(path)) < 0)
+		return;
+	snprintf(temp, sizeof(temp), "%s.%d", path, (int)getpid());
+	FILE* w = fopen(temp, "wb");
+	if (!w) {
+		FN_WARNING("Cannot write registration cache %s\n", temp);
+		return;
+	}
+	freenect_registration_cache cache;
+	memset(&cache, 0, sizeof(cache));
+	memcpy(cache.magic, REGISTRATION_CACHE_MAGIC, 4);
+	cache.version = REGISTRATION_CACHE_VERSION;
+	snprintf(cache.camera_serial, sizeof(cache.camera_serial), "%s", dev->camera_serial);
+	cache.video_resolution = dev->video_resolution;
+	cache.reg_info = reg->reg_info;
+	cache.reg_pad_info = reg->reg_pad_info;
+	cache.zero_plane_info = reg->zero_plane_info;
+	cache.const_shift = reg->const_shift;
+	cache.raw_to_mm_shift = REGISTRATION_CACHE_RAW_TO_MM;
+	cache.depth_to_rgb_shift = REGISTRATION_CACHE_DEPTH_TO_RGB;
+	cache.registration_table = REGISTRATION_CACHE_TABLE;
+	cache.size = REGISTRATION_CACHE_SIZE;
+	uint8_t pad[8] = {0};
+	int ok = fwrite(&cache, sizeof(cache), 1, w) == 1 &&
+	         fwrite(pad, 1, REGISTRATION_CACHE_RAW_TO_MM - sizeof(cache), w) == REGISTRATION_CACHE_RAW_TO_MM - sizeof(cache) &&
+	         fwrite(reg->raw_to_mm_shift, sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE, 1, w) == 1 &&
+	         fwrite(reg->depth_to_rgb_shift, sizeof(int32_t) * DEPTH_MAX_METRIC_VALUE, 1, w) == 1 &&
+	         fwrite(reg->registration_table, sizeof(int32_t) * DEPTH_X_RES * DEPTH_Y_RES * 2, 1, w) == 1;
+	if (fclose(w) != 0 || !ok || rename(temp, path) != 0) {
+		FN_WARNING("Cannot write registration cache %s\n", path);
+		unlink(temp);
+	}
+}
+
 /// Allocate and fill registration tables
 /// This function should be called every time a new video (not depth!) mode is
 /// activated.
@@ -339,6 +470,16 @@ int freenect_init_registration(freenect_device* dev)
 	// Ensure that we free the previous tables before dropping the pointers, if there were any.
 	freenect_destroy_registration(&(dev->registration));
 
+	// Map the tables straight from the cache if it was made for the current video mode.
+	freenect_registration_cache* cache = (freenect_registration_cache*)dev->registration_cache;
+	if (cache && cache->video_resolution == dev->video_resolution) {
+		reg->raw_to_mm_shift    = (uint16_t*)((uint8_t*)cache + cache->raw_to_mm_shift);
+		reg->depth_to_rgb_shift = (int32_t*)((uint8_t*)cache + cache->depth_to_rgb_shift);
+		reg->registration_table = (int32_t (*)[2])((uint8_t*)cache + cache->registration_table);
+		reg->mapped = 1;
+		return 0;
+	}
+
 	// Allocate tables.
 	reg->raw_to_mm_shift    = (uint16_t*)malloc( sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE );
 	reg->depth_to_rgb_shift = (int32_t*)malloc( sizeof( int32_t) * DEPTH_MAX_METRIC_VALUE );
@@ -347,6 +488,11 @@ int freenect_init_registration(freenect_device* dev)
 	// Fill tables.
 	complete_tables(reg);
 
+	// Only the default mode's cache is looked up when a device opens, and one that is already
+	// mapped is valid, so other modes' tables never overwrite it.
+	if (dev->video_resolution == FREENECT_RESOLUTION_MEDIUM && !dev->registration_cache)
+		freenect_save_registration_cache(dev);
+
 	return 0;
 }
 
@@ -360,12 +506,32 @@ freenect_registration freenect_copy_registration(freenect_device* dev)
 	retval.raw_to_mm_shift    = (uint16_t*)malloc( sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE );
 	retval.depth_to_rgb_shift = (int32_t*)malloc( sizeof( int32_t) * DEPTH_MAX_METRIC_VALUE );
 	retval.registration_table = (int32_t (*)[2])malloc( sizeof( int32_t) * DEPTH_X_RES * DEPTH_Y_RES * 2 );
-	complete_tables(&retval);
+	retval.mapped = 0;
+	// the device's tables are already complete for the same parameters, copying is far cheaper than recomputing
+	if (dev->registration.raw_to_mm_shift) {
+		memcpy(retval.raw_to_mm_shift, dev->registration.raw_to_mm_shift, sizeof(uint16_t) * DEPTH_MAX_RAW_VALUE);
+		memcpy(retval.depth_to_rgb_shift, dev->registration.depth_to_rgb_shift, sizeof(int32_t) * DEPTH_MAX_METRIC_VALUE);
+		memcpy(retval.registration_table, dev->registration.registration_table, sizeof(int32_t) * DEPTH_X_RES * DEPTH_Y_RES * 2);
+	} else
+		complete_tables(&retval);
 	return retval;
 }
 
+freenect_zero_plane_info freenect_get_zero_plane_info(freenect_device* dev)
+{
+	return dev->registration.zero_plane_info;
+}
+
 int freenect_destroy_registration(freenect_registration* reg)
 {
+	if (reg->mapped) {
+		// tables belong to the cache mapping
+		reg->raw_to_mm_shift = NULL;
+		reg->depth_to_rgb_shift = NULL;
+		reg->registration_table = NULL;
+		reg->mapped = 0;
+		return 0;
+	}
 	if (reg->raw_to_mm_shift) {
 		free(reg->raw_to_mm_shift);
 		reg->raw_to_mm_shift = NULL;
@@ -28,10 +28,15 @@
 #define REGISTRATION_H
 
 #include "libfreenect.h"
+#include "libfreenect-registration.h"
 
 // Internal function declarations relating to registration
 int freenect_init_registration(freenect_device* dev);
 int freenect_apply_registration(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
 int freenect_apply_depth_to_mm(freenect_device* dev, uint8_t* input_packed, uint16_t* output_mm);
+int freenect_load_registration_cache(freenect_device* dev, freenect_resolution video_resolution);
+void freenect_unload_registration_cache(freenect_device* dev);
+// Fills the tables of reg from its parameters, exposed so bench can measure it
+void complete_tables(freenect_registration* reg);
 
 #endif
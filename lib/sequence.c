@@ -0,0 +1,608 @@
+#include "sequence.h"
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SEQUENCE_VERSION 1
+
+// everything is in host byte order
+typedef struct {
+	char magic[4]; // CBSQ
+	uint32_t version;
+	uint16_t width;
+	uint16_t height;
+	uint32_t chunk; // most frames in a chunk
+} sequence_header_t;
+
+// one device's frames, the first one coded on its own, every other one against the one before
+typedef struct {
+	char magic[4]; // CBCK
+	uint32_t device;
+	uint32_t frames;
+	uint32_t size; // bytes of frames following the header
+	double ref_pix_size;
+	double ref_distance;
+} sequence_chunk_t;
+
+typedef struct {
+	double timestamp;
+	uint32_t size; // bytes of code following the header
+	uint32_t reserved;
+} sequence_record_t;
+
+typedef struct {
+	uint64_t chunk; // file offset of the chunk
+	uint32_t offset; // of the frame's record from the chunk
+	uint32_t device;
+	double timestamp;
+} sequence_entry_t;
+
+typedef struct {
+	char magic[4]; // CBIX
+	uint32_t version;
+	uint64_t index; // file offset of the entries
+	uint64_t count;
+} sequence_footer_t;
+
+typedef struct {
+	uint16_t* depth;
+	sequence_frame_t frame;
+	int ready; // copied in, the writer may take it
+} sequence_slot_t;
+
+typedef struct {
+	uint16_t* previous; // last frame written, the prediction for the next one
+	uint8_t* chunk; // header and records of the chunk being filled
+	size_t size;
+	int frames;
+	uint64_t* entries; // index entries of the chunk's frames, their chunk offset isn't known until it's written
+} sequence_device_t;
+
+struct sequence_writer_t {
+	int fd;
+	uint64_t offset; // bytes written to the file
+	int width, height;
+	int queue;
+	int chunk;
+	sequence_slot_t* slots;
+	uint64_t head; // frames ever queued
+	uint64_t tail; // frames ever taken by the writer thread
+	int closing;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+	sequence_device_t* devices;
+	int device_count;
+	sequence_entry_t* entries;
+	uint64_t entry_count;
+	uint64_t entry_capacity;
+	uint8_t* code; // scratch for one encoded frame
+	sequence_stats_t stats;
+};
+
+struct sequence_reader_t {
+	uint8_t* data;
+	size_t size;
+	int width, height;
+	sequence_entry_t* entries;
+	int count;
+	int owns_entries; // scanned rather than mapped from the footer
+	// the last frame decoded of each device, so reading a device's frames in order costs one frame each
+	int cache_count;
+	int* cache_entry;
+	uint16_t** cache;
+};
+
+static double sequence_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline uint8_t* sequence_put(uint8_t* out, uint32_t value)
+{
+	while (value >= 0x80)
+	{
+		*out++ = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+static inline const uint8_t* sequence_get(const uint8_t* in, const uint8_t* end, uint32_t* value)
+{
+	uint32_t result = 0;
+	int shift = 0;
+	while (in < end && shift < 35)
+	{
+		uint8_t byte = *in++;
+		result |= (uint32_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+		{
+			*value = result;
+			return in;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+// a token is either a run of zero residuals, (run - 1) << 1 | 1, or one zigzagged residual shifted up by one
+size_t sequence_encode(const uint16_t* depth, const uint16_t* previous, int pixels, uint8_t* code)
+{
+	uint8_t* out = code;
+	uint32_t run = 0;
+	int i;
+	for (i = 0; i < pixels; i++)
+	{
+		int prediction = previous ? previous[i] : (i > 0 ? depth[i - 1] : 0);
+		int residual = (int)depth[i] - prediction;
+		if (residual == 0)
+		{
+			++run;
+			continue;
+		}
+		if (run > 0)
+		{
+			out = sequence_put(out, (run - 1) << 1 | 1);
+			run = 0;
+		}
+		uint32_t zigzag = residual < 0 ? ((uint32_t)-residual << 1) - 1 : (uint32_t)residual << 1;
+		out = sequence_put(out, zigzag << 1);
+	}
+	if (run > 0)
+		out = sequence_put(out, (run - 1) << 1 | 1);
+	return out - code;
+}
+
+int sequence_decode(const uint8_t* code, size_t size, const uint16_t* previous, int pixels, uint16_t* depth)
+{
+	const uint8_t* end = code + size;
+	int i = 0;
+	while (i < pixels)
+	{
+		uint32_t token;
+		code = sequence_get(code, end, &token);
+		if (!code)
+			return -1;
+		if (token & 1)
+		{
+			uint32_t run = (token >> 1) + 1;
+			if (run > (uint32_t)(pixels - i))
+				return -1;
+			if (previous)
+				memcpy(depth + i, previous + i, sizeof(uint16_t) * run);
+			else
+			{
+				uint16_t value = i > 0 ? depth[i - 1] : 0;
+				uint32_t j;
+				for (j = 0; j < run; j++)
+					depth[i + j] = value;
+			}
+			i += run;
+		} else {
+			uint32_t zigzag = token >> 1;
+			int residual = zigzag & 1 ? -(int)((zigzag + 1) >> 1) : (int)(zigzag >> 1);
+			int prediction = previous ? previous[i] : (i > 0 ? depth[i - 1] : 0);
+			depth[i] = (uint16_t)(prediction + residual);
+			++i;
+		}
+	}
+	return 0;
+}
+
+// only the writer thread, or whoever owns the writer before it starts and after it ends, writes
+static void sequence_write(sequence_writer_t* writer, const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	// past a failed write the offsets in the index would be wrong anyway
+	if (writer->stats.error)
+		return;
+	while (size > 0)
+	{
+		ssize_t written = write(writer->fd, bytes, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+		{
+			pthread_mutex_lock(&writer->mutex);
+			writer->stats.error = written < 0 ? errno : ENOSPC;
+			pthread_mutex_unlock(&writer->mutex);
+			return;
+		}
+		bytes += written;
+		size -= written;
+		writer->offset += written;
+	}
+}
+
+static void sequence_flush_chunk(sequence_writer_t* writer, sequence_device_t* device)
+{
+	if (device->frames == 0)
+		return;
+	sequence_chunk_t* chunk = (sequence_chunk_t*)device->chunk;
+	chunk->frames = device->frames;
+	chunk->size = device->size - sizeof(sequence_chunk_t);
+	int i;
+	for (i = 0; i < device->frames; i++)
+		writer->entries[device->entries[i]].chunk = writer->offset;
+	sequence_write(writer, device->chunk, device->size);
+	device->frames = 0;
+	device->size = 0;
+}
+
+static void sequence_writer_encode(sequence_writer_t* writer, sequence_slot_t* slot)
+{
+	int pixels = writer->width * writer->height;
+	int id = slot->frame.device;
+	if (id < 0 || writer->stats.error)
+		return;
+	if (id >= writer->device_count)
+	{
+		int count = id + 1;
+		writer->devices = (sequence_device_t*)realloc(writer->devices, sizeof(sequence_device_t) * count);
+		memset(writer->devices + writer->device_count, 0, sizeof(sequence_device_t) * (count - writer->device_count));
+		writer->device_count = count;
+	}
+	sequence_device_t* device = writer->devices + id;
+	if (!device->chunk)
+	{
+		device->previous = (uint16_t*)malloc(sizeof(uint16_t) * pixels);
+		// every frame could take up to 3 bytes a pixel
+		device->chunk = (uint8_t*)malloc(sizeof(sequence_chunk_t) + (sizeof(sequence_record_t) + pixels * 3) * writer->chunk);
+		device->entries = (uint64_t*)malloc(sizeof(uint64_t) * writer->chunk);
+	}
+	if (device->frames == 0)
+	{
+		sequence_chunk_t chunk;
+		memcpy(chunk.magic, "CBCK", 4);
+		chunk.device = id;
+		chunk.frames = 0;
+		chunk.size = 0;
+		chunk.ref_pix_size = slot->frame.ref_pix_size;
+		chunk.ref_distance = slot->frame.ref_distance;
+		memcpy(device->chunk, &chunk, sizeof(chunk));
+		device->size = sizeof(chunk);
+	}
+	double start = sequence_time();
+	sequence_record_t record;
+	record.timestamp = slot->frame.timestamp;
+	record.reserved = 0;
+	record.size = sequence_encode(slot->depth, device->frames > 0 ? device->previous : 0, pixels, device->chunk + device->size + sizeof(record));
+	double encode_time = sequence_time() - start;
+	if (writer->entry_count == writer->entry_capacity)
+	{
+		writer->entry_capacity = writer->entry_capacity ? writer->entry_capacity * 2 : 4096;
+		writer->entries = (sequence_entry_t*)realloc(writer->entries, sizeof(sequence_entry_t) * writer->entry_capacity);
+	}
+	sequence_entry_t* entry = writer->entries + writer->entry_count;
+	entry->chunk = 0;
+	entry->offset = device->size;
+	entry->device = id;
+	entry->timestamp = slot->frame.timestamp;
+	device->entries[device->frames] = writer->entry_count++;
+	memcpy(device->chunk + device->size, &record, sizeof(record));
+	device->size += sizeof(record) + record.size;
+	memcpy(device->previous, slot->depth, sizeof(uint16_t) * pixels);
+	++device->frames;
+	pthread_mutex_lock(&writer->mutex);
+	writer->stats.raw_bytes += sizeof(uint16_t) * pixels;
+	writer->stats.encoded_bytes += sizeof(record) + record.size;
+	writer->stats.encode_time += encode_time;
+	writer->stats.frames++;
+	pthread_mutex_unlock(&writer->mutex);
+	if (device->frames == writer->chunk)
+		sequence_flush_chunk(writer, device);
+}
+
+static void* sequence_writer_main(void* data)
+{
+	sequence_writer_t* writer = (sequence_writer_t*)data;
+	pthread_mutex_lock(&writer->mutex);
+	for (;;)
+	{
+		sequence_slot_t* slot = writer->slots + writer->tail % writer->queue;
+		if (writer->tail == writer->head || !slot->ready)
+		{
+			if (writer->closing && writer->tail == writer->head)
+				break;
+			pthread_cond_wait(&writer->cond, &writer->mutex);
+			continue;
+		}
+		// the slot stays ours until tail moves past it, encode without holding up pushes
+		pthread_mutex_unlock(&writer->mutex);
+		sequence_writer_encode(writer, slot);
+		pthread_mutex_lock(&writer->mutex);
+		slot->ready = 0;
+		++writer->tail;
+	}
+	pthread_mutex_unlock(&writer->mutex);
+	return 0;
+}
+
+sequence_writer_t* sequence_writer_open(const char* path, int width, int height, int queue, int chunk)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return 0;
+	queue = queue > 0 ? queue : 32;
+	chunk = chunk > 0 ? chunk : 30;
+	sequence_writer_t* writer = (sequence_writer_t*)malloc(sizeof(sequence_writer_t) + sizeof(sequence_slot_t) * queue + sizeof(uint16_t) * width * height * queue);
+	memset(writer, 0, sizeof(sequence_writer_t));
+	writer->fd = fd;
+	writer->width = width;
+	writer->height = height;
+	writer->queue = queue;
+	writer->chunk = chunk;
+	writer->slots = (sequence_slot_t*)(writer + 1);
+	uint16_t* depth = (uint16_t*)(writer->slots + queue);
+	int i;
+	for (i = 0; i < queue; i++)
+	{
+		writer->slots[i].depth = depth + i * width * height;
+		writer->slots[i].ready = 0;
+	}
+	sequence_header_t header;
+	memcpy(header.magic, "CBSQ", 4);
+	header.version = SEQUENCE_VERSION;
+	header.width = width;
+	header.height = height;
+	header.chunk = chunk;
+	pthread_mutex_init(&writer->mutex, 0);
+	sequence_write(writer, &header, sizeof(header));
+	if (writer->stats.error)
+	{
+		close(fd);
+		pthread_mutex_destroy(&writer->mutex);
+		free(writer);
+		return 0;
+	}
+	pthread_cond_init(&writer->cond, 0);
+	pthread_create(&writer->thread, 0, sequence_writer_main, writer);
+	return writer;
+}
+
+int sequence_writer_push(sequence_writer_t* writer, sequence_frame_t frame, const uint16_t* depth)
+{
+	pthread_mutex_lock(&writer->mutex);
+	if (writer->closing || writer->head - writer->tail >= (uint64_t)writer->queue)
+	{
+		++writer->stats.dropped;
+		pthread_mutex_unlock(&writer->mutex);
+		return -1;
+	}
+	sequence_slot_t* slot = writer->slots + writer->head % writer->queue;
+	++writer->head;
+	pthread_mutex_unlock(&writer->mutex);
+	// copied outside the lock, the writer thread waits for the ready flag
+	memcpy(slot->depth, depth, sizeof(uint16_t) * writer->width * writer->height);
+	slot->frame = frame;
+	pthread_mutex_lock(&writer->mutex);
+	slot->ready = 1;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+	return 0;
+}
+
+sequence_stats_t sequence_writer_stats(sequence_writer_t* writer)
+{
+	pthread_mutex_lock(&writer->mutex);
+	sequence_stats_t stats = writer->stats;
+	pthread_mutex_unlock(&writer->mutex);
+	return stats;
+}
+
+void sequence_writer_close(sequence_writer_t* writer)
+{
+	pthread_mutex_lock(&writer->mutex);
+	writer->closing = 1;
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->mutex);
+	pthread_join(writer->thread, 0);
+	int i;
+	for (i = 0; i < writer->device_count; i++)
+		sequence_flush_chunk(writer, writer->devices + i);
+	sequence_footer_t footer;
+	memcpy(footer.magic, "CBIX", 4);
+	footer.version = SEQUENCE_VERSION;
+	footer.index = writer->offset;
+	footer.count = writer->entry_count;
+	sequence_write(writer, writer->entries, sizeof(sequence_entry_t) * writer->entry_count);
+	sequence_write(writer, &footer, sizeof(footer));
+	close(writer->fd);
+	for (i = 0; i < writer->device_count; i++)
+	{
+		free(writer->devices[i].previous);
+		free(writer->devices[i].chunk);
+		free(writer->devices[i].entries);
+	}
+	free(writer->devices);
+	free(writer->entries);
+	pthread_mutex_destroy(&writer->mutex);
+	pthread_cond_destroy(&writer->cond);
+	free(writer);
+}
+
+// without an index, walk the complete chunks, a chunk's frames are in the order they were written
+static int sequence_reader_scan(sequence_reader_t* reader)
+{
+	size_t offset = sizeof(sequence_header_t);
+	int capacity = 0;
+	reader->entries = 0;
+	reader->count = 0;
+	reader->owns_entries = 1;
+	while (offset + sizeof(sequence_chunk_t) <= reader->size)
+	{
+		sequence_chunk_t chunk;
+		memcpy(&chunk, reader->data + offset, sizeof(chunk));
+		if (memcmp(chunk.magic, "CBCK", 4) != 0 || offset + sizeof(chunk) + chunk.size > reader->size)
+			break;
+		size_t record_offset = sizeof(chunk);
+		uint32_t i;
+		for (i = 0; i < chunk.frames && record_offset + sizeof(sequence_record_t) <= sizeof(chunk) + chunk.size; i++)
+		{
+			sequence_record_t record;
+			memcpy(&record, reader->data + offset + record_offset, sizeof(record));
+			if (reader->count == capacity)
+			{
+				capacity = capacity ? capacity * 2 : 4096;
+				reader->entries = (sequence_entry_t*)realloc(reader->entries, sizeof(sequence_entry_t) * capacity);
+			}
+			sequence_entry_t* entry = reader->entries + reader->count++;
+			entry->chunk = offset;
+			entry->offset = record_offset;
+			entry->device = chunk.device;
+			entry->timestamp = record.timestamp;
+			record_offset += sizeof(record) + record.size;
+		}
+		offset += sizeof(chunk) + chunk.size;
+	}
+	return 0;
+}
+
+sequence_reader_t* sequence_reader_open(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(sequence_header_t))
+	{
+		close(fd);
+		return 0;
+	}
+	void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+	sequence_header_t header;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, "CBSQ", 4) != 0 || header.version != SEQUENCE_VERSION)
+	{
+		munmap(data, st.st_size);
+		return 0;
+	}
+	sequence_reader_t* reader = (sequence_reader_t*)malloc(sizeof(sequence_reader_t));
+	memset(reader, 0, sizeof(sequence_reader_t));
+	reader->data = (uint8_t*)data;
+	reader->size = st.st_size;
+	reader->width = header.width;
+	reader->height = header.height;
+	sequence_footer_t footer;
+	if (reader->size >= sizeof(header) + sizeof(footer))
+		memcpy(&footer, reader->data + reader->size - sizeof(footer), sizeof(footer));
+	if (reader->size >= sizeof(header) + sizeof(footer) && memcmp(footer.magic, "CBIX", 4) == 0 &&
+		footer.index + footer.count * sizeof(sequence_entry_t) + sizeof(footer) == reader->size)
+	{
+		// the entries are 8 byte aligned in the file as long as everything before them is
+		if (footer.index % 8 == 0)
+			reader->entries = (sequence_entry_t*)(reader->data + footer.index);
+		else {
+			reader->entries = (sequence_entry_t*)malloc(sizeof(sequence_entry_t) * footer.count);
+			memcpy(reader->entries, reader->data + footer.index, sizeof(sequence_entry_t) * footer.count);
+			reader->owns_entries = 1;
+		}
+		reader->count = footer.count;
+	} else
+		sequence_reader_scan(reader);
+	int i;
+	for (i = 0; i < reader->count; i++)
+		if ((int)reader->entries[i].device + 1 > reader->cache_count)
+			reader->cache_count = reader->entries[i].device + 1;
+	reader->cache_entry = (int*)malloc(sizeof(int) * reader->cache_count);
+	reader->cache = (uint16_t**)malloc(sizeof(uint16_t*) * reader->cache_count);
+	for (i = 0; i < reader->cache_count; i++)
+	{
+		reader->cache_entry[i] = -1;
+		reader->cache[i] = 0;
+	}
+	return reader;
+}
+
+int sequence_reader_count(sequence_reader_t* reader)
+{
+	return reader->count;
+}
+
+void sequence_reader_size(sequence_reader_t* reader, int* width, int* height)
+{
+	*width = reader->width;
+	*height = reader->height;
+}
+
+sequence_frame_t sequence_reader_info(sequence_reader_t* reader, int i)
+{
+	sequence_frame_t frame;
+	sequence_entry_t* entry = reader->entries + i;
+	sequence_chunk_t chunk;
+	memcpy(&chunk, reader->data + entry->chunk, sizeof(chunk));
+	frame.device = entry->device;
+	frame.timestamp = entry->timestamp;
+	frame.ref_pix_size = chunk.ref_pix_size;
+	frame.ref_distance = chunk.ref_distance;
+	return frame;
+}
+
+int sequence_reader_read(sequence_reader_t* reader, int i, uint16_t* depth)
+{
+	if (i < 0 || i >= reader->count)
+		return -1;
+	int pixels = reader->width * reader->height;
+	sequence_entry_t* entry = reader->entries + i;
+	uint16_t** cache = reader->cache + entry->device;
+	int* cached = reader->cache_entry + entry->device;
+	if (!*cache)
+		*cache = (uint16_t*)malloc(sizeof(uint16_t) * pixels);
+	const uint8_t* chunk = reader->data + entry->chunk;
+	// continue from the cached frame if it is an earlier one of the same chunk, otherwise from the chunk's start
+	size_t offset = sizeof(sequence_chunk_t);
+	int first = 1;
+	if (*cached >= 0 && reader->entries[*cached].chunk == entry->chunk && reader->entries[*cached].offset <= entry->offset)
+	{
+		if (*cached == i)
+		{
+			memcpy(depth, *cache, sizeof(uint16_t) * pixels);
+			return 0;
+		}
+		sequence_record_t record;
+		memcpy(&record, chunk + reader->entries[*cached].offset, sizeof(record));
+		offset = reader->entries[*cached].offset + sizeof(record) + record.size;
+		first = 0;
+	}
+	*cached = -1;
+	while (offset <= entry->offset)
+	{
+		sequence_record_t record;
+		memcpy(&record, chunk + offset, sizeof(record));
+		if (sequence_decode(chunk + offset + sizeof(record), record.size, first ? 0 : *cache, pixels, depth) < 0)
+			return -1;
+		memcpy(*cache, depth, sizeof(uint16_t) * pixels);
+		first = 0;
+		offset += sizeof(record) + record.size;
+	}
+	*cached = i;
+	return 0;
+}
+
+void sequence_reader_close(sequence_reader_t* reader)
+{
+	int i;
+	for (i = 0; i < reader->cache_count; i++)
+		free(reader->cache[i]);
+	free(reader->cache);
+	free(reader->cache_entry);
+	if (reader->owns_entries)
+		free(reader->entries);
+	munmap(reader->data, reader->size);
+	free(reader);
+}
@@ -0,0 +1,55 @@
+#ifndef _GUARD_SEQUENCE_H_
+#define _GUARD_SEQUENCE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Lossless archive of millimeter depth frames from several devices.  Frames are compressed
+// on a background thread: each pixel is predicted from the same pixel of the device's previous
+// frame (from its left neighbour in the first frame of a chunk), the residuals are zigzag
+// coded and runs of zeros collapse into one varint.  Frames of one device are grouped into
+// chunks that start from scratch, an index at the end of the file points at every frame, so
+// any frame is at most a chunk's worth of decoding away.
+
+typedef struct sequence_writer_t sequence_writer_t;
+typedef struct sequence_reader_t sequence_reader_t;
+
+typedef struct {
+	uint64_t frames; // frames written
+	uint64_t dropped; // frames pushed while the queue was full
+	uint64_t raw_bytes;
+	uint64_t encoded_bytes;
+	double encode_time; // seconds the writer thread spent compressing
+	int error; // errno of the first write that failed, nothing is written after it, 0 while all went through
+} sequence_stats_t;
+
+typedef struct {
+	int device; // the id the device was opened with, replay matches it against cubic_open's ids
+	double timestamp;
+	double ref_pix_size; // the device's calibration, as cubic_depth_rows_to_cube takes it
+	double ref_distance;
+} sequence_frame_t;
+
+// the frame codec on its own, previous is 0 for a frame coded without reference, code needs room for 3 bytes a pixel
+size_t sequence_encode(const uint16_t* depth, const uint16_t* previous, int pixels, uint8_t* code);
+// returns 0 on success, -1 if the code is corrupt
+int sequence_decode(const uint8_t* code, size_t size, const uint16_t* previous, int pixels, uint16_t* depth);
+
+// queue is how many frames may wait for the writer thread, chunk is frames per device per chunk, 0 for the defaults
+sequence_writer_t* sequence_writer_open(const char* path, int width, int height, int queue, int chunk);
+// copies the frame into the queue, returns -1 and drops it if the queue is full, safe from any thread
+int sequence_writer_push(sequence_writer_t* writer, sequence_frame_t frame, const uint16_t* depth);
+sequence_stats_t sequence_writer_stats(sequence_writer_t* writer);
+// writes what is queued and the index
+void sequence_writer_close(sequence_writer_t* writer);
+
+// recordings that were never closed have no index, their complete chunks are found by scanning
+sequence_reader_t* sequence_reader_open(const char* path);
+int sequence_reader_count(sequence_reader_t* reader);
+void sequence_reader_size(sequence_reader_t* reader, int* width, int* height);
+sequence_frame_t sequence_reader_info(sequence_reader_t* reader, int i);
+// decodes the i-th frame written, in any order, returns 0 on success
+int sequence_reader_read(sequence_reader_t* reader, int i, uint16_t* depth);
+void sequence_reader_close(sequence_reader_t* reader);
+
+#endif
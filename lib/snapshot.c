@@ -0,0 +1,300 @@
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BRICK_VOXELS (SNAPSHOT_BRICK * SNAPSHOT_BRICK * SNAPSHOT_BRICK)
+
+// everything is in host byte order, and 8 byte aligned in the file
+typedef struct {
+	char magic[4]; // CBSN
+	uint32_t version;
+	uint32_t dims[3];
+	uint32_t transforms; // cubic_transform_t following the header
+	double resolution;
+	uint64_t directory; // file offset of one brick offset per brick, 0 if the brick is empty, x fastest
+} snapshot_header_t;
+
+typedef struct {
+	uint32_t width; // bytes of each count, 1, 2 or 4
+	uint32_t count; // non-zero voxels, thus counts following the header
+	uint64_t mask[SNAPSHOT_BRICK_VOXELS / 64]; // bit per voxel, x fastest
+} snapshot_brick_t;
+
+struct snapshot_t {
+	const uint8_t* data;
+	size_t size;
+	const snapshot_header_t* header;
+	const cubic_transform_t* transforms;
+	const uint64_t* directory;
+	size_t bricks[3];
+};
+
+static size_t snapshot_bricks(uint32_t dim)
+{
+	return ((size_t)dim + SNAPSHOT_BRICK - 1) / SNAPSHOT_BRICK;
+}
+
+static size_t snapshot_align(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+int snapshot_write(const char* path, const uint32_t* cube, const size_t dims[3], double resolution, const cubic_transform_t* transforms, int count)
+{
+	size_t bx = snapshot_bricks(dims[0]), by = snapshot_bricks(dims[1]), bz = snapshot_bricks(dims[2]);
+	size_t brick_count = bx * by * bz;
+	snapshot_header_t header;
+	memcpy(header.magic, "CBSN", 4);
+	header.version = SNAPSHOT_VERSION;
+	header.dims[0] = dims[0];
+	header.dims[1] = dims[1];
+	header.dims[2] = dims[2];
+	header.transforms = transforms ? count : 0;
+	header.resolution = resolution;
+	header.directory = sizeof(header) + sizeof(cubic_transform_t) * header.transforms;
+	uint64_t* directory = (uint64_t*)malloc(sizeof(uint64_t) * brick_count);
+	// a brick is at most its header and 4 bytes a voxel
+	uint8_t* brick = (uint8_t*)malloc(snapshot_align(sizeof(snapshot_brick_t) + sizeof(uint32_t) * SNAPSHOT_BRICK_VOXELS));
+	uint32_t values[SNAPSHOT_BRICK_VOXELS];
+	FILE* out = fopen(path, "wb");
+	if (!out)
+	{
+		free(directory);
+		free(brick);
+		return -1;
+	}
+	// the directory is only known after the bricks, leave room for it and come back
+	fwrite(&header, sizeof(header), 1, out);
+	if (header.transforms)
+		fwrite(transforms, sizeof(cubic_transform_t), header.transforms, out);
+	memset(directory, 0, sizeof(uint64_t) * brick_count);
+	fwrite(directory, sizeof(uint64_t), brick_count, out);
+	uint64_t offset = header.directory + sizeof(uint64_t) * brick_count;
+	size_t i, j, k, x, y, z;
+	for (k = 0; k < bz; k++)
+		for (j = 0; j < by; j++)
+			for (i = 0; i < bx; i++)
+			{
+				snapshot_brick_t* packed = (snapshot_brick_t*)brick;
+				memset(packed, 0, sizeof(snapshot_brick_t));
+				uint32_t max = 0;
+				for (z = 0; z < SNAPSHOT_BRICK; z++)
+					for (y = 0; y < SNAPSHOT_BRICK; y++)
+						for (x = 0; x < SNAPSHOT_BRICK; x++)
+						{
+							size_t wx = i * SNAPSHOT_BRICK + x, wy = j * SNAPSHOT_BRICK + y, wz = k * SNAPSHOT_BRICK + z;
+							if (wx >= dims[0] || wy >= dims[1] || wz >= dims[2])
+								continue;
+							uint32_t value = cube[wz * dims[0] * dims[1] + wy * dims[0] + wx];
+							if (!value)
+								continue;
+							int bit = (z * SNAPSHOT_BRICK + y) * SNAPSHOT_BRICK + x;
+							packed->mask[bit >> 6] |= (uint64_t)1 << (bit & 63);
+							values[packed->count++] = value;
+							if (value > max)
+								max = value;
+						}
+				if (packed->count == 0)
+					continue;
+				packed->width = max > 0xffff ? 4 : (max > 0xff ? 2 : 1);
+				uint8_t* payload = brick + sizeof(snapshot_brick_t);
+				for (x = 0; x < packed->count; x++)
+					if (packed->width == 1)
+						payload[x] = (uint8_t)values[x];
+					else if (packed->width == 2)
+						((uint16_t*)payload)[x] = (uint16_t)values[x];
+					else
+						((uint32_t*)payload)[x] = values[x];
+				size_t size = snapshot_align(sizeof(snapshot_brick_t) + packed->width * packed->count);
+				memset(payload + packed->width * packed->count, 0, size - sizeof(snapshot_brick_t) - packed->width * packed->count);
+				fwrite(brick, size, 1, out);
+				directory[(k * by + j) * bx + i] = offset;
+				offset += size;
+			}
+	fseek(out, header.directory, SEEK_SET);
+	fwrite(directory, sizeof(uint64_t), brick_count, out);
+	int failed = ferror(out);
+	if (fclose(out) != 0)
+		failed = 1;
+	free(directory);
+	free(brick);
+	return failed ? -1 : 0;
+}
+
+// every brick the directory points at has to lie within the file, with as many counts as its mask has bits
+static int snapshot_bricks_valid(const uint8_t* data, uint64_t size, const uint64_t* directory, size_t bricks)
+{
+	size_t i;
+	for (i = 0; i < bricks; i++)
+	{
+		uint64_t offset = directory[i];
+		if (!offset)
+			continue;
+		if ((offset & 7) || offset > size || size - offset < sizeof(snapshot_brick_t))
+			return 0;
+		const snapshot_brick_t* brick = (const snapshot_brick_t*)(data + offset);
+		if (brick->width != 1 && brick->width != 2 && brick->width != 4)
+			return 0;
+		uint32_t count = 0;
+		int word;
+		for (word = 0; word < SNAPSHOT_BRICK_VOXELS / 64; word++)
+			count += __builtin_popcountll(brick->mask[word]);
+		if (brick->count != count || (uint64_t)brick->width * count > size - offset - sizeof(snapshot_brick_t))
+			return 0;
+	}
+	return 1;
+}
+
+snapshot_t* snapshot_open(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snapshot_header_t))
+	{
+		close(fd);
+		return 0;
+	}
+	void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+	const snapshot_header_t* header = (const snapshot_header_t*)data;
+	// 3 dims of up to 2^29 bricks each overflow 64 bits, but 2 don't, and a directory that big couldn't fit in the file anyway
+	uint64_t capacity = st.st_size / sizeof(uint64_t);
+	uint64_t plane = (uint64_t)snapshot_bricks(header->dims[0]) * snapshot_bricks(header->dims[1]);
+	uint64_t bricks = plane > 0 && snapshot_bricks(header->dims[2]) > capacity / plane ? capacity + 1 : plane * snapshot_bricks(header->dims[2]);
+	if (memcmp(header->magic, "CBSN", 4) != 0 || header->version != SNAPSHOT_VERSION ||
+		header->directory != sizeof(snapshot_header_t) + sizeof(cubic_transform_t) * header->transforms ||
+		bricks > capacity || header->directory + sizeof(uint64_t) * bricks > (uint64_t)st.st_size ||
+		!snapshot_bricks_valid((const uint8_t*)data, st.st_size, (const uint64_t*)((const uint8_t*)data + header->directory), bricks))
+	{
+		munmap(data, st.st_size);
+		return 0;
+	}
+	snapshot_t* snapshot = (snapshot_t*)malloc(sizeof(snapshot_t));
+	snapshot->data = (const uint8_t*)data;
+	snapshot->size = st.st_size;
+	snapshot->header = header;
+	snapshot->transforms = (const cubic_transform_t*)(snapshot->data + sizeof(snapshot_header_t));
+	snapshot->directory = (const uint64_t*)(snapshot->data + header->directory);
+	snapshot->bricks[0] = snapshot_bricks(header->dims[0]);
+	snapshot->bricks[1] = snapshot_bricks(header->dims[1]);
+	snapshot->bricks[2] = snapshot_bricks(header->dims[2]);
+	return snapshot;
+}
+
+void snapshot_dims(snapshot_t* snapshot, size_t dims[3])
+{
+	dims[0] = snapshot->header->dims[0];
+	dims[1] = snapshot->header->dims[1];
+	dims[2] = snapshot->header->dims[2];
+}
+
+double snapshot_resolution(snapshot_t* snapshot)
+{
+	return snapshot->header->resolution;
+}
+
+int snapshot_transform_count(snapshot_t* snapshot)
+{
+	return snapshot->header->transforms;
+}
+
+cubic_transform_t snapshot_transform(snapshot_t* snapshot, int i)
+{
+	return snapshot->transforms[i];
+}
+
+snapshot_stats_t snapshot_stats(snapshot_t* snapshot)
+{
+	snapshot_stats_t stats;
+	stats.bricks = snapshot->bricks[0] * snapshot->bricks[1] * snapshot->bricks[2];
+	stats.occupied = stats.voxels = 0;
+	stats.bytes = snapshot->size;
+	uint64_t i;
+	for (i = 0; i < stats.bricks; i++)
+		if (snapshot->directory[i])
+		{
+			++stats.occupied;
+			stats.voxels += ((const snapshot_brick_t*)(snapshot->data + snapshot->directory[i]))->count;
+		}
+	return stats;
+}
+
+static inline uint32_t snapshot_brick_value(const snapshot_brick_t* brick, int rank)
+{
+	const uint8_t* payload = (const uint8_t*)(brick + 1);
+	if (brick->width == 1)
+		return payload[rank];
+	if (brick->width == 2)
+		return ((const uint16_t*)payload)[rank];
+	return ((const uint32_t*)payload)[rank];
+}
+
+uint32_t snapshot_voxel(snapshot_t* snapshot, size_t x, size_t y, size_t z)
+{
+	const snapshot_header_t* header = snapshot->header;
+	if (x >= header->dims[0] || y >= header->dims[1] || z >= header->dims[2])
+		return 0;
+	uint64_t offset = snapshot->directory[((z / SNAPSHOT_BRICK) * snapshot->bricks[1] + y / SNAPSHOT_BRICK) * snapshot->bricks[0] + x / SNAPSHOT_BRICK];
+	if (!offset)
+		return 0;
+	const snapshot_brick_t* brick = (const snapshot_brick_t*)(snapshot->data + offset);
+	int bit = ((z % SNAPSHOT_BRICK) * SNAPSHOT_BRICK + y % SNAPSHOT_BRICK) * SNAPSHOT_BRICK + x % SNAPSHOT_BRICK;
+	if (!(brick->mask[bit >> 6] & ((uint64_t)1 << (bit & 63))))
+		return 0;
+	// the rank of the voxel among the brick's non-zero ones
+	int i, rank = 0;
+	for (i = 0; i < (bit >> 6); i++)
+		rank += __builtin_popcountll(brick->mask[i]);
+	rank += __builtin_popcountll(brick->mask[bit >> 6] & (((uint64_t)1 << (bit & 63)) - 1));
+	return snapshot_brick_value(brick, rank);
+}
+
+void snapshot_inflate(snapshot_t* snapshot, uint32_t* cube)
+{
+	const snapshot_header_t* header = snapshot->header;
+	size_t dims[3] = {
+		header->dims[0], header->dims[1], header->dims[2]
+	};
+	memset(cube, 0, sizeof(uint32_t) * dims[0] * dims[1] * dims[2]);
+	size_t i, j, k;
+	for (k = 0; k < snapshot->bricks[2]; k++)
+		for (j = 0; j < snapshot->bricks[1]; j++)
+			for (i = 0; i < snapshot->bricks[0]; i++)
+			{
+				uint64_t offset = snapshot->directory[(k * snapshot->bricks[1] + j) * snapshot->bricks[0] + i];
+				if (!offset)
+					continue;
+				const snapshot_brick_t* brick = (const snapshot_brick_t*)(snapshot->data + offset);
+				int word, rank = 0;
+				for (word = 0; word < SNAPSHOT_BRICK_VOXELS / 64; word++)
+				{
+					uint64_t bits = brick->mask[word];
+					while (bits)
+					{
+						int bit = word * 64 + __builtin_ctzll(bits);
+						bits &= bits - 1;
+						size_t wx = i * SNAPSHOT_BRICK + bit % SNAPSHOT_BRICK;
+						size_t wy = j * SNAPSHOT_BRICK + bit / SNAPSHOT_BRICK % SNAPSHOT_BRICK;
+						size_t wz = k * SNAPSHOT_BRICK + bit / (SNAPSHOT_BRICK * SNAPSHOT_BRICK);
+						cube[wz * dims[0] * dims[1] + wy * dims[0] + wx] = snapshot_brick_value(brick, rank++);
+					}
+				}
+			}
+}
+
+void snapshot_close(snapshot_t* snapshot)
+{
+	munmap((void*)snapshot->data, snapshot->size);
+	free(snapshot);
+}
@@ -0,0 +1,41 @@
+#ifndef _GUARD_SNAPSHOT_H_
+#define _GUARD_SNAPSHOT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "cubic.h"
+
+// A fused cube on disk without its empty space.  The volume is cut into 8x8x8 bricks, a
+// directory holds the file offset of every brick with a hit in it, and each such brick
+// stores a bit mask of its non-zero voxels followed by only their counts, in as few bytes
+// as its largest count needs.  The file is mapped as is, a voxel lookup is a directory
+// read, a bit test and a popcount, nothing is inflated unless asked for.
+
+#define SNAPSHOT_BRICK (8)
+
+typedef struct snapshot_t snapshot_t;
+
+typedef struct {
+	uint64_t bricks; // in the volume
+	uint64_t occupied; // bricks with at least one hit
+	uint64_t voxels; // non-zero voxels
+	uint64_t bytes; // of the whole file
+} snapshot_stats_t;
+
+// transforms is optional, count of them, returns 0 on success
+int snapshot_write(const char* path, const uint32_t* cube, const size_t dims[3], double resolution, const cubic_transform_t* transforms, int count);
+
+snapshot_t* snapshot_open(const char* path);
+void snapshot_dims(snapshot_t* snapshot, size_t dims[3]);
+double snapshot_resolution(snapshot_t* snapshot);
+int snapshot_transform_count(snapshot_t* snapshot);
+cubic_transform_t snapshot_transform(snapshot_t* snapshot, int i);
+snapshot_stats_t snapshot_stats(snapshot_t* snapshot);
+// 0 for anything outside of the volume
+uint32_t snapshot_voxel(snapshot_t* snapshot, size_t x, size_t y, size_t z);
+// into a dense cube laid out as cubic_t.cube
+void snapshot_inflate(snapshot_t* snapshot, uint32_t* cube);
+void snapshot_close(snapshot_t* snapshot);
+
+#endif
@@ -0,0 +1,129 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct
+{
+	double ts; // in us
+	const char* name;
+	int id;
+	char phase;
+} trace_event_t;
+
+// single producer (its thread), single consumer (whoever flushes) ring
+typedef struct trace_buffer_t
+{
+	struct trace_buffer_t* next;
+	int tid;
+	const char* name;
+	int capacity;
+	uint64_t head; // events ever written, only the owning thread moves it
+	uint64_t tail; // events ever flushed, only trace_flush moves it
+	uint64_t dropped;
+	trace_event_t* events;
+} trace_buffer_t;
+
+volatile int trace_enabled = 0;
+static int trace_capacity = 0;
+static trace_buffer_t* trace_buffers = 0;
+static __thread trace_buffer_t* trace_buffer = 0;
+
+static double trace_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+static trace_buffer_t* trace_thread_buffer(void)
+{
+	if (trace_buffer)
+		return trace_buffer;
+	trace_buffer_t* buffer = (trace_buffer_t*)malloc(sizeof(trace_buffer_t) + sizeof(trace_event_t) * trace_capacity);
+	buffer->next = 0;
+	buffer->tid = (int)syscall(SYS_gettid);
+	buffer->name = 0;
+	buffer->capacity = trace_capacity;
+	buffer->head = buffer->tail = buffer->dropped = 0;
+	buffer->events = (trace_event_t*)(buffer + 1);
+	// buffers are never freed, threads may record at any time, push to the list lock-free
+	trace_buffer_t** tail = &trace_buffers;
+	while (!__sync_bool_compare_and_swap(tail, 0, buffer))
+		tail = &(*tail)->next;
+	trace_buffer = buffer;
+	return buffer;
+}
+
+void trace_start(int capacity)
+{
+	if (trace_capacity == 0)
+		trace_capacity = capacity > 0 ? capacity : 65536;
+	trace_enabled = 1;
+}
+
+void trace_stop(void)
+{
+	trace_enabled = 0;
+}
+
+void trace_thread_name(const char* name)
+{
+	if (trace_enabled)
+		trace_thread_buffer()->name = name;
+}
+
+void trace_event(char phase, const char* name, int id)
+{
+	trace_buffer_t* buffer = trace_thread_buffer();
+	uint64_t head = buffer->head;
+	if (head - __sync_fetch_and_add(&buffer->tail, 0) >= (uint64_t)buffer->capacity)
+	{
+		++buffer->dropped;
+		return;
+	}
+	trace_event_t* event = buffer->events + head % buffer->capacity;
+	event->ts = trace_time();
+	event->name = name;
+	event->id = id;
+	event->phase = phase;
+	// publish the event only after it is written
+	__sync_synchronize();
+	buffer->head = head + 1;
+}
+
+int trace_flush(const char* path)
+{
+	FILE* w = fopen(path, "a");
+	if (!w)
+		return -1;
+	// the array format doesn't need the closing bracket, so a file can be appended to across flushes
+	int first = ftell(w) == 0;
+	if (first)
+		fputc('[', w);
+	int pid = getpid();
+	trace_buffer_t* buffer;
+	for (buffer = trace_buffers; buffer; buffer = buffer->next)
+	{
+		if (buffer->name)
+		{
+			fprintf(w, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",", pid, buffer->tid, buffer->name);
+			first = 0;
+		}
+		uint64_t i, head = __sync_fetch_and_add(&buffer->head, 0);
+		for (i = buffer->tail; i < head; i++)
+		{
+			trace_event_t* event = buffer->events + i % buffer->capacity;
+			fprintf(w, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d%s,\"args\":{\"id\":%d}}", first ? "" : ",", event->name, event->phase, event->ts, pid, buffer->tid, event->phase == 'i' ? ",\"s\":\"t\"" : "", event->id);
+			first = 0;
+		}
+		__sync_lock_test_and_set(&buffer->tail, head);
+	}
+	fclose(w);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _GUARD_TRACE_H_
+#define _GUARD_TRACE_H_
+
+// Opt-in timeline tracing of the library threads.  Every thread records begin / end
+// events into its own buffer without taking locks, trace_flush writes what has been
+// recorded so far as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+
+extern volatile int trace_enabled;
+
+// events are names as string literals, only the pointer is kept, id goes into the event's args
+#define TRACE_BEGIN(name, id) do { if (trace_enabled) trace_event('B', name, id); } while (0)
+#define TRACE_END(name, id) do { if (trace_enabled) trace_event('E', name, id); } while (0)
+#define TRACE_INSTANT(name, id) do { if (trace_enabled) trace_event('i', name, id); } while (0)
+
+// starts recording, each thread buffers up to capacity events between flushes, more are dropped
+void trace_start(int capacity);
+void trace_stop(void);
+// names the calling thread on the timeline
+void trace_thread_name(const char* name);
+void trace_event(char phase, const char* name, int id);
+// appends the events recorded since the last flush to a trace file, returns 0 on success
+int trace_flush(const char* path);
+
+#endif
@@ -29,11 +29,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <libusb-1.0/libusb.h>
 #include "freenect_internal.h"
+#include "trace.h"
+
+// libusb_dev_mem_alloc arrived with libusb 1.0.21
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define FNUSB_HAVE_DEV_MEM
+#endif
+
+#define FNUSB_HUGEPAGE_SIZE (2 * 1024 * 1024)
 
 int fnusb_num_devices(fnusb_ctx *ctx)
 {
+	if (ctx->backend)
+		return ctx->backend->num_devices(ctx->backend_state);
 	libusb_device **devs; 
 	//pointer to pointer of device, used to retrieve a list of devices	
 	ssize_t cnt = libusb_get_device_list (ctx->ctx, &devs); 
@@ -58,6 +70,24 @@ int fnusb_num_devices(fnusb_ctx *ctx)
 int fnusb_list_device_attributes(fnusb_ctx *ctx, struct freenect_device_attributes** attribute_list)
 {
 	*attribute_list = NULL; // initialize some return value in case the user is careless.
+	if (ctx->backend)
+	{
+		struct freenect_device_attributes** prev_next = attribute_list;
+		fnusb_device_info info;
+		int i, n = ctx->backend->num_devices(ctx->backend_state), num_cams = 0;
+		for (i = 0; num_cams < n && i < 256; i++)
+		{
+			if (ctx->backend->describe(ctx->backend_state, i, &info) < 0)
+				continue;
+			struct freenect_device_attributes* new_dev_attrs = (struct freenect_device_attributes*)malloc(sizeof(struct freenect_device_attributes));
+			memset(new_dev_attrs, 0, sizeof(*new_dev_attrs));
+			*prev_next = new_dev_attrs;
+			new_dev_attrs->camera_serial = strdup(info.serial);
+			prev_next = &(new_dev_attrs->next);
+			num_cams++;
+		}
+		return num_cams;
+	}
 	libusb_device **devs;
 	//pointer to pointer of device, used to retrieve a list of devices
 	ssize_t count = libusb_get_device_list (ctx->ctx, &devs);
@@ -114,6 +144,41 @@ int fnusb_list_device_attributes(fnusb_ctx *ctx, struct freenect_device_attribut
 	return num_cams;
 }
 
+int fnusb_get_device_bus(fnusb_ctx *ctx, int index)
+{
+	if (ctx->backend)
+	{
+		fnusb_device_info info;
+		if (ctx->backend->describe(ctx->backend_state, index, &info) < 0)
+			return -1;
+		return info.bus;
+	}
+	libusb_device **devs;
+	ssize_t cnt = libusb_get_device_list(ctx->ctx, &devs);
+	if (cnt < 0)
+		return -1;
+	int i, nr_cam = 0, bus = -1;
+	struct libusb_device_descriptor desc;
+	for (i = 0; i < cnt; i++)
+	{
+		int r = libusb_get_device_descriptor(devs[i], &desc);
+		if (r < 0)
+			continue;
+		if (desc.idVendor == VID_MICROSOFT && desc.idProduct == PID_NUI_CAMERA)
+		{
+			// cameras are counted in the same order as fnusb_open_subdevices does
+			if (nr_cam == index)
+			{
+				bus = libusb_get_bus_number(devs[i]);
+				break;
+			}
+			nr_cam++;
+		}
+	}
+	libusb_free_device_list(devs, 1);
+	return bus;
+}
+
 int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx)
 {
 	int res;
@@ -140,6 +205,17 @@ int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx)
 int fnusb_shutdown(fnusb_ctx *ctx)
 {
 	//int res;
+	if (ctx->recorder)
+	{
+		fnusb_record_close(ctx->recorder);
+		ctx->recorder = NULL;
+	}
+	if (ctx->backend)
+	{
+		ctx->backend->destroy(ctx->backend_state);
+		ctx->backend = NULL;
+		ctx->backend_state = NULL;
+	}
 	if (ctx->should_free_ctx)
 	{
 		libusb_exit(ctx->ctx);
@@ -150,14 +226,39 @@ int fnusb_shutdown(fnusb_ctx *ctx)
 
 int fnusb_process_events(fnusb_ctx *ctx)
 {
+	if (ctx->backend)
+		return ctx->backend->process_events(ctx->backend_state, ctx, NULL);
 	return libusb_handle_events(ctx->ctx);
 }
 
 int fnusb_process_events_timeout(fnusb_ctx *ctx, struct timeval* timeout)
 {
+	if (ctx->backend)
+		return ctx->backend->process_events(ctx->backend_state, ctx, timeout);
 	return libusb_handle_events_timeout(ctx->ctx, timeout);
 }
 
+// the camera of a backend device has no libusb handle, but code above checks for one to see
+// whether the camera is open, so it gets a placeholder that is never handed to libusb
+static int fnusb_open_backend(freenect_device *dev, int index)
+{
+	freenect_context *ctx = dev->parent;
+	fnusb_device_info info;
+
+	if (!(ctx->enabled_subdevices & FREENECT_DEVICE_CAMERA))
+		return -1;
+	if (ctx->usb.backend->describe(ctx->usb.backend_state, index, &info) < 0) {
+		FN_ERROR("Could not open camera %d: no such device\n", index);
+		return -1;
+	}
+	dev->usb_cam.dev = (libusb_device_handle*)&dev->usb_cam;
+	dev->hwrev = info.hwrev;
+	memcpy(dev->camera_serial, info.serial, sizeof(dev->camera_serial));
+	dev->camera_serial[sizeof(dev->camera_serial) - 1] = 0;
+	// there is no motor to drive, cameras are all there is
+	return 0;
+}
+
 int fnusb_open_subdevices(freenect_device *dev, int index)
 {
 	freenect_context *ctx = dev->parent;
@@ -166,6 +267,11 @@ int fnusb_open_subdevices(freenect_device *dev, int index)
 	dev->usb_cam.dev = NULL;
 	dev->usb_motor.parent = dev;
 	dev->usb_motor.dev = NULL;
+	dev->usb_cam.index = index;
+	dev->usb_motor.index = index;
+
+	if (ctx->usb.backend)
+		return fnusb_open_backend(dev, index);
 
 	libusb_device **devs; //pointer to pointer of device, used to retrieve a list of devices
 	ssize_t cnt = libusb_get_device_list(dev->parent->usb.ctx, &devs); //get the list of devices
@@ -227,6 +333,18 @@ int fnusb_open_subdevices(freenect_device *dev, int index)
 					dev->usb_cam.dev = NULL;
 					break;
 				}
+				// the serial number keys the calibration cache
+				if (desc.iSerialNumber == 0 || libusb_get_string_descriptor_ascii(dev->usb_cam.dev, desc.iSerialNumber, (unsigned char*)dev->camera_serial, sizeof(dev->camera_serial)) < 0)
+					dev->camera_serial[0] = 0;
+				if (ctx->usb.recorder)
+				{
+					fnusb_device_info info;
+					memset(&info, 0, sizeof(info));
+					info.bus = libusb_get_bus_number(devs[i]);
+					info.hwrev = dev->hwrev;
+					memcpy(info.serial, dev->camera_serial, sizeof(info.serial));
+					fnusb_record_device(ctx->usb.recorder, index, &info);
+				}
 				// Open for the motor
 				// the device immediately before camera is the motor on Xbox 360
 				if ((ctx->enabled_subdevices & FREENECT_DEVICE_MOTOR) && !dev->usb_motor.dev && nr_ms_dev == nr_mot + 1)
@@ -277,6 +395,11 @@ int fnusb_open_subdevices(freenect_device *dev, int index)
 
 int fnusb_close_subdevices(freenect_device *dev)
 {
+	if (dev->parent->usb.backend)
+	{
+		dev->usb_cam.dev = NULL;
+		return 0;
+	}
 	if (dev->usb_cam.dev)
 	{
 		libusb_release_interface(dev->usb_cam.dev, 0);
@@ -293,6 +416,132 @@ int fnusb_close_subdevices(freenect_device *dev)
 	return 0;
 }
 
+static void iso_callback(struct libusb_transfer *xfer);
+
+// One region backs every transfer slot of a stream, each slot page aligned.  Prefer
+// memory usbfs maps for us so packets are DMA'd straight into it instead of being
+// copied by the kernel, then huge pages if asked for, then plain pages.
+static int fnusb_alloc_buffer(fnusb_isoc_stream *strm, int hugepages, int copy)
+{
+	freenect_context *ctx = strm->parent->parent->parent;
+	size_t page = sysconf(_SC_PAGESIZE);
+	strm->xfer_size = (strm->pkts * strm->len + page - 1) / page * page;
+	strm->buffer_size = strm->xfer_size * strm->max_xfers;
+#ifdef FNUSB_HAVE_DEV_MEM
+	if (!copy) {
+		strm->buffer = libusb_dev_mem_alloc(strm->parent->dev, strm->buffer_size);
+		if (strm->buffer) {
+			strm->buffer_kind = FNUSB_BUFFER_DEV_MEM;
+			return 0;
+		}
+		FN_INFO("Zero-copy transfer buffers unavailable, falling back to user memory\n");
+	}
+#endif
+	if (hugepages) {
+		size_t size = (strm->buffer_size + FNUSB_HUGEPAGE_SIZE - 1) / FNUSB_HUGEPAGE_SIZE * FNUSB_HUGEPAGE_SIZE;
+		void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buffer != MAP_FAILED) {
+			strm->buffer = (uint8_t*)buffer;
+			strm->buffer_size = size;
+			strm->buffer_kind = FNUSB_BUFFER_HUGEPAGES;
+			return 0;
+		}
+		FN_INFO("No huge pages reserved for transfer buffers, falling back to regular pages\n");
+	}
+	void *buffer = mmap(NULL, strm->buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED)
+		return -1;
+#ifdef MADV_HUGEPAGE
+	if (hugepages)
+		madvise(buffer, strm->buffer_size, MADV_HUGEPAGE);
+#endif
+	strm->buffer = (uint8_t*)buffer;
+	strm->buffer_kind = FNUSB_BUFFER_PAGES;
+	return 0;
+}
+
+static void fnusb_free_buffer(fnusb_isoc_stream *strm)
+{
+	if (!strm->buffer)
+		return;
+#ifdef FNUSB_HAVE_DEV_MEM
+	if (strm->buffer_kind == FNUSB_BUFFER_DEV_MEM) {
+		libusb_dev_mem_free(strm->parent->dev, strm->buffer, strm->buffer_size);
+		strm->buffer = NULL;
+		return;
+	}
+#endif
+	munmap(strm->buffer, strm->buffer_size);
+	strm->buffer = NULL;
+}
+
+static void fnusb_free_xfer(fnusb_isoc_stream *strm, struct libusb_transfer *xfer)
+{
+	int i;
+	for (i=0; i<strm->max_xfers; i++)
+		if (strm->xfers[i] == xfer) {
+			strm->xfers[i] = NULL;
+			break;
+		}
+	// hand the pages of a retired slot back, they are faulted in again if it is reused
+	if (strm->buffer_kind == FNUSB_BUFFER_PAGES)
+		madvise(xfer->buffer, strm->xfer_size, MADV_DONTNEED);
+	libusb_free_transfer(xfer);
+	strm->num_xfers--;
+}
+
+// allocate and submit transfers into free slots until target_xfers are in flight
+static void fnusb_grow_iso(fnusb_isoc_stream *strm)
+{
+	freenect_context *ctx = strm->parent->parent->parent;
+	int i, ret;
+
+	for (i=0; i<strm->max_xfers && strm->num_xfers - strm->dead_xfers < strm->target_xfers; i++) {
+		if (strm->xfers[i])
+			continue;
+		FN_SPEW("Creating EP %02x transfer #%d\n", strm->ep, i);
+		strm->xfers[i] = libusb_alloc_transfer(strm->pkts);
+		uint8_t *bufp = strm->buffer + i * strm->xfer_size;
+
+		libusb_fill_iso_transfer(strm->xfers[i], strm->parent->dev, strm->ep, bufp, strm->pkts * strm->len, strm->pkts, iso_callback, strm, 0);
+
+		libusb_set_iso_packet_lengths(strm->xfers[i], strm->len);
+
+		strm->num_xfers++;
+		ret = libusb_submit_transfer(strm->xfers[i]);
+		if (ret < 0) {
+			FN_WARNING("Failed to submit isochronous transfer %d: %d\n", i, ret);
+			// never submitted, so no callback will come for it: release the slot right away
+			libusb_free_transfer(strm->xfers[i]);
+			strm->xfers[i] = NULL;
+			strm->num_xfers--;
+			break;
+		}
+	}
+}
+
+void fnusb_deliver(fnusb_isoc_stream *strm, uint8_t *buf, const int *lens, int n)
+{
+	struct timespec start, end;
+	TRACE_BEGIN("iso_callback", strm->ep);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	strm->cb(strm->parent->parent, buf, strm->len, lens, n);
+	TRACE_END("iso_callback", strm->ep);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	strm->cpu_nsec += (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+}
+
+fnusb_isoc_stream *fnusb_find_stream(fnusb_ctx *ctx, int index, int ep)
+{
+	int i;
+	for (i=0; i<FNUSB_MAX_STREAMS; i++) {
+		fnusb_isoc_stream *strm = ctx->streams[i];
+		if (strm && !strm->dead && strm->ep == ep && strm->parent->index == index)
+			return strm;
+	}
+	return NULL;
+}
+
 static void iso_callback(struct libusb_transfer *xfer)
 {
 	int i;
@@ -308,10 +557,16 @@ static void iso_callback(struct libusb_transfer *xfer)
 	switch(xfer->status) {
 		case LIBUSB_TRANSFER_COMPLETED: // Normal operation.
 		{
-			uint8_t *buf = (uint8_t*)xfer->buffer;
-			for (i=0; i<strm->pkts; i++) {
-				strm->cb(strm->parent->parent, buf, xfer->iso_packet_desc[i].actual_length);
-				buf += strm->len;
+			if (ctx->usb.recorder)
+				fnusb_record_iso(ctx->usb.recorder, strm, xfer);
+			int lens[strm->pkts];
+			for (i=0; i<strm->pkts; i++)
+				lens[i] = xfer->iso_packet_desc[i].actual_length;
+			fnusb_deliver(strm, (uint8_t*)xfer->buffer, lens, strm->pkts);
+			// the stream wants fewer transfers in flight, retire this one rather than resubmitting it
+			if (strm->num_xfers - strm->dead_xfers > strm->target_xfers) {
+				fnusb_free_xfer(strm, xfer);
+				break;
 			}
 			int res;
 			res = libusb_submit_transfer(xfer);
@@ -321,7 +576,10 @@ static void iso_callback(struct libusb_transfer *xfer)
 				if (res == LIBUSB_ERROR_NO_DEVICE) {
 					strm->parent->device_dead = 1;
 				}
+				break;
 			}
+			// or more, top them up
+			fnusb_grow_iso(strm);
 			break;
 		}
 		case LIBUSB_TRANSFER_NO_DEVICE:
@@ -375,42 +633,59 @@ static void iso_callback(struct libusb_transfer *xfer)
 	}
 }
 
-int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int pkts, int len)
+int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int max_xfers, int pkts, int len, int hugepages, int copy)
 {
-	freenect_context *ctx = dev->parent->parent;
-	int ret, i;
-
+	fnusb_ctx *usb = &dev->parent->parent->usb;
+	int i;
 	strm->parent = dev;
 	strm->cb = cb;
-	strm->num_xfers = xfers;
+	strm->ep = ep;
+	strm->num_xfers = 0;
+	strm->max_xfers = max_xfers > xfers ? max_xfers : xfers;
+	strm->target_xfers = xfers;
 	strm->pkts = pkts;
 	strm->len = len;
-	strm->buffer = (uint8_t*)malloc(xfers * pkts * len);
-	strm->xfers = (struct libusb_transfer**)malloc(sizeof(struct libusb_transfer*) * xfers);
+	strm->xfers = (struct libusb_transfer**)calloc(strm->max_xfers, sizeof(struct libusb_transfer*));
 	strm->dead = 0;
 	strm->dead_xfers = 0;
+	strm->cpu_nsec = 0;
 
-	uint8_t *bufp = strm->buffer;
-
-	for (i=0; i<xfers; i++) {
-		FN_SPEW("Creating EP %02x transfer #%d\n", ep, i);
-		strm->xfers[i] = libusb_alloc_transfer(pkts);
+	// a backend fills the first slot itself, there is no device memory to map
+	if (fnusb_alloc_buffer(strm, hugepages, copy || usb->backend) < 0) {
+		free(strm->xfers);
+		strm->xfers = NULL;
+		return -1;
+	}
 
-		libusb_fill_iso_transfer(strm->xfers[i], dev->dev, ep, bufp, pkts * len, pkts, iso_callback, strm, 0);
+	if (usb->backend) {
+		for (i=0; i<FNUSB_MAX_STREAMS; i++)
+			if (__sync_bool_compare_and_swap(&usb->streams[i], NULL, strm))
+				return 0;
+		fnusb_free_buffer(strm);
+		free(strm->xfers);
+		strm->xfers = NULL;
+		return -1;
+	}
 
-		libusb_set_iso_packet_lengths(strm->xfers[i], len);
+	fnusb_grow_iso(strm);
 
-		ret = libusb_submit_transfer(strm->xfers[i]);
-		if (ret < 0) {
-			FN_WARNING("Failed to submit isochronous transfer %d: %d\n", i, ret);
-			strm->dead_xfers++;
-		}
+	return 0;
 
-		bufp += pkts*len;
-	}
+}
 
-	return 0;
+void fnusb_set_iso_depth(fnusb_isoc_stream *strm, int xfers)
+{
+	if (xfers < 1)
+		xfers = 1;
+	if (xfers > strm->max_xfers)
+		xfers = strm->max_xfers;
+	// takes effect as transfers complete, so nothing is cancelled mid-flight
+	strm->target_xfers = xfers;
+}
 
+int fnusb_iso_depth(fnusb_isoc_stream *strm)
+{
+	return strm->num_xfers - strm->dead_xfers;
 }
 
 int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
@@ -422,8 +697,12 @@ int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
 
 	strm->dead = 1;
 
-	for (i=0; i<strm->num_xfers; i++)
-		libusb_cancel_transfer(strm->xfers[i]);
+	for (i=0; i<FNUSB_MAX_STREAMS; i++)
+		__sync_bool_compare_and_swap(&ctx->usb.streams[i], strm, NULL);
+
+	for (i=0; i<strm->max_xfers; i++)
+		if (strm->xfers[i])
+			libusb_cancel_transfer(strm->xfers[i]);
 	FN_FLOOD("fnusb_stop_iso() cancelled all transfers\n");
 
 	while (strm->dead_xfers < strm->num_xfers) {
@@ -431,11 +710,12 @@ int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
 		libusb_handle_events(ctx->usb.ctx);
 	}
 
-	for (i=0; i<strm->num_xfers; i++)
-		libusb_free_transfer(strm->xfers[i]);
+	for (i=0; i<strm->max_xfers; i++)
+		if (strm->xfers[i])
+			libusb_free_transfer(strm->xfers[i]);
 	FN_FLOOD("fnusb_stop_iso() freed all transfers\n");
 
-	free(strm->buffer);
+	fnusb_free_buffer(strm);
 	free(strm->xfers);
 
 	FN_FLOOD("fnusb_stop_iso() freed buffers and stream\n");
@@ -446,5 +726,15 @@ int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm)
 
 int fnusb_control(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength)
 {
-	return libusb_control_transfer(dev->dev, bmRequestType, bRequest, wValue, wIndex, data, wLength, 0);
+	fnusb_ctx *usb = &dev->parent->parent->usb;
+	if (usb->backend) {
+		if (!dev->dev)
+			return LIBUSB_ERROR_NO_DEVICE;
+		return usb->backend->control(usb->backend_state, dev, bmRequestType, bRequest, wValue, wIndex, data, wLength);
+	}
+	int res = libusb_control_transfer(dev->dev, bmRequestType, bRequest, wValue, wIndex, data, wLength, 0);
+	// only the camera is replayed, the motor would interleave its own replies
+	if (usb->recorder && dev == &dev->parent->usb_cam)
+		fnusb_record_control(usb->recorder, dev, bmRequestType, bRequest, wValue, wIndex, data, wLength, res);
+	return res;
 }
@@ -34,24 +34,64 @@
 #define NUM_XFERS 16
 #define DEPTH_PKTBUF 1920
 #define VIDEO_PKTBUF 1920
+#define FNUSB_MAX_STREAMS 64
+
+struct fnusb_isoc_stream;
+typedef struct fnusb_backend fnusb_backend;
+typedef struct fnusb_recorder fnusb_recorder;
 
 typedef struct {
-	libusb_context *ctx;
+	libusb_context *ctx; // NULL when a backend stands in for libusb
 	int should_free_ctx;
+	const fnusb_backend *backend; // feeds devices from somewhere other than USB, if set
+	void *backend_state;
+	struct fnusb_isoc_stream *streams[FNUSB_MAX_STREAMS]; // running streams, kept for the backend to look up
+	fnusb_recorder *recorder; // appends the traffic of opened cameras to a file, if set
 } fnusb_ctx;
 
 typedef struct {
 	freenect_device *parent; //so we can go up from the libusb userdata
 	libusb_device_handle *dev;
 	int device_dead; // set to 1 when the underlying libusb_device_handle vanishes (ie, Kinect was unplugged)
+	int index; // as passed to fnusb_open_subdevices, identifies the device in recordings
 } fnusb_dev;
 
+// what a backend reports about one of its cameras
 typedef struct {
+	int32_t bus;
+	int32_t hwrev;
+	char serial[128];
+} fnusb_device_info;
+
+// Stands in for libusb.  Streams are started and stopped as usual, the backend hands
+// packets to them from process_events by calling fnusb_deliver.
+struct fnusb_backend {
+	int (*num_devices)(void *state);
+	int (*describe)(void *state, int index, fnusb_device_info *info); // < 0 if there is no such device
+	int (*control)(void *state, fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength);
+	int (*process_events)(void *state, fnusb_ctx *ctx, struct timeval *timeout); // timeout is NULL to block
+	void (*destroy)(void *state);
+};
+
+typedef enum {
+	FNUSB_BUFFER_PAGES, // regular anonymous pages, the kernel copies packets into them
+	FNUSB_BUFFER_HUGEPAGES,
+	FNUSB_BUFFER_DEV_MEM, // mapped by usbfs, packets land in them without a copy
+} fnusb_buffer_kind;
+
+typedef struct fnusb_isoc_stream {
 	fnusb_dev *parent; //so we can go up from the libusb userdata
-	struct libusb_transfer **xfers;
-	uint8_t *buffer;
+	struct libusb_transfer **xfers; // max_xfers slots, NULL where no transfer is allocated
+	uint8_t *buffer; // backs every slot, slot i starts at i * xfer_size
+	size_t buffer_size;
+	size_t xfer_size;
+	fnusb_buffer_kind buffer_kind;
+	int64_t cpu_nsec; // event thread cpu time spent handling this stream's packets
 	fnusb_iso_cb cb;
-	int num_xfers;
+	int ep;
+	int num_xfers; // allocated transfers, in flight or dead
+	int max_xfers;
+	int target_xfers; // transfers the stream wants in flight, adjusted as transfers complete
 	int pkts;
 	int len;
 	int dead;
@@ -60,6 +100,7 @@ typedef struct {
 
 int fnusb_num_devices(fnusb_ctx *ctx);
 int fnusb_list_device_attributes(fnusb_ctx *ctx, struct freenect_device_attributes** attribute_list);
+int fnusb_get_device_bus(fnusb_ctx *ctx, int index);
 
 int fnusb_init(fnusb_ctx *ctx, freenect_usb_context *usb_ctx);
 int fnusb_shutdown(fnusb_ctx *ctx);
@@ -69,9 +110,27 @@ int fnusb_process_events_timeout(fnusb_ctx *ctx, struct timeval* timeout);
 int fnusb_open_subdevices(freenect_device *dev, int index);
 int fnusb_close_subdevices(freenect_device *dev);
 
-int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int pkts, int len);
+int fnusb_start_iso(fnusb_dev *dev, fnusb_isoc_stream *strm, fnusb_iso_cb cb, int ep, int xfers, int max_xfers, int pkts, int len, int hugepages, int copy);
 int fnusb_stop_iso(fnusb_dev *dev, fnusb_isoc_stream *strm);
+void fnusb_set_iso_depth(fnusb_isoc_stream *strm, int xfers);
+int fnusb_iso_depth(fnusb_isoc_stream *strm);
 
 int fnusb_control(fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength);
 
+// for backends: the running stream of a device's endpoint in this context, NULL if none
+fnusb_isoc_stream *fnusb_find_stream(fnusb_ctx *ctx, int index, int ep);
+// for backends: hands n packets to the stream, packet i starts at buf + i * strm->len
+void fnusb_deliver(fnusb_isoc_stream *strm, uint8_t *buf, const int *lens, int n);
+
+// usb_replay.c
+int fnusb_init_replay(fnusb_ctx *ctx, const char *path, freenect_replay_speed speed);
+int fnusb_record(fnusb_ctx *ctx, const char *path);
+void fnusb_record_close(fnusb_recorder *rec);
+void fnusb_record_device(fnusb_recorder *rec, int index, const fnusb_device_info *info);
+void fnusb_record_control(fnusb_recorder *rec, fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data, uint16_t wLength, int res);
+void fnusb_record_iso(fnusb_recorder *rec, fnusb_isoc_stream *strm, struct libusb_transfer *xfer);
+
+// usb_virtual.c
+int fnusb_init_virtual(fnusb_ctx *ctx, int count, const freenect_virtual_pose *poses, freenect_replay_speed speed);
+
 #endif
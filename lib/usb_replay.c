@@ -0,0 +1,393 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+// Recording of the USB traffic of opened cameras, and a backend replaying it.
+//
+// A recording is a file header followed by records, each a fnusb_record_header header and
+// its payload.  Records are written with a single writev to a file opened with
+// O_APPEND, so contexts recording at the same time interleave whole records.
+// Fields are in host byte order, recordings are replayed on the machine type
+// they were made on.
+//
+//   DEVICE   a camera was opened, fnusb_device_info
+//   CONTROL  a control transfer: fnusb_record_setup, then the data read if it was IN
+//   ISO      a completed isochronous transfer: packet count, one fnusb_record_packet
+//            per packet, then the data of all packets back to back
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "freenect_internal.h"
+
+#define FNUSB_RECORD_MAGIC "FNUSBREC"
+#define FNUSB_RECORD_VERSION 1
+#define FNUSB_REPLAY_DEVICES 256
+
+enum {
+	FNUSB_RECORD_DEVICE = 1,
+	FNUSB_RECORD_CONTROL,
+	FNUSB_RECORD_ISO,
+};
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} fnusb_record_file;
+
+typedef struct {
+	uint8_t type;
+	uint8_t index; // device, as passed to freenect_open_device
+	uint8_t ep; // endpoint of ISO, bmRequestType of CONTROL
+	uint8_t request; // bRequest of CONTROL
+	int32_t size; // bytes of payload following the header
+	uint64_t time; // CLOCK_MONOTONIC nanoseconds
+} fnusb_record_header;
+
+typedef struct {
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+	uint16_t reserved;
+	int32_t result;
+} fnusb_record_setup;
+
+typedef struct {
+	int32_t length;
+	int32_t status;
+} fnusb_record_packet;
+
+struct fnusb_recorder {
+	int fd;
+};
+
+static uint64_t fnusb_record_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int fnusb_record(fnusb_ctx *ctx, const char *path)
+{
+	// whoever creates the file writes the header, everyone else only appends records
+	int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd >= 0) {
+		fnusb_record_file header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, FNUSB_RECORD_MAGIC, sizeof(header.magic));
+		header.version = FNUSB_RECORD_VERSION;
+		int res = write(fd, &header, sizeof(header));
+		close(fd);
+		if (res != sizeof(header))
+			return -1;
+	} else if (errno != EEXIST) {
+		return -1;
+	}
+	fd = open(path, O_WRONLY | O_APPEND);
+	if (fd < 0)
+		return -1;
+	fnusb_recorder *rec = (fnusb_recorder*)malloc(sizeof(fnusb_recorder));
+	rec->fd = fd;
+	if (ctx->recorder)
+		fnusb_record_close(ctx->recorder);
+	ctx->recorder = rec;
+	return 0;
+}
+
+void fnusb_record_close(fnusb_recorder *rec)
+{
+	close(rec->fd);
+	free(rec);
+}
+
+static void fnusb_record_write(fnusb_recorder *rec, fnusb_record_header *header, struct iovec *iov, int iovcnt)
+{
+	int i;
+	header->size = 0;
+	for (i = 1; i < iovcnt; i++)
+		header->size += iov[i].iov_len;
+	iov[0].iov_base = header;
+	iov[0].iov_len = sizeof(*header);
+	// a short write leaves a torn record at the end, replay stops there
+	if (writev(rec->fd, iov, iovcnt) < 0)
+		return;
+}
+
+void fnusb_record_device(fnusb_recorder *rec, int index, const fnusb_device_info *info)
+{
+	fnusb_record_header header = { FNUSB_RECORD_DEVICE, (uint8_t)index, 0, 0, 0, fnusb_record_time() };
+	struct iovec iov[2];
+	iov[1].iov_base = (void*)info;
+	iov[1].iov_len = sizeof(*info);
+	fnusb_record_write(rec, &header, iov, 2);
+}
+
+void fnusb_record_control(fnusb_recorder *rec, fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, const uint8_t *data, uint16_t wLength, int res)
+{
+	int in = bmRequestType & LIBUSB_ENDPOINT_IN;
+	// an IN transfer that came back empty is a poll for a reply that wasn't ready, replay
+	// hands out the reply right away instead
+	if (in && res == 0)
+		return;
+	fnusb_record_header header = { FNUSB_RECORD_CONTROL, (uint8_t)dev->index, bmRequestType, bRequest, 0, fnusb_record_time() };
+	fnusb_record_setup setup = { wValue, wIndex, wLength, 0, res };
+	struct iovec iov[3];
+	iov[1].iov_base = &setup;
+	iov[1].iov_len = sizeof(setup);
+	iov[2].iov_base = (void*)data;
+	iov[2].iov_len = in && res > 0 ? res : 0;
+	fnusb_record_write(rec, &header, iov, 3);
+}
+
+void fnusb_record_iso(fnusb_recorder *rec, fnusb_isoc_stream *strm, struct libusb_transfer *xfer)
+{
+	int i, n = xfer->num_iso_packets;
+	fnusb_record_header header = { FNUSB_RECORD_ISO, (uint8_t)strm->parent->index, (uint8_t)strm->ep, 0, 0, fnusb_record_time() };
+	int32_t count = n;
+	fnusb_record_packet packets[n];
+	struct iovec iov[3 + n];
+	iov[1].iov_base = &count;
+	iov[1].iov_len = sizeof(count);
+	iov[2].iov_base = packets;
+	iov[2].iov_len = sizeof(fnusb_record_packet) * n;
+	for (i = 0; i < n; i++) {
+		packets[i].length = xfer->iso_packet_desc[i].actual_length;
+		packets[i].status = xfer->iso_packet_desc[i].status;
+		iov[3 + i].iov_base = xfer->buffer + i * strm->len;
+		iov[3 + i].iov_len = packets[i].length;
+	}
+	fnusb_record_write(rec, &header, iov, 3 + n);
+}
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+	size_t cursor; // next record process_events looks at
+	freenect_replay_speed speed;
+	uint64_t first; // time of the first record
+	int num_devices;
+	int present[FNUSB_REPLAY_DEVICES];
+	fnusb_device_info devices[FNUSB_REPLAY_DEVICES];
+	size_t controls[FNUSB_REPLAY_DEVICES]; // where to look for each device's next control reply
+} fnusb_replay;
+
+// when the first packet was replayed, shared by all contexts, so recordings replayed by
+// several of them stay in step, starts over once no replay is left
+static uint64_t fnusb_replay_start = 0;
+static int fnusb_replays = 0;
+
+// the record at offset, 0 if there is no complete one
+static int fnusb_replay_record(fnusb_replay *replay, size_t offset, fnusb_record_header *record)
+{
+	if (offset + sizeof(fnusb_record_header) > replay->size)
+		return 0;
+	memcpy(record, replay->data + offset, sizeof(fnusb_record_header));
+	if (record->size < 0 || offset + sizeof(fnusb_record_header) + record->size > replay->size)
+		return 0;
+	return 1;
+}
+
+static int replay_num_devices(void *state)
+{
+	return ((fnusb_replay*)state)->num_devices;
+}
+
+static int replay_describe(void *state, int index, fnusb_device_info *info)
+{
+	fnusb_replay *replay = (fnusb_replay*)state;
+	if (index < 0 || index >= FNUSB_REPLAY_DEVICES || !replay->present[index])
+		return -1;
+	*info = replay->devices[index];
+	return 0;
+}
+
+static int replay_control(void *state, fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength)
+{
+	fnusb_replay *replay = (fnusb_replay*)state;
+	freenect_context *ctx = dev->parent->parent;
+	fnusb_record_header record;
+	size_t offset = replay->controls[dev->index];
+	while (fnusb_replay_record(replay, offset, &record)) {
+		uint8_t *payload = replay->data + offset + sizeof(fnusb_record_header);
+		offset += sizeof(fnusb_record_header) + record.size;
+		if (record.type != FNUSB_RECORD_CONTROL || record.index != dev->index)
+			continue;
+		replay->controls[dev->index] = offset;
+		if (record.ep != bmRequestType || record.request != bRequest) {
+			FN_WARNING("Replayed control transfer %02x/%02x doesn't match the recorded %02x/%02x\n", bmRequestType, bRequest, record.ep, record.request);
+			return LIBUSB_ERROR_IO;
+		}
+		fnusb_record_setup setup;
+		memcpy(&setup, payload, sizeof(setup));
+		int len = record.size - (int)sizeof(setup);
+		if (len > wLength)
+			len = wLength;
+		if (len > 0)
+			memcpy(data, payload + sizeof(setup), len);
+		return setup.result;
+	}
+	replay->controls[dev->index] = offset;
+	FN_WARNING("No more recorded control transfers for device %d\n", dev->index);
+	return LIBUSB_ERROR_IO;
+}
+
+static void replay_sleep(uint64_t nsec)
+{
+	struct timespec ts;
+	ts.tv_sec = nsec / 1000000000ULL;
+	ts.tv_nsec = nsec % 1000000000ULL;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// hands out the next transfer for a stream running in this context, returns < 0 at the end of the recording
+static int replay_process_events(void *state, fnusb_ctx *usb, struct timeval *timeout)
+{
+	fnusb_replay *replay = (fnusb_replay*)state;
+	fnusb_record_header record;
+	uint64_t now = fnusb_record_time();
+	uint64_t deadline = timeout ? now + timeout->tv_sec * 1000000000ULL + timeout->tv_usec * 1000ULL : 0;
+	while (fnusb_replay_record(replay, replay->cursor, &record)) {
+		uint8_t *payload = replay->data + replay->cursor + sizeof(fnusb_record_header);
+		fnusb_isoc_stream *strm = record.type == FNUSB_RECORD_ISO ? fnusb_find_stream(usb, record.index, record.ep) : NULL;
+		if (!strm) {
+			replay->cursor += sizeof(fnusb_record_header) + record.size;
+			continue;
+		}
+		if (replay->speed == FREENECT_REPLAY_REALTIME) {
+			__sync_bool_compare_and_swap(&fnusb_replay_start, 0, now);
+			uint64_t due = fnusb_replay_start + (record.time - replay->first);
+			now = fnusb_record_time();
+			if (timeout && due > deadline) {
+				if (deadline > now)
+					replay_sleep(deadline - now);
+				return 0;
+			}
+			if (due > now)
+				replay_sleep(due - now);
+		}
+		replay->cursor += sizeof(fnusb_record_header) + record.size;
+		int32_t count;
+		memcpy(&count, payload, sizeof(count));
+		fnusb_record_packet *packets = (fnusb_record_packet*)(payload + sizeof(count));
+		uint8_t *data = (uint8_t*)(packets + count);
+		// lay the packets out the way libusb would, one per stride, as many as the stream takes at once
+		int i = 0;
+		while (i < count) {
+			int n = count - i < strm->pkts ? count - i : strm->pkts;
+			int lens[n], j;
+			for (j = 0; j < n; j++, i++) {
+				fnusb_record_packet packet;
+				memcpy(&packet, packets + i, sizeof(packet));
+				if (packet.length < 0)
+					packet.length = 0;
+				lens[j] = packet.length < strm->len ? packet.length : strm->len;
+				memcpy(strm->buffer + j * strm->len, data, lens[j]);
+				data += packet.length;
+			}
+			fnusb_deliver(strm, strm->buffer, lens, n);
+		}
+		return 0;
+	}
+	return LIBUSB_ERROR_IO;
+}
+
+static void replay_destroy(void *state)
+{
+	fnusb_replay *replay = (fnusb_replay*)state;
+	munmap(replay->data, replay->size);
+	free(replay);
+	if (__sync_sub_and_fetch(&fnusb_replays, 1) == 0)
+		__sync_lock_test_and_set(&fnusb_replay_start, 0);
+}
+
+static const fnusb_backend replay_backend = {
+	replay_num_devices,
+	replay_describe,
+	replay_control,
+	replay_process_events,
+	replay_destroy,
+};
+
+int fnusb_init_replay(fnusb_ctx *ctx, const char *path, freenect_replay_speed speed)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(fnusb_record_file)) {
+		close(fd);
+		return -1;
+	}
+	void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+	fnusb_record_file header;
+	memcpy(&header, data, sizeof(header));
+	if (memcmp(header.magic, FNUSB_RECORD_MAGIC, sizeof(header.magic)) != 0 || header.version != FNUSB_RECORD_VERSION) {
+		munmap(data, st.st_size);
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	fnusb_replay *replay = (fnusb_replay*)malloc(sizeof(fnusb_replay));
+	memset(replay, 0, sizeof(*replay));
+	replay->data = (uint8_t*)data;
+	replay->size = st.st_size;
+	replay->cursor = sizeof(fnusb_record_file);
+	replay->speed = speed;
+	int i;
+	for (i = 0; i < FNUSB_REPLAY_DEVICES; i++)
+		replay->controls[i] = replay->cursor;
+	// the cameras opened while recording are the ones there are
+	fnusb_record_header record;
+	size_t offset = replay->cursor;
+	while (fnusb_replay_record(replay, offset, &record)) {
+		if (offset == replay->cursor)
+			replay->first = record.time;
+		if (record.type == FNUSB_RECORD_DEVICE && record.size >= (int32_t)sizeof(fnusb_device_info) && !replay->present[record.index]) {
+			memcpy(&replay->devices[record.index], replay->data + offset + sizeof(fnusb_record_header), sizeof(fnusb_device_info));
+			replay->present[record.index] = 1;
+			replay->num_devices++;
+		}
+		offset += sizeof(fnusb_record_header) + record.size;
+	}
+
+	__sync_add_and_fetch(&fnusb_replays, 1);
+	ctx->ctx = NULL;
+	ctx->should_free_ctx = 0;
+	ctx->backend = &replay_backend;
+	ctx->backend_state = replay;
+	return 0;
+}
@@ -0,0 +1,613 @@
+/*
+ * This file is part of the OpenKinect Project. http://www.openkinect.org
+ *
+ * Copyright (c) 2010 individual OpenKinect contributors. See the CONTRIB file
+ * for details.
+ *
+ * This code is licensed to you under the terms of the Apache License, version
+ * 2.0, or, at your option, the terms of the GNU General Public License,
+ * version 2.0. See the APACHE20 and GPL2 files for the text of the licenses,
+ * or the following URLs:
+ * http://www.apache.org/licenses/LICENSE-2.0
+ * http://www.gnu.org/licenses/gpl-2.0.txt
+ *
+ * If you redistribute this file in source form, modified or unmodified, you
+ * may:
+ *   1) Leave this header intact and distribute it under the same terms,
+ *      accompanying it with the APACHE20 and GPL20 files, or
+ *   2) Delete the Apache 2.0 clause and accompany it with the GPL2 file, or
+ *   3) Delete the GPL v2 clause and accompany it with the APACHE20 file
+ * In all cases you must keep the copyright notice intact and include a copy
+ * of the CONTRIB file.
+ *
+ * Binary distributions must follow the binary distribution requirements of
+ * either License.
+ */
+
+// A backend of virtual cameras looking at an analytic scene: a room with a few
+// boxes in it and spheres circling through it.  Each camera answers the control
+// protocol with the calibration of a typical Xbox 360 Kinect and, once its depth
+// stream is started, sends 11 bit packed depth packets paced like the real thing,
+// one packet slot per 125us microframe, 30 frames a second.  Frame n only depends
+// on n and the camera's pose, so runs are repeatable.
+//
+// The room and boxes are ray cast once per camera, only the rows the spheres cover
+// are redone every frame.  Only the depth stream is simulated.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include "freenect_internal.h"
+
+#define VIRTUAL_WIDTH 640
+#define VIRTUAL_HEIGHT 480
+#define VIRTUAL_ROW_BYTES (VIRTUAL_WIDTH * 11 / 8)
+#define VIRTUAL_FRAME_BYTES (VIRTUAL_ROW_BYTES * VIRTUAL_HEIGHT)
+#define VIRTUAL_FRAME_PKTS ((VIRTUAL_FRAME_BYTES + DEPTH_PKTDSIZE - 1) / DEPTH_PKTDSIZE)
+#define VIRTUAL_SLOT_RATE 8000 // isochronous microframes per second
+#define VIRTUAL_FRAME_RATE 30
+#define VIRTUAL_TICK_RATE 60000000.0 // device timestamp ticks per second
+#define VIRTUAL_MAX_MM 8000 // further than this reads as no depth, like a real device
+#define VIRTUAL_MIN_MM 400
+
+// calibration of a typical device, see freenect_fetch_zero_plane_info and freenect_raw_to_mm
+#define VIRTUAL_EMITTER_DIST 7.5f
+#define VIRTUAL_RCMOS_DIST 2.3f
+#define VIRTUAL_REFERENCE_DIST 120.0f
+#define VIRTUAL_PIXEL_SIZE 0.1042f
+#define VIRTUAL_CONST_SHIFT 200
+
+typedef struct {
+	float min[3], max[3];
+} virtual_box;
+
+typedef struct {
+	float radius;
+	float orbit; // radius of the circle the center travels on the floor plan
+	float speed; // radians per second
+	float phase;
+	float height, bob; // center height and how far it moves up and down
+} virtual_sphere;
+
+// millimeters, y points down like image rows, the cameras sit around the origin
+static const float room_min[3] = { -3500, -1600, -3500 };
+static const float room_max[3] = { 3500, 1000, 3500 };
+static const virtual_box boxes[] = {
+	{ { 1200, 400, -300 }, { 1800, 1000, 300 } }, // a crate
+	{ { -2000, 250, 1500 }, { -1200, 1000, 2200 } }, // a table
+	{ { -400, -1600, -3000 }, { 400, 1000, -2600 } }, // a pillar
+};
+static const virtual_sphere spheres[] = {
+	{ 250, 2000, 0.9f, 0.0f, 200, 300 },
+	{ 400, 2600, -0.5f, 2.0f, 0, 200 },
+	{ 300, 1500, 1.3f, 4.0f, 400, 150 },
+};
+
+#define VIRTUAL_SPHERES (sizeof(spheres) / sizeof(spheres[0]))
+#define VIRTUAL_BOXES (sizeof(boxes) / sizeof(boxes[0]))
+
+typedef struct {
+	freenect_virtual_pose pose;
+	float rotation[9]; // camera to world, row major
+	uint16_t *background; // mm of the room and boxes, 0 where there is no reading
+	uint8_t *background_packed;
+	uint8_t *packed; // the frame being sent
+	int dirty_first, dirty_last; // rows of packed that differ from background_packed
+	volatile int streaming;
+	double start; // host time of slot 0
+	uint64_t slot; // next microframe slot to send
+	uint8_t seq;
+	uint32_t clock_offset;
+	uint8_t reply[0x200]; // reply to the last command, handed out by the next IN transfer
+	int reply_len;
+} virtual_device;
+
+typedef struct {
+	int count;
+	freenect_replay_speed speed;
+	uint16_t raw[VIRTUAL_MAX_MM + 1]; // mm to raw disparity, the inverse of freenect_raw_to_mm
+	virtual_device devices[];
+} virtual_state;
+
+static double virtual_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void virtual_sleep(double seconds)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)seconds;
+	ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static void virtual_raw_table(uint16_t *raw)
+{
+	int mm;
+	raw[0] = FREENECT_DEPTH_RAW_NO_VALUE;
+	for (mm = 1; mm <= VIRTUAL_MAX_MM; mm++) {
+		if (mm < VIRTUAL_MIN_MM) {
+			raw[mm] = FREENECT_DEPTH_RAW_NO_VALUE;
+			continue;
+		}
+		// solve freenect_raw_to_mm for raw
+		double d = mm / 10.0;
+		double metric = (d - VIRTUAL_REFERENCE_DIST) * VIRTUAL_EMITTER_DIST / d;
+		double shift = (metric / VIRTUAL_PIXEL_SIZE + 0.375) * 4 + 4 * VIRTUAL_CONST_SHIFT;
+		int value = (int)(shift + 0.5);
+		raw[mm] = value < 0 ? 0 : value >= FREENECT_DEPTH_RAW_NO_VALUE ? FREENECT_DEPTH_RAW_NO_VALUE : value;
+	}
+}
+
+// pixel to camera ray with unit depth, the projection freenect_camera_to_world inverts
+static inline void virtual_ray(int x, int y, float *ray)
+{
+	const float scale = 2 * VIRTUAL_PIXEL_SIZE / VIRTUAL_REFERENCE_DIST;
+	ray[0] = (x - VIRTUAL_WIDTH / 2 + 0.5f) * scale;
+	ray[1] = (y - VIRTUAL_HEIGHT / 2 + 0.5f) * scale;
+	ray[2] = 1;
+}
+
+static inline void virtual_rotate(const float *m, const float *v, float *out)
+{
+	out[0] = m[0] * v[0] + m[1] * v[1] + m[2] * v[2];
+	out[1] = m[3] * v[0] + m[4] * v[1] + m[5] * v[2];
+	out[2] = m[6] * v[0] + m[7] * v[1] + m[8] * v[2];
+}
+
+// distance along dir to where it leaves the room, the origin is inside
+static float virtual_room_exit(const float *origin, const float *dir)
+{
+	int i;
+	float t = INFINITY;
+	for (i = 0; i < 3; i++) {
+		float exit;
+		if (dir[i] > 0)
+			exit = (room_max[i] - origin[i]) / dir[i];
+		else if (dir[i] < 0)
+			exit = (room_min[i] - origin[i]) / dir[i];
+		else
+			continue;
+		if (exit < t)
+			t = exit;
+	}
+	return t;
+}
+
+// distance along dir to where it enters the box, INFINITY if it misses
+static float virtual_box_entry(const virtual_box *box, const float *origin, const float *dir)
+{
+	int i;
+	float near = -INFINITY, far = INFINITY;
+	for (i = 0; i < 3; i++) {
+		if (dir[i] == 0) {
+			if (origin[i] < box->min[i] || origin[i] > box->max[i])
+				return INFINITY;
+			continue;
+		}
+		float t0 = (box->min[i] - origin[i]) / dir[i];
+		float t1 = (box->max[i] - origin[i]) / dir[i];
+		if (t0 > t1) {
+			float t = t0;
+			t0 = t1;
+			t1 = t;
+		}
+		if (t0 > near)
+			near = t0;
+		if (t1 < far)
+			far = t1;
+	}
+	return near <= far && near > 0 ? near : INFINITY;
+}
+
+// with a ray of unit depth, the distance along it is the depth the camera reports
+static float virtual_sphere_entry(const float *center, float radius, const float *origin, const float *dir)
+{
+	float oc[3] = { origin[0] - center[0], origin[1] - center[1], origin[2] - center[2] };
+	float a = dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2];
+	float b = oc[0] * dir[0] + oc[1] * dir[1] + oc[2] * dir[2];
+	float c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - radius * radius;
+	float disc = b * b - a * c;
+	if (disc < 0)
+		return INFINITY;
+	float t = (-b - sqrtf(disc)) / a;
+	return t > 0 ? t : INFINITY;
+}
+
+static void virtual_sphere_center(const virtual_sphere *sphere, double time, float *center)
+{
+	float angle = sphere->phase + sphere->speed * time;
+	center[0] = sphere->orbit * cosf(angle);
+	center[1] = sphere->height + sphere->bob * sinf(2 * angle);
+	center[2] = sphere->orbit * sinf(angle);
+}
+
+static inline uint16_t virtual_depth(float t)
+{
+	return t < VIRTUAL_MAX_MM ? (uint16_t)(t + 0.5f) : 0;
+}
+
+static void virtual_pack_row(const virtual_state *state, const uint16_t *mm, uint8_t *packed)
+{
+	int x;
+	for (x = 0; x < VIRTUAL_WIDTH; x += 8, mm += 8, packed += 11) {
+		uint16_t v[8];
+		int i;
+		for (i = 0; i < 8; i++)
+			v[i] = state->raw[mm[i]];
+		// most significant bit first, the layout convert_packed11_to_16bit takes apart
+		packed[0] = v[0] >> 3;
+		packed[1] = (v[0] << 5) | (v[1] >> 6);
+		packed[2] = (v[1] << 2) | (v[2] >> 9);
+		packed[3] = v[2] >> 1;
+		packed[4] = (v[2] << 7) | (v[3] >> 4);
+		packed[5] = (v[3] << 4) | (v[4] >> 7);
+		packed[6] = (v[4] << 1) | (v[5] >> 10);
+		packed[7] = v[5] >> 2;
+		packed[8] = (v[5] << 6) | (v[6] >> 5);
+		packed[9] = (v[6] << 3) | (v[7] >> 8);
+		packed[10] = v[7];
+	}
+}
+
+static void virtual_render_background(virtual_state *state, virtual_device *device)
+{
+	int x, y, i;
+	const float origin[3] = { device->pose.x, device->pose.y, device->pose.z };
+	for (y = 0; y < VIRTUAL_HEIGHT; y++) {
+		uint16_t *row = device->background + y * VIRTUAL_WIDTH;
+		for (x = 0; x < VIRTUAL_WIDTH; x++) {
+			float ray[3], dir[3];
+			virtual_ray(x, y, ray);
+			virtual_rotate(device->rotation, ray, dir);
+			float t = virtual_room_exit(origin, dir);
+			for (i = 0; i < VIRTUAL_BOXES; i++) {
+				float hit = virtual_box_entry(boxes + i, origin, dir);
+				if (hit < t)
+					t = hit;
+			}
+			row[x] = virtual_depth(t);
+		}
+		virtual_pack_row(state, row, device->background_packed + y * VIRTUAL_ROW_BYTES);
+	}
+	memcpy(device->packed, device->background_packed, VIRTUAL_FRAME_BYTES);
+	device->dirty_first = VIRTUAL_HEIGHT;
+	device->dirty_last = -1;
+}
+
+// bounds of x / z over the sphere, for one image axis
+static void virtual_sphere_extent(float c, float z, float radius, float *lo, float *hi)
+{
+	float znear = z - radius, zfar = z + radius;
+	*lo = c - radius <= 0 ? (c - radius) / znear : (c - radius) / zfar;
+	*hi = c + radius >= 0 ? (c + radius) / znear : (c + radius) / zfar;
+}
+
+// frame n: the background with the spheres where they are at time n / 30
+static void virtual_render_frame(virtual_state *state, virtual_device *device, uint64_t frame)
+{
+	const float scale = 2 * VIRTUAL_PIXEL_SIZE / VIRTUAL_REFERENCE_DIST;
+	const float origin[3] = { device->pose.x, device->pose.y, device->pose.z };
+	double time = (double)frame / VIRTUAL_FRAME_RATE;
+	int i, x, y;
+	if (device->dirty_first <= device->dirty_last)
+		memcpy(device->packed + device->dirty_first * VIRTUAL_ROW_BYTES, device->background_packed + device->dirty_first * VIRTUAL_ROW_BYTES, (device->dirty_last - device->dirty_first + 1) * VIRTUAL_ROW_BYTES);
+	device->dirty_first = VIRTUAL_HEIGHT;
+	device->dirty_last = -1;
+	float centers[VIRTUAL_SPHERES][3];
+	int x0[VIRTUAL_SPHERES], x1[VIRTUAL_SPHERES], y0[VIRTUAL_SPHERES], y1[VIRTUAL_SPHERES];
+	for (i = 0; i < VIRTUAL_SPHERES; i++) {
+		virtual_sphere_center(spheres + i, time, centers[i]);
+		// into camera space, the rotation is orthonormal so its transpose inverts it
+		float d[3] = { centers[i][0] - origin[0], centers[i][1] - origin[1], centers[i][2] - origin[2] };
+		const float *m = device->rotation;
+		float c[3] = {
+			m[0] * d[0] + m[3] * d[1] + m[6] * d[2],
+			m[1] * d[0] + m[4] * d[1] + m[7] * d[2],
+			m[2] * d[0] + m[5] * d[1] + m[8] * d[2],
+		};
+		float radius = spheres[i].radius;
+		x0[i] = y0[i] = 0;
+		x1[i] = VIRTUAL_WIDTH - 1;
+		y1[i] = VIRTUAL_HEIGHT - 1;
+		if (c[2] + radius <= 0) {
+			y0[i] = VIRTUAL_HEIGHT; // behind the camera
+			continue;
+		}
+		if (c[2] - radius > 1) {
+			float lo, hi;
+			virtual_sphere_extent(c[0], c[2], radius, &lo, &hi);
+			x0[i] = (int)floorf(lo / scale + VIRTUAL_WIDTH / 2 - 0.5f);
+			x1[i] = (int)ceilf(hi / scale + VIRTUAL_WIDTH / 2 - 0.5f);
+			virtual_sphere_extent(c[1], c[2], radius, &lo, &hi);
+			y0[i] = (int)floorf(lo / scale + VIRTUAL_HEIGHT / 2 - 0.5f);
+			y1[i] = (int)ceilf(hi / scale + VIRTUAL_HEIGHT / 2 - 0.5f);
+			x0[i] = x0[i] < 0 ? 0 : x0[i];
+			x1[i] = x1[i] >= VIRTUAL_WIDTH ? VIRTUAL_WIDTH - 1 : x1[i];
+			y0[i] = y0[i] < 0 ? 0 : y0[i];
+			y1[i] = y1[i] >= VIRTUAL_HEIGHT ? VIRTUAL_HEIGHT - 1 : y1[i];
+		}
+	}
+	for (y = 0; y < VIRTUAL_HEIGHT; y++) {
+		uint16_t row[VIRTUAL_WIDTH];
+		int covered = 0;
+		for (i = 0; i < VIRTUAL_SPHERES; i++) {
+			if (y < y0[i] || y > y1[i] || x0[i] > x1[i])
+				continue;
+			if (!covered)
+				memcpy(row, device->background + y * VIRTUAL_WIDTH, sizeof(row));
+			covered = 1;
+			for (x = x0[i]; x <= x1[i]; x++) {
+				float ray[3], dir[3];
+				virtual_ray(x, y, ray);
+				virtual_rotate(device->rotation, ray, dir);
+				float t = virtual_sphere_entry(centers[i], spheres[i].radius, origin, dir);
+				uint16_t mm = virtual_depth(t);
+				if (mm && (!row[x] || mm < row[x]))
+					row[x] = mm;
+			}
+		}
+		if (!covered)
+			continue;
+		virtual_pack_row(state, row, device->packed + y * VIRTUAL_ROW_BYTES);
+		if (y < device->dirty_first)
+			device->dirty_first = y;
+		device->dirty_last = y;
+	}
+}
+
+static int virtual_num_devices(void *state)
+{
+	return ((virtual_state*)state)->count;
+}
+
+static int virtual_describe(void *state, int index, fnusb_device_info *info)
+{
+	if (index < 0 || index >= ((virtual_state*)state)->count)
+		return -1;
+	memset(info, 0, sizeof(*info));
+	info->bus = 1 + index / 2; // two cameras to a bus, so sharding by bus has something to do
+	info->hwrev = HWREV_XBOX360_0;
+	snprintf(info->serial, sizeof(info->serial), "VIRTUAL%04d", index);
+	return 0;
+}
+
+static void virtual_start(virtual_state *state, virtual_device *device)
+{
+	if (!device->background) {
+		device->background = (uint16_t*)malloc(sizeof(uint16_t) * VIRTUAL_WIDTH * VIRTUAL_HEIGHT);
+		device->background_packed = (uint8_t*)malloc(VIRTUAL_FRAME_BYTES);
+		device->packed = (uint8_t*)malloc(VIRTUAL_FRAME_BYTES);
+		virtual_render_background(state, device);
+	}
+	device->slot = 0;
+	device->start = virtual_time();
+	// the event thread picks the stream up once everything above is in place
+	__sync_synchronize();
+	device->streaming = 1;
+}
+
+// answers a command the way the camera does, see send_cmd
+static void virtual_command(virtual_state *state, virtual_device *device, const uint8_t *data, int len)
+{
+	uint16_t hdr[4], params[5] = { 0 };
+	if (len < (int)sizeof(hdr))
+		return;
+	memcpy(hdr, data, sizeof(hdr));
+	memcpy(params, data + sizeof(hdr), len - sizeof(hdr) < sizeof(params) ? len - sizeof(hdr) : sizeof(params));
+	uint16_t cmd = fn_le16(hdr[2]);
+	uint8_t *reply = device->reply + sizeof(hdr);
+	int reply_len = 2;
+	memset(device->reply, 0, sizeof(device->reply));
+	switch (cmd) {
+		case 0x03: // write register
+			if (fn_le16(params[0]) == 0x06) {
+				if (fn_le16(params[1]) == 0x02)
+					virtual_start(state, device);
+				else
+					device->streaming = 0;
+			}
+			break;
+		case 0x16: // algorithm parameters, registration info and pad info are left zeroed
+			switch (fn_le16(params[0])) {
+				case 0x40:
+					reply_len = 118;
+					break;
+				case 0x41:
+					reply_len = 8;
+					break;
+				case 0x00:
+				{
+					uint16_t shift = fn_le16(VIRTUAL_CONST_SHIFT);
+					reply_len = 4;
+					memcpy(reply + 2, &shift, sizeof(shift));
+					break;
+				}
+			}
+			break;
+		case 0x04: // fixed parameters, with the zero plane info at 94
+		{
+			float zero_plane[4] = { VIRTUAL_EMITTER_DIST, VIRTUAL_RCMOS_DIST, VIRTUAL_REFERENCE_DIST, VIRTUAL_PIXEL_SIZE };
+			int i;
+			for (i = 0; i < 4; i++) {
+				union {
+					uint32_t ui;
+					float f;
+				} conversion_union;
+				conversion_union.f = zero_plane[i];
+				conversion_union.ui = fn_le32(conversion_union.ui);
+				memcpy(reply + 94 + i * 4, &conversion_union.ui, 4);
+			}
+			reply_len = 322;
+			break;
+		}
+	}
+	uint16_t rhdr[4];
+	device->reply[0] = 0x52;
+	device->reply[1] = 0x42;
+	rhdr[1] = fn_le16(reply_len / 2);
+	rhdr[2] = hdr[2];
+	rhdr[3] = hdr[3];
+	memcpy(device->reply + 2, rhdr + 1, 6);
+	device->reply_len = sizeof(hdr) + reply_len;
+}
+
+static int virtual_control(void *state, fnusb_dev *dev, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t wLength)
+{
+	virtual_state *virt = (virtual_state*)state;
+	virtual_device *device = virt->devices + dev->index;
+	if (!(bmRequestType & LIBUSB_ENDPOINT_IN)) {
+		virtual_command(virt, device, data, wLength);
+		return wLength;
+	}
+	int len = device->reply_len < wLength ? device->reply_len : wLength;
+	memcpy(data, device->reply, len);
+	device->reply_len = 0;
+	return len;
+}
+
+// first microframe slot of a frame, frames don't line up with slots exactly
+static inline uint64_t virtual_frame_slot(uint64_t frame)
+{
+	return frame * VIRTUAL_SLOT_RATE / VIRTUAL_FRAME_RATE;
+}
+
+// fills one transfer's worth of packet slots, most are packets of the frame, the
+// slots left over until the next frame starts come back empty as they do from a device
+static void virtual_transfer(virtual_state *state, virtual_device *device, fnusb_isoc_stream *strm)
+{
+	int i, lens[strm->pkts];
+	for (i = 0; i < strm->pkts; i++, device->slot++) {
+		uint64_t frame = device->slot * VIRTUAL_FRAME_RATE / VIRTUAL_SLOT_RATE;
+		if (virtual_frame_slot(frame + 1) <= device->slot)
+			frame++;
+		uint64_t pkt = device->slot - virtual_frame_slot(frame);
+		lens[i] = 0;
+		if (pkt >= VIRTUAL_FRAME_PKTS)
+			continue;
+		if (pkt == 0)
+			virtual_render_frame(state, device, frame);
+		uint8_t *buf = strm->buffer + i * strm->len;
+		int offset = pkt * DEPTH_PKTDSIZE;
+		int datalen = VIRTUAL_FRAME_BYTES - offset < DEPTH_PKTDSIZE ? VIRTUAL_FRAME_BYTES - offset : DEPTH_PKTDSIZE;
+		uint32_t timestamp = fn_le32(device->clock_offset + (uint32_t)(uint64_t)(device->slot * (VIRTUAL_TICK_RATE / VIRTUAL_SLOT_RATE)));
+		buf[0] = 'R';
+		buf[1] = 'B';
+		buf[2] = 0;
+		buf[3] = pkt == 0 ? 0x71 : pkt == VIRTUAL_FRAME_PKTS - 1 ? 0x75 : 0x72;
+		buf[4] = 0;
+		buf[5] = device->seq++;
+		buf[6] = buf[7] = 0;
+		memcpy(buf + 8, &timestamp, 4);
+		memcpy(buf + 12, device->packed + offset, datalen);
+		lens[i] = 12 + datalen;
+	}
+	fnusb_deliver(strm, strm->buffer, lens, strm->pkts);
+}
+
+// sends the transfer that is due first among the streams running in this context
+static int virtual_process_events(void *state, fnusb_ctx *usb, struct timeval *timeout)
+{
+	virtual_state *virt = (virtual_state*)state;
+	double now = virtual_time();
+	double deadline = timeout ? now + timeout->tv_sec + timeout->tv_usec * 1e-6 : now + 0.01;
+	virtual_device *next = NULL;
+	fnusb_isoc_stream *next_strm = NULL;
+	double due = 0;
+	int i;
+	for (i = 0; i < virt->count; i++) {
+		virtual_device *device = virt->devices + i;
+		if (!device->streaming)
+			continue;
+		fnusb_isoc_stream *strm = fnusb_find_stream(usb, i, 0x82);
+		if (!strm)
+			continue;
+		// a transfer completes with its last packet slot
+		double complete = device->start + (double)(device->slot + strm->pkts) / VIRTUAL_SLOT_RATE;
+		if (!next || complete < due) {
+			next = device;
+			next_strm = strm;
+			due = complete;
+		}
+	}
+	if (!next) {
+		if (deadline > now)
+			virtual_sleep(deadline - now);
+		return 0;
+	}
+	if (virt->speed == FREENECT_REPLAY_REALTIME) {
+		if (due > deadline) {
+			if (deadline > now)
+				virtual_sleep(deadline - now);
+			return 0;
+		}
+		if (due > now)
+			virtual_sleep(due - now);
+	}
+	virtual_transfer(virt, next, next_strm);
+	return 0;
+}
+
+static void virtual_destroy(void *state)
+{
+	virtual_state *virt = (virtual_state*)state;
+	int i;
+	for (i = 0; i < virt->count; i++) {
+		free(virt->devices[i].background);
+		free(virt->devices[i].background_packed);
+		free(virt->devices[i].packed);
+	}
+	free(virt);
+}
+
+static const fnusb_backend virtual_backend = {
+	virtual_num_devices,
+	virtual_describe,
+	virtual_control,
+	virtual_process_events,
+	virtual_destroy,
+};
+
+int fnusb_init_virtual(fnusb_ctx *ctx, int count, const freenect_virtual_pose *poses, freenect_replay_speed speed)
+{
+	if (count < 1 || count > FREENECT_VIRTUAL_MAX_DEVICES)
+		return -1;
+	virtual_state *virt = (virtual_state*)malloc(sizeof(virtual_state) + sizeof(virtual_device) * count);
+	memset(virt, 0, sizeof(virtual_state) + sizeof(virtual_device) * count);
+	virt->count = count;
+	virt->speed = speed;
+	virtual_raw_table(virt->raw);
+	int i;
+	for (i = 0; i < count; i++) {
+		virtual_device *device = virt->devices + i;
+		if (poses) {
+			device->pose = poses[i];
+		} else {
+			// all at the center of the room, 60 degrees apart like the six camera rig
+			device->pose.pitch = i * M_PI / 3;
+		}
+		// rotation about x by yaw, then about y by pitch
+		float sy = sinf(device->pose.yaw), cy = cosf(device->pose.yaw);
+		float sp = sinf(device->pose.pitch), cp = cosf(device->pose.pitch);
+		float rotation[9] = {
+			cp, sy * sp, cy * sp,
+			0, cy, -sy,
+			-sp, sy * cp, cy * cp,
+		};
+		memcpy(device->rotation, rotation, sizeof(rotation));
+		// devices' clocks aren't in step
+		device->clock_offset = (uint32_t)(i * 0x9e3779b9u);
+	}
+
+	ctx->ctx = NULL;
+	ctx->should_free_ctx = 0;
+	ctx->backend = &virtual_backend;
+	ctx->backend_state = virt;
+	return 0;
+}